@@ -0,0 +1,479 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) by Ronnie Sahlberg <ronniesahlberg@gmail.com> 2013
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Workload driver for the fuse-nfs benchmarks. Runs a fixed set of
+ * data and metadata workloads inside a directory, normally on a fuse-nfs
+ * mount, and prints one result per workload as JSON or CSV.
+ * bench/run.sh sets up the server and the mount and then calls this.
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+struct result {
+	const char *name;
+	size_t bs;
+	uint64_t ops;
+	uint64_t bytes;
+	uint64_t elapsed;	/* ns */
+	uint64_t *lat;		/* ns per operation */
+	uint64_t max_ops;	/* size of lat[] */
+};
+
+static const char *dir;
+static uint64_t file_size = 64 * 1024 * 1024;
+static int num_files = 2000;
+static int num_dirents = 10000;
+static int rand_ops = 2000;
+static int csv;
+static FILE *out;
+static int num_results;
+
+static uint64_t
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+die(const char *what, const char *path)
+{
+	fprintf(stderr, "fuse-nfs-bench: %s %s: %s\n", what, path,
+		strerror(errno));
+	exit(1);
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double
+percentile(struct result *r, double p)
+{
+	uint64_t i;
+
+	if (r->ops == 0) {
+		return 0;
+	}
+	i = (uint64_t)(p * (r->ops - 1) + 0.5);
+	return r->lat[i] / 1000.0;
+}
+
+static void
+result_start(struct result *r, const char *name, size_t bs, uint64_t max_ops)
+{
+	memset(r, 0, sizeof(*r));
+	r->name = name;
+	r->bs = bs;
+	r->max_ops = max_ops ? max_ops : 1;
+	r->lat = malloc(r->max_ops * sizeof(uint64_t));
+	if (r->lat == NULL) {
+		fprintf(stderr, "fuse-nfs-bench: out of memory\n");
+		exit(1);
+	}
+}
+
+static void
+result_op(struct result *r, uint64_t start, uint64_t bytes)
+{
+	uint64_t elapsed = now() - start;
+
+	/* A directory left over from an earlier run can hold more entries
+	 * than we expected.
+	 */
+	if (r->ops == r->max_ops) {
+		r->max_ops *= 2;
+		r->lat = realloc(r->lat, r->max_ops * sizeof(uint64_t));
+		if (r->lat == NULL) {
+			fprintf(stderr, "fuse-nfs-bench: out of memory\n");
+			exit(1);
+		}
+	}
+	r->lat[r->ops++] = elapsed;
+	r->bytes += bytes;
+}
+
+static void
+result_end(struct result *r, uint64_t start)
+{
+	double secs;
+
+	r->elapsed = now() - start;
+	secs = r->elapsed / 1e9;
+	qsort(r->lat, r->ops, sizeof(uint64_t), cmp_u64);
+
+	if (csv) {
+		if (num_results == 0) {
+			fprintf(out, "workload,bs,ops,bytes,seconds,ops_per_sec,"
+				"mb_per_sec,p50_us,p99_us,p999_us\n");
+		}
+		fprintf(out, "%s,%zu,%llu,%llu,%.6f,%.1f,%.2f,%.1f,%.1f,%.1f\n",
+			r->name, r->bs, (unsigned long long)r->ops,
+			(unsigned long long)r->bytes, secs, r->ops / secs,
+			r->bytes / secs / 1e6, percentile(r, 0.5),
+			percentile(r, 0.99), percentile(r, 0.999));
+	} else {
+		fprintf(out, "%s\n    {\"workload\": \"%s\", \"bs\": %zu, "
+			"\"ops\": %llu, \"bytes\": %llu, \"seconds\": %.6f, "
+			"\"ops_per_sec\": %.1f, \"mb_per_sec\": %.2f, "
+			"\"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f}",
+			num_results ? "," : "[",
+			r->name, r->bs, (unsigned long long)r->ops,
+			(unsigned long long)r->bytes, secs, r->ops / secs,
+			r->bytes / secs / 1e6, percentile(r, 0.5),
+			percentile(r, 0.99), percentile(r, 0.999));
+	}
+	fflush(out);
+	num_results++;
+	free(r->lat);
+}
+
+/* Make sure the next pass has to go through fuse-nfs again instead of
+ * being served from the kernel page cache.
+ */
+static void
+drop_cache(int fd)
+{
+	fsync(fd);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+static void
+bench_seq(const char *path, size_t bs, int do_write)
+{
+	struct result r;
+	uint64_t start, t, off;
+	char *buf;
+	int fd;
+	ssize_t n;
+
+	fd = open(path, do_write ? O_WRONLY|O_CREAT|O_TRUNC : O_RDONLY, 0644);
+	if (fd == -1) {
+		die("open", path);
+	}
+	buf = malloc(bs);
+	memset(buf, 0xa5, bs);
+	drop_cache(fd);
+
+	result_start(&r, do_write ? "seq_write" : "seq_read", bs,
+		     file_size / bs + 1);
+	start = now();
+	for (off = 0; off < file_size; off += n) {
+		t = now();
+		n = do_write ? write(fd, buf, bs) : read(fd, buf, bs);
+		if (n <= 0) {
+			die(do_write ? "write" : "read", path);
+		}
+		result_op(&r, t, n);
+	}
+	if (do_write) {
+		/* The data is only on the server once fsync returns */
+		t = now();
+		if (fsync(fd) == -1) {
+			die("fsync", path);
+		}
+		result_op(&r, t, 0);
+	}
+	result_end(&r, start);
+
+	close(fd);
+	free(buf);
+}
+
+static void
+bench_rand(const char *path, size_t bs, int do_write)
+{
+	struct result r;
+	uint64_t start, t, off, blocks = file_size / bs;
+	char *buf;
+	int fd, i;
+
+	fd = open(path, do_write ? O_WRONLY : O_RDONLY);
+	if (fd == -1) {
+		die("open", path);
+	}
+	buf = malloc(bs);
+	memset(buf, 0x5a, bs);
+	drop_cache(fd);
+	srandom(bs);
+
+	result_start(&r, do_write ? "rand_write" : "rand_read", bs,
+		     rand_ops + 1);
+	start = now();
+	for (i = 0; i < rand_ops; i++) {
+		off = ((uint64_t)random() % blocks) * bs;
+		t = now();
+		if ((do_write ? pwrite(fd, buf, bs, off) :
+		     pread(fd, buf, bs, off)) != (ssize_t)bs) {
+			die(do_write ? "pwrite" : "pread", path);
+		}
+		result_op(&r, t, bs);
+	}
+	if (do_write) {
+		t = now();
+		if (fsync(fd) == -1) {
+			die("fsync", path);
+		}
+		result_op(&r, t, 0);
+	}
+	result_end(&r, start);
+
+	close(fd);
+	free(buf);
+}
+
+static void
+bench_meta(const char *sub)
+{
+	struct result r;
+	struct stat st;
+	uint64_t start, t;
+	char path[PATH_MAX];
+	int i, fd;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, sub);
+	if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+		die("mkdir", path);
+	}
+
+	result_start(&r, "create", 0, num_files);
+	start = now();
+	for (i = 0; i < num_files; i++) {
+		snprintf(path, sizeof(path), "%s/%s/f%d", dir, sub, i);
+		t = now();
+		fd = open(path, O_WRONLY|O_CREAT|O_EXCL, 0644);
+		if (fd == -1) {
+			die("create", path);
+		}
+		close(fd);
+		result_op(&r, t, 0);
+	}
+	result_end(&r, start);
+
+	result_start(&r, "stat", 0, num_files);
+	start = now();
+	for (i = 0; i < num_files; i++) {
+		snprintf(path, sizeof(path), "%s/%s/f%d", dir, sub, i);
+		t = now();
+		if (stat(path, &st) == -1) {
+			die("stat", path);
+		}
+		result_op(&r, t, 0);
+	}
+	result_end(&r, start);
+
+	result_start(&r, "stat_missing", 0, num_files);
+	start = now();
+	for (i = 0; i < num_files; i++) {
+		snprintf(path, sizeof(path), "%s/%s/missing%d", dir, sub, i);
+		t = now();
+		if (stat(path, &st) == 0 || errno != ENOENT) {
+			die("stat", path);
+		}
+		result_op(&r, t, 0);
+	}
+	result_end(&r, start);
+
+	result_start(&r, "unlink", 0, num_files);
+	start = now();
+	for (i = 0; i < num_files; i++) {
+		snprintf(path, sizeof(path), "%s/%s/f%d", dir, sub, i);
+		t = now();
+		if (unlink(path) == -1) {
+			die("unlink", path);
+		}
+		result_op(&r, t, 0);
+	}
+	result_end(&r, start);
+
+	snprintf(path, sizeof(path), "%s/%s", dir, sub);
+	rmdir(path);
+}
+
+static void
+bench_dir(const char *sub)
+{
+	struct result r;
+	struct dirent *de;
+	struct stat st;
+	DIR *d;
+	uint64_t start, t;
+	char path[PATH_MAX];
+	int i, fd;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, sub);
+	if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+		die("mkdir", path);
+	}
+	for (i = 0; i < num_dirents; i++) {
+		snprintf(path, sizeof(path), "%s/%s/entry-%08d", dir, sub, i);
+		fd = open(path, O_WRONLY|O_CREAT, 0644);
+		if (fd == -1) {
+			die("create", path);
+		}
+		close(fd);
+	}
+	snprintf(path, sizeof(path), "%s/%s", dir, sub);
+
+	/* One operation per directory entry returned */
+	result_start(&r, "readdir", 0, num_dirents + 2);
+	start = now();
+	d = opendir(path);
+	if (d == NULL) {
+		die("opendir", path);
+	}
+	t = now();
+	while ((de = readdir(d)) != NULL) {
+		result_op(&r, t, 0);
+		t = now();
+	}
+	closedir(d);
+	result_end(&r, start);
+
+	/* ls -l: readdir followed by an lstat of every entry */
+	result_start(&r, "ls_l", 0, num_dirents + 2);
+	start = now();
+	d = opendir(path);
+	if (d == NULL) {
+		die("opendir", path);
+	}
+	while ((de = readdir(d)) != NULL) {
+		t = now();
+		if (fstatat(dirfd(d), de->d_name, &st,
+			    AT_SYMLINK_NOFOLLOW) == -1) {
+			die("lstat", de->d_name);
+		}
+		result_op(&r, t, 0);
+	}
+	closedir(d);
+	result_end(&r, start);
+
+	for (i = 0; i < num_dirents; i++) {
+		snprintf(path, sizeof(path), "%s/%s/entry-%08d", dir, sub, i);
+		unlink(path);
+	}
+	snprintf(path, sizeof(path), "%s/%s", dir, sub);
+	rmdir(path);
+}
+
+static void
+print_usage(char *name)
+{
+	fprintf(stderr, "Usage: %s [-?|--help] [-f json|csv|--format=json|csv] "
+		"[-o FILE|--output=FILE] [-s BYTES|--size=BYTES] "
+		"[-n N|--files=N] [-e N|--dirents=N] [-r N|--rand_ops=N] "
+		"DIRECTORY\n", name);
+	exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+	static const size_t seq_bs[] = { 4096, 65536, 1048576 };
+	static const size_t rand_bs[] = { 4096, 65536 };
+	char path[PATH_MAX];
+	int c;
+	unsigned i;
+
+	static struct option long_opts[] = {
+		{ "help", no_argument, 0, '?' },
+		{ "format", required_argument, 0, 'f' },
+		{ "output", required_argument, 0, 'o' },
+		{ "size", required_argument, 0, 's' },
+		{ "files", required_argument, 0, 'n' },
+		{ "dirents", required_argument, 0, 'e' },
+		{ "rand_ops", required_argument, 0, 'r' },
+		{ NULL, 0, 0, 0 }
+	};
+
+	out = stdout;
+	while ((c = getopt_long(argc, argv, "?f:o:s:n:e:r:", long_opts,
+				NULL)) != -1) {
+		switch (c) {
+		case 'f':
+			csv = !strcmp(optarg, "csv");
+			break;
+		case 'o':
+			out = fopen(optarg, "w");
+			if (out == NULL) {
+				die("open", optarg);
+			}
+			break;
+		case 's':
+			file_size = strtoull(optarg, NULL, 0);
+			break;
+		case 'n':
+			num_files = atoi(optarg);
+			break;
+		case 'e':
+			num_dirents = atoi(optarg);
+			break;
+		case 'r':
+			rand_ops = atoi(optarg);
+			break;
+		default:
+			print_usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || file_size < seq_bs[2]) {
+		print_usage(argv[0]);
+	}
+	dir = argv[optind];
+
+	snprintf(path, sizeof(path), "%s/bench-data", dir);
+	for (i = 0; i < sizeof(seq_bs) / sizeof(seq_bs[0]); i++) {
+		bench_seq(path, seq_bs[i], 1);
+		bench_seq(path, seq_bs[i], 0);
+	}
+	for (i = 0; i < sizeof(rand_bs) / sizeof(rand_bs[0]); i++) {
+		bench_rand(path, rand_bs[i], 0);
+		bench_rand(path, rand_bs[i], 1);
+	}
+	unlink(path);
+
+	bench_meta("bench-meta");
+	bench_dir("bench-dir");
+
+	if (!csv && num_results) {
+		fprintf(out, "\n]\n");
+	}
+	if (out != stdout) {
+		fclose(out);
+	}
+	return 0;
+}
@@ -0,0 +1,43 @@
+#!/bin/sh
+#
+# Measure how many CPU cycles fuse-nfs spends per byte for a sequential
+# read of FILE, which must live on a fuse-nfs mount.
+#
+#   read-cpb.sh FILE [BLOCKSIZE]
+#
+# Needs perf. Run as root so the page cache can be dropped first,
+# otherwise the kernel may serve the read without asking fuse-nfs.
+
+FILE=$1
+BS=${2:-1M}
+
+if [ -z "$FILE" ]; then
+	echo "Usage: $0 FILE [BLOCKSIZE]"
+	exit 1
+fi
+
+PID=$(pgrep -o -x fuse-nfs)
+if [ -z "$PID" ]; then
+	echo "fuse-nfs is not running"
+	exit 1
+fi
+
+SIZE=$(stat -c %s "$FILE") || exit 1
+
+sync
+[ "$(id -u)" = 0 ] && echo 3 > /proc/sys/vm/drop_caches
+
+OUT=$(mktemp)
+perf stat -x, -o "$OUT" -e cycles -p "$PID" -- \
+	dd if="$FILE" of=/dev/null bs="$BS" 2>/dev/null
+CYCLES=$(awk -F, '/cycles/ { print $1 }' "$OUT")
+rm -f "$OUT"
+
+if [ -z "$CYCLES" ]; then
+	echo "perf did not report any cycles"
+	exit 1
+fi
+
+echo "bytes:       $SIZE"
+echo "cycles:      $CYCLES"
+echo "cycles/byte: $(echo "$CYCLES $SIZE" | awk '{ printf "%.3f", $1 / $2 }')"
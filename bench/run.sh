@@ -0,0 +1,86 @@
+#!/bin/sh
+#
+# Run the fuse-nfs benchmark suite against a throwaway NFS server on
+# loopback.
+#
+#   run.sh FUSE_NFS BENCH [BENCH OPTIONS]
+#
+# FUSE_NFS is the fuse-nfs binary to test and BENCH the workload driver,
+# bench/fuse-nfs-bench. Results go to stdout, as JSON unless -f csv is
+# passed on to the driver.
+#
+# The server is unfsd from unfs3, which runs as a normal user and does not
+# need a portmapper. Environment:
+#
+#   NFS_URL        benchmark this export instead of starting unfsd
+#   NFS_PORT       port unfsd listens on for NFS and MOUNT (default 20490)
+#   FUSE_NFS_OPTS  extra fuse-nfs options, e.g. "--attr_cache_ttl=1"
+
+FUSE_NFS=$1
+BENCH=$2
+if [ -z "$FUSE_NFS" ] || [ -z "$BENCH" ]; then
+	echo "Usage: $0 FUSE_NFS BENCH [BENCH OPTIONS]" >&2
+	exit 1
+fi
+shift 2
+
+NFS_PORT=${NFS_PORT:-20490}
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/fuse-nfs-bench.XXXXXX") || exit 1
+UNFSD_PID=
+MOUNTED=
+
+cleanup() {
+	if [ -n "$MOUNTED" ] && ! fusermount -u "$WORK/mnt"; then
+		echo "could not unmount $WORK/mnt, leaving $WORK in place" >&2
+		[ -n "$UNFSD_PID" ] && kill "$UNFSD_PID" 2>/dev/null
+		return
+	fi
+	[ -n "$UNFSD_PID" ] && kill "$UNFSD_PID" 2>/dev/null
+	# Never recurse into what may still be a mount
+	rmdir "$WORK/mnt" 2>/dev/null
+	if [ -d "$WORK/mnt" ]; then
+		echo "$WORK/mnt is not empty, leaving $WORK in place" >&2
+		return
+	fi
+	rm -rf "$WORK"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+mkdir "$WORK/export" "$WORK/mnt" || exit 1
+
+if [ -z "$NFS_URL" ]; then
+	if ! command -v unfsd >/dev/null 2>&1; then
+		echo "unfsd not found, install unfs3 or set NFS_URL" >&2
+		exit 1
+	fi
+	echo "$WORK/export 127.0.0.1(rw,insecure,no_root_squash)" \
+		> "$WORK/exports"
+	unfsd -d -p -t -u -e "$WORK/exports" \
+		-n "$NFS_PORT" -m "$NFS_PORT" >"$WORK/unfsd.log" 2>&1 &
+	UNFSD_PID=$!
+	sleep 1
+	if ! kill -0 "$UNFSD_PID" 2>/dev/null; then
+		echo "unfsd failed to start:" >&2
+		cat "$WORK/unfsd.log" >&2
+		exit 1
+	fi
+	NFS_URL="nfs://127.0.0.1$WORK/export?nfsport=$NFS_PORT&mountport=$NFS_PORT"
+fi
+
+# shellcheck disable=SC2086
+"$FUSE_NFS" -n "$NFS_URL" -m "$WORK/mnt" $FUSE_NFS_OPTS || exit 1
+MOUNTED=1
+
+# fuse-nfs daemonizes before the mount is ready
+i=0
+while ! mountpoint -q "$WORK/mnt"; do
+	i=$((i + 1))
+	if [ $i -gt 50 ]; then
+		echo "fuse-nfs did not mount $NFS_URL" >&2
+		exit 1
+	fi
+	sleep 0.1
+done
+
+"$BENCH" "$@" "$WORK/mnt"
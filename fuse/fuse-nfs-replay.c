@@ -0,0 +1,633 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) by Ronnie Sahlberg <ronniesahlberg@gmail.com> 2013
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Replays a trace recorded with fuse-nfs --trace_file against a mounted
+ * file system, as fast as possible or at the recorded pace, and reports
+ * the throughput and latency per operation.
+ *
+ * The operations of one recorded process are issued in order by one
+ * worker thread, processes are spread over --concurrency workers. Only
+ * --pace keeps the order between processes, as fast as possible a
+ * process may run ahead of the one that creates the files it uses.
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/fsuid.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/types.h>
+
+#include "fuse-nfs-trace.h"
+
+/* One record of the trace with its paths resolved below the mount */
+struct replay_op {
+	struct trace_record *rec;
+	char *path;
+	char *path2;
+	uint64_t sort;		/* when the operation takes effect */
+	int handle;		/* index into handles[], or -1 */
+	uint64_t latency;
+	int failed;
+};
+
+struct worker {
+	pthread_t thread;
+	struct replay_op **ops;
+	int num_ops;
+	char *buf;
+	size_t buf_size;
+};
+
+static const char *op_names[TRACE_NUM_OPS] = {
+	[TRACE_GETATTR]		= "getattr",
+	[TRACE_READLINK]	= "readlink",
+	[TRACE_OPENDIR]		= "opendir",
+	[TRACE_READDIR]		= "readdir",
+	[TRACE_RELEASEDIR]	= "releasedir",
+	[TRACE_OPEN]		= "open",
+	[TRACE_CREATE]		= "create",
+	[TRACE_READ]		= "read",
+	[TRACE_WRITE]		= "write",
+	[TRACE_FLUSH]		= "flush",
+	[TRACE_FSYNC]		= "fsync",
+	[TRACE_RELEASE]		= "release",
+	[TRACE_MKNOD]		= "mknod",
+	[TRACE_MKDIR]		= "mkdir",
+	[TRACE_UNLINK]		= "unlink",
+	[TRACE_RMDIR]		= "rmdir",
+	[TRACE_SYMLINK]		= "symlink",
+	[TRACE_RENAME]		= "rename",
+	[TRACE_LINK]		= "link",
+	[TRACE_CHMOD]		= "chmod",
+	[TRACE_CHOWN]		= "chown",
+	[TRACE_TRUNCATE]	= "truncate",
+	[TRACE_UTIME]		= "utime",
+	[TRACE_STATFS]		= "statfs",
+	[TRACE_FGETATTR]	= "fgetattr",
+	[TRACE_FTRUNCATE]	= "ftruncate",
+};
+
+static const char *mnt;
+static int concurrency = 1;
+static double speed;		/* 0: as fast as possible */
+static int as_caller;
+static uint64_t replay_start;
+static uint64_t trace_first;
+
+static struct replay_op *ops;
+static int num_ops;
+static int *handles;		/* open file descriptors */
+static int num_handles;
+
+static uint64_t
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static char *
+mnt_path(const char *path, int len)
+{
+	char *p;
+
+	if (asprintf(&p, "%s%.*s", mnt, len, path) < 0) {
+		fprintf(stderr, "fuse-nfs-replay: out of memory\n");
+		exit(1);
+	}
+	return p;
+}
+
+static int
+cmp_sort(const void *a, const void *b)
+{
+	const struct replay_op *x = a, *y = b;
+
+	if (x->sort != y->sort) {
+		return x->sort < y->sort ? -1 : 1;
+	}
+	/* Keep the recorded order for ties */
+	return x->rec < y->rec ? -1 : x->rec > y->rec;
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Maps the handles of the trace to slots in handles[]. The handle is
+ * whatever fuse-nfs kept in fi->fh and is reused once a file has been
+ * released, so an open starts a new slot and a release ends it.
+ */
+struct handle_map {
+	uint64_t handle;
+	int slot;
+};
+
+static int
+handle_slot(struct handle_map *map, size_t mask, uint64_t handle,
+	    int create, int remove)
+{
+	size_t i = (handle * 0x9e3779b97f4a7c15ULL >> 20) & mask;
+	int slot;
+
+	while (map[i].handle && map[i].handle != handle) {
+		i = (i + 1) & mask;
+	}
+	if (create) {
+		map[i].handle = handle;
+		map[i].slot = num_handles++;
+		return map[i].slot;
+	}
+	if (map[i].handle == 0) {
+		return -1;
+	}
+	slot = map[i].slot;
+	if (remove) {
+		/* Tombstone, keeps the probe chains intact */
+		map[i].slot = -1;
+	}
+	return slot;
+}
+
+static int
+load_trace(const char *file)
+{
+	struct trace_header *hdr;
+	struct trace_record *rec;
+	struct handle_map *map;
+	struct replay_op *op;
+	size_t size = 0, len, pos, mask;
+	char *data = NULL;
+	FILE *f;
+	int i, n;
+
+	f = fopen(file, "r");
+	if (f == NULL) {
+		return -1;
+	}
+	while (1) {
+		data = realloc(data, size + 1024 * 1024);
+		if (data == NULL) {
+			fclose(f);
+			return -1;
+		}
+		len = fread(data + size, 1, 1024 * 1024, f);
+		size += len;
+		if (len < 1024 * 1024) {
+			break;
+		}
+	}
+	fclose(f);
+
+	hdr = (struct trace_header *)data;
+	if (size < sizeof(*hdr) || hdr->magic != TRACE_MAGIC ||
+	    hdr->version != TRACE_VERSION) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Count first so that ops[] can point into data */
+	for (pos = sizeof(*hdr), n = 0; pos + sizeof(*rec) <= size; n++) {
+		rec = (struct trace_record *)(data + pos);
+		pos += sizeof(*rec) + rec->path_len + rec->path2_len;
+	}
+	ops = calloc(n, sizeof(struct replay_op));
+	if (ops == NULL) {
+		return -1;
+	}
+	for (pos = sizeof(*hdr), i = 0; i < n; i++) {
+		rec = (struct trace_record *)(data + pos);
+		pos += sizeof(*rec);
+		if (pos + rec->path_len + rec->path2_len > size ||
+		    rec->op == 0 || rec->op >= TRACE_NUM_OPS) {
+			break;
+		}
+		op = &ops[num_ops++];
+		op->rec = rec;
+		op->path = mnt_path(data + pos, rec->path_len);
+		pos += rec->path_len;
+		if (rec->op == TRACE_SYMLINK) {
+			/* The target is used as it was given */
+			op->path2 = strndup(data + pos, rec->path2_len);
+			pos += rec->path2_len;
+		} else if (rec->path2_len) {
+			op->path2 = mnt_path(data + pos, rec->path2_len);
+			pos += rec->path2_len;
+		}
+		/* A handle only exists once open has returned */
+		op->sort = rec->time;
+		if (rec->op == TRACE_OPEN || rec->op == TRACE_CREATE) {
+			op->sort += rec->duration;
+		}
+	}
+	if (num_ops == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	qsort(ops, num_ops, sizeof(struct replay_op), cmp_sort);
+	trace_first = ops[0].sort;
+
+	for (mask = 1; mask < (size_t)num_ops * 2; mask <<= 1)
+		;
+	map = calloc(mask, sizeof(struct handle_map));
+	if (map == NULL) {
+		return -1;
+	}
+	mask--;
+	for (i = 0; i < num_ops; i++) {
+		op = &ops[i];
+		op->handle = -1;
+		switch (op->rec->op) {
+		case TRACE_OPEN:
+		case TRACE_CREATE:
+			if (op->rec->handle) {
+				op->handle = handle_slot(map, mask, op->rec->handle,
+							 1, 0);
+			}
+			break;
+		case TRACE_READ:
+		case TRACE_WRITE:
+		case TRACE_FLUSH:
+		case TRACE_FSYNC:
+		case TRACE_FGETATTR:
+		case TRACE_FTRUNCATE:
+		case TRACE_RELEASE:
+			op->handle = handle_slot(map, mask, op->rec->handle, 0,
+						 op->rec->op == TRACE_RELEASE);
+			break;
+		}
+	}
+	free(map);
+
+	handles = malloc((num_handles + 1) * sizeof(int));
+	if (handles == NULL) {
+		return -1;
+	}
+	for (i = 0; i < num_handles; i++) {
+		handles[i] = -1;
+	}
+	return 0;
+}
+
+static void *
+worker_buf(struct worker *w, size_t size)
+{
+	if (size > w->buf_size) {
+		free(w->buf);
+		w->buf = calloc(1, size);
+		w->buf_size = w->buf ? size : 0;
+	}
+	return w->buf;
+}
+
+static int
+handle_fd(struct replay_op *op)
+{
+	if (op->handle < 0) {
+		return -1;
+	}
+	return __atomic_load_n(&handles[op->handle], __ATOMIC_ACQUIRE);
+}
+
+/* Issue one operation, returns -1 with errno set if it failed */
+static int
+replay_one(struct worker *w, struct replay_op *op)
+{
+	struct trace_record *rec = op->rec;
+	struct utimbuf times;
+	struct statvfs svfs;
+	struct stat st;
+	struct dirent *de;
+	DIR *dir;
+	char *buf;
+	int fd;
+
+	switch (rec->op) {
+	case TRACE_GETATTR:
+		return lstat(op->path, &st);
+	case TRACE_READLINK:
+		buf = worker_buf(w, PATH_MAX);
+		return readlink(op->path, buf, PATH_MAX) < 0 ? -1 : 0;
+	case TRACE_READDIR:
+		/* The continuation calls of a listing are part of ours */
+		if (rec->offset) {
+			return 0;
+		}
+		dir = opendir(op->path);
+		if (dir == NULL) {
+			return -1;
+		}
+		while ((de = readdir(dir)) != NULL)
+			;
+		return closedir(dir);
+	case TRACE_OPENDIR:
+	case TRACE_RELEASEDIR:
+	case TRACE_FLUSH:
+		return 0;
+	case TRACE_OPEN:
+	case TRACE_CREATE:
+		fd = open(op->path, rec->op == TRACE_CREATE ?
+			  (int)rec->flags | O_CREAT : (int)rec->flags,
+			  rec->mode);
+		if (fd == -1) {
+			return -1;
+		}
+		if (op->handle < 0) {
+			return close(fd);
+		}
+		__atomic_store_n(&handles[op->handle], fd, __ATOMIC_RELEASE);
+		return 0;
+	case TRACE_READ:
+		buf = worker_buf(w, rec->size);
+		fd = handle_fd(op);
+		if (fd == -1 || buf == NULL) {
+			errno = EBADF;
+			return -1;
+		}
+		return pread(fd, buf, rec->size, rec->offset) < 0 ? -1 : 0;
+	case TRACE_WRITE:
+		buf = worker_buf(w, rec->size);
+		fd = handle_fd(op);
+		if (fd == -1 || buf == NULL) {
+			errno = EBADF;
+			return -1;
+		}
+		return pwrite(fd, buf, rec->size, rec->offset) < 0 ? -1 : 0;
+	case TRACE_FSYNC:
+		fd = handle_fd(op);
+		if (fd == -1) {
+			errno = EBADF;
+			return -1;
+		}
+		return rec->flags ? fdatasync(fd) : fsync(fd);
+	case TRACE_FGETATTR:
+		fd = handle_fd(op);
+		if (fd == -1) {
+			errno = EBADF;
+			return -1;
+		}
+		return fstat(fd, &st);
+	case TRACE_FTRUNCATE:
+		fd = handle_fd(op);
+		if (fd == -1) {
+			errno = EBADF;
+			return -1;
+		}
+		return ftruncate(fd, rec->offset);
+	case TRACE_RELEASE:
+		if (op->handle < 0) {
+			return 0;
+		}
+		fd = __atomic_exchange_n(&handles[op->handle], -1,
+					 __ATOMIC_ACQ_REL);
+		return fd == -1 ? 0 : close(fd);
+	case TRACE_MKNOD:
+		return mknod(op->path, rec->mode, rec->size);
+	case TRACE_MKDIR:
+		return mkdir(op->path, rec->mode);
+	case TRACE_UNLINK:
+		return unlink(op->path);
+	case TRACE_RMDIR:
+		return rmdir(op->path);
+	case TRACE_SYMLINK:
+		return symlink(op->path2, op->path);
+	case TRACE_RENAME:
+		return rename(op->path, op->path2);
+	case TRACE_LINK:
+		return link(op->path, op->path2);
+	case TRACE_CHMOD:
+		return chmod(op->path, rec->mode);
+	case TRACE_CHOWN:
+		return lchown(op->path, rec->offset, rec->size);
+	case TRACE_TRUNCATE:
+		return truncate(op->path, rec->offset);
+	case TRACE_UTIME:
+		times.actime = rec->offset;
+		times.modtime = rec->size;
+		return utime(op->path, rec->flags ? NULL : &times);
+	case TRACE_STATFS:
+		return statvfs(op->path, &svfs);
+	}
+	return 0;
+}
+
+static void *
+worker_run(void *arg)
+{
+	struct worker *w = arg;
+	struct replay_op *op;
+	struct timespec ts;
+	uint64_t start, due;
+	int i;
+
+	for (i = 0; i < w->num_ops; i++) {
+		op = w->ops[i];
+		if (speed > 0) {
+			due = replay_start +
+				(uint64_t)((op->sort - trace_first) / speed);
+			ts.tv_sec = due / 1000000000ULL;
+			ts.tv_nsec = due % 1000000000ULL;
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+					       &ts, NULL) == EINTR)
+				;
+		}
+		if (as_caller) {
+			setfsgid(op->rec->gid);
+			setfsuid(op->rec->uid);
+		}
+		start = now();
+		op->failed = replay_one(w, op) != 0;
+		op->latency = now() - start;
+	}
+	free(w->buf);
+
+	return NULL;
+}
+
+static void
+report(uint64_t elapsed)
+{
+	uint64_t *lat, count, failed, bytes, total = 0, total_bytes = 0;
+	double secs = elapsed / 1e9;
+	int op, i;
+
+	lat = malloc(num_ops * sizeof(uint64_t));
+	if (lat == NULL) {
+		return;
+	}
+	printf("%-12s %10s %8s %16s %12s %12s %12s\n", "op", "count",
+	       "errors", "bytes", "p50(us)", "p99(us)", "p999(us)");
+	for (op = 1; op < TRACE_NUM_OPS; op++) {
+		for (count = failed = bytes = 0, i = 0; i < num_ops; i++) {
+			if (ops[i].rec->op != (uint32_t)op) {
+				continue;
+			}
+			lat[count++] = ops[i].latency;
+			failed += ops[i].failed;
+			if (op == TRACE_READ || op == TRACE_WRITE) {
+				bytes += ops[i].rec->size;
+			}
+		}
+		if (count == 0) {
+			continue;
+		}
+		qsort(lat, count, sizeof(uint64_t), cmp_u64);
+		printf("%-12s %10llu %8llu %16llu %12.1f %12.1f %12.1f\n",
+		       op_names[op], (unsigned long long)count,
+		       (unsigned long long)failed, (unsigned long long)bytes,
+		       lat[(count - 1) / 2] / 1000.0,
+		       lat[(uint64_t)((count - 1) * 0.99)] / 1000.0,
+		       lat[(uint64_t)((count - 1) * 0.999)] / 1000.0);
+		total += count;
+		total_bytes += bytes;
+	}
+	printf("\n%llu operations in %.3f seconds, %.1f ops/s, %.2f MB/s\n",
+	       (unsigned long long)total, secs, total / secs,
+	       total_bytes / secs / 1e6);
+	free(lat);
+}
+
+static void
+print_usage(char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [OPTIONS] TRACE MOUNTPOINT\n"
+		"\t [-?|--help] \n"
+		"\t [-c N|--concurrency=N] \n"
+		"\t\t Replay with N worker threads, default 1. The operations of\n"
+		"\t\t a recorded process always go to the same worker\n"
+		"\t [-p|--pace] \n"
+		"\t\t Issue operations at the pace they were recorded at instead\n"
+		"\t\t of as fast as possible\n"
+		"\t [-s FACTOR|--speed=FACTOR] \n"
+		"\t\t Like --pace but FACTOR times faster\n"
+		"\t [-u|--as_caller] \n"
+		"\t\t Issue every operation with the recorded uid and gid (root only)\n",
+		name);
+	exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+	struct worker *workers;
+	uint64_t elapsed;
+	int c, i, w;
+
+	static struct option long_opts[] = {
+		{ "help", no_argument, 0, '?' },
+		{ "concurrency", required_argument, 0, 'c' },
+		{ "pace", no_argument, 0, 'p' },
+		{ "speed", required_argument, 0, 's' },
+		{ "as_caller", no_argument, 0, 'u' },
+		{ NULL, 0, 0, 0 }
+	};
+
+	while ((c = getopt_long(argc, argv, "?c:ps:u", long_opts,
+				NULL)) != -1) {
+		switch (c) {
+		case 'c':
+			concurrency = atoi(optarg);
+			if (concurrency < 1) {
+				concurrency = 1;
+			}
+			break;
+		case 'p':
+			speed = 1;
+			break;
+		case 's':
+			speed = atof(optarg);
+			break;
+		case 'u':
+			as_caller = 1;
+			break;
+		default:
+			print_usage(argv[0]);
+		}
+	}
+	if (optind != argc - 2) {
+		print_usage(argv[0]);
+	}
+	mnt = argv[optind + 1];
+
+	if (load_trace(argv[optind]) != 0) {
+		fprintf(stderr, "Failed to load trace %s : %s\n",
+			argv[optind], strerror(errno));
+		return 10;
+	}
+
+	workers = calloc(concurrency, sizeof(struct worker));
+	if (workers == NULL) {
+		fprintf(stderr, "Failed to allocate workers\n");
+		return 10;
+	}
+	for (w = 0; w < concurrency; w++) {
+		workers[w].ops = malloc(num_ops * sizeof(struct replay_op *));
+		if (workers[w].ops == NULL) {
+			fprintf(stderr, "Failed to allocate workers\n");
+			return 10;
+		}
+	}
+	for (i = 0; i < num_ops; i++) {
+		w = ops[i].rec->pid % concurrency;
+		workers[w].ops[workers[w].num_ops++] = &ops[i];
+	}
+
+	replay_start = now();
+	for (w = 0; w < concurrency; w++) {
+		if (pthread_create(&workers[w].thread, NULL, worker_run,
+				   &workers[w]) != 0) {
+			fprintf(stderr, "Failed to start worker thread\n");
+			return 10;
+		}
+	}
+	for (w = 0; w < concurrency; w++) {
+		pthread_join(workers[w].thread, NULL);
+	}
+	elapsed = now() - replay_start;
+
+	for (i = 0; i < num_handles; i++) {
+		if (handles[i] != -1) {
+			close(handles[i]);
+		}
+	}
+	report(elapsed);
+
+	return 0;
+}
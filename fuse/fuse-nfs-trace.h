@@ -0,0 +1,90 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) by Ronnie Sahlberg <ronniesahlberg@gmail.com> 2013
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Format of the operation traces written by fuse-nfs --trace_file and
+ * read by fuse-nfs-replay.
+ *
+ * A trace is a struct trace_header followed by one struct trace_record
+ * per FUSE operation, each directly followed by path_len bytes of path
+ * and path2_len bytes of path2. Paths are not NUL terminated. Records
+ * are in the order the operations returned and in host byte order.
+ */
+#ifndef _FUSE_NFS_TRACE_H_
+#define _FUSE_NFS_TRACE_H_
+
+#include <stdint.h>
+
+#define TRACE_MAGIC	0x52544e46	/* "FNTR" */
+#define TRACE_VERSION	1
+
+/* Longer paths are truncated */
+#define TRACE_MAX_PATH	4096
+
+enum trace_op {
+	TRACE_GETATTR = 1,
+	TRACE_READLINK,
+	TRACE_OPENDIR,
+	TRACE_READDIR,
+	TRACE_RELEASEDIR,
+	TRACE_OPEN,		/* flags: open flags */
+	TRACE_CREATE,		/* flags: open flags, mode */
+	TRACE_READ,		/* offset, size */
+	TRACE_WRITE,		/* offset, size */
+	TRACE_FLUSH,
+	TRACE_FSYNC,		/* flags: datasync */
+	TRACE_RELEASE,
+	TRACE_MKNOD,		/* mode, size: rdev */
+	TRACE_MKDIR,		/* mode */
+	TRACE_UNLINK,
+	TRACE_RMDIR,
+	TRACE_SYMLINK,		/* path: the new link, path2: its target */
+	TRACE_RENAME,		/* path to path2 */
+	TRACE_LINK,		/* path2 becomes a new link to path */
+	TRACE_CHMOD,		/* mode */
+	TRACE_CHOWN,		/* offset: uid, size: gid */
+	TRACE_TRUNCATE,		/* offset: the new size */
+	TRACE_UTIME,		/* offset: atime, size: mtime, flags: 1 for now */
+	TRACE_STATFS,
+	TRACE_FGETATTR,
+	TRACE_FTRUNCATE,	/* offset: the new size */
+	TRACE_NUM_OPS
+};
+
+struct trace_header {
+	uint32_t magic;
+	uint32_t version;
+};
+
+struct trace_record {
+	uint64_t time;		/* ns from the start of the trace to the call */
+	uint64_t duration;	/* ns the call took */
+	uint64_t offset;
+	uint64_t size;
+	uint64_t handle;	/* identifies the open file, 0 for path ops */
+	uint32_t op;
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t pid;
+	uint32_t mode;
+	uint32_t flags;
+	uint16_t path_len;
+	uint16_t path2_len;
+	uint32_t pad;
+};
+
+#endif /* !_FUSE_NFS_TRACE_H_ */
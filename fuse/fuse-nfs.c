@@ -23,11 +23,15 @@
 #include "../config.h"
 
 #include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
 #include <getopt.h>
 #ifndef WIN32
 #include <poll.h>
@@ -35,7 +39,16 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_SYSMACROS_H
+#include <sys/sysmacros.h>
+#endif
+#include <time.h>
 #include <nfsc/libnfs.h>
+#include <nfsc/libnfs-raw.h>
+#include <nfsc/libnfs-raw-nfs.h>
+
+#include "fuse-nfs-trace.h"
 
 #ifdef WIN32
 #include <winsock2.h>
@@ -46,26 +59,746 @@
 #define FUSE_STAT stat
 #endif
 
-#define LOG(...) do {                                              \
-        if (logfile) {                                          \
-                FILE *fh = fopen(logfile, "a+");                \
-                time_t t = time(NULL);                          \
-                char tmp[256];                                  \
-                strftime(tmp, sizeof(tmp), "%T", localtime(&t));\
-                fprintf(fh, "[NFS] %s ", tmp);			\
-                fprintf(fh, __VA_ARGS__);                       \
-                fclose(fh);                                     \
+#ifndef makedev
+#define makedev(major, minor) ((((uint64_t)(major)) << 8) | (minor))
+#endif
+#ifndef major
+#define major(dev) (((uint64_t)(dev)) >> 8)
+#endif
+#ifndef minor
+#define minor(dev) ((dev) & 0xff)
+#endif
+
+/*
+ * Logging (-L logfile).
+ *
+ * LOG() must be cheap enough to leave in the read and write paths, so it
+ * only formats the message into a ring owned by the calling thread. A
+ * writer thread drains all the rings into the log file in batches. When
+ * a ring is full the message is dropped and counted rather than making
+ * the caller wait; the writer reports how many were lost.
+ *
+ * Messages above --log_level are skipped at runtime, and levels above
+ * LOG_MAX_LEVEL (see --disable-debug-log) are not compiled in at all.
+ */
+#define LOG_LEVEL_ERROR		0
+#define LOG_LEVEL_WARNING	1
+#define LOG_LEVEL_INFO		2
+#define LOG_LEVEL_DEBUG		3
+
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL		LOG_LEVEL_DEBUG
+#endif
+
+#define LOG_RING_SIZE		1024
+#define LOG_RECORD_SIZE		240
+
+#define LOG_AT(level, ...) do {                                    \
+        if ((level) <= LOG_MAX_LEVEL && logfile &&              \
+            (level) <= log_level) {                             \
+                log_write(__VA_ARGS__);                         \
         }                                                       \
-} while (0);
+} while (0)
+
+#define LOG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
 
 static char *logfile;
+static int log_level = LOG_LEVEL_DEBUG;
+
+struct log_record {
+	struct timespec ts;
+	char msg[LOG_RECORD_SIZE];
+};
+
+/* Single producer, the owning thread, and single consumer, the writer */
+struct log_ring {
+	struct log_ring *next;
+	int orphaned;
+	unsigned int head;
+	unsigned int tail;
+	struct log_record recs[LOG_RING_SIZE];
+};
+
+static __thread struct log_ring *log_thread_ring;
+static struct log_ring *log_rings;
+static pthread_mutex_t log_rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t log_flush_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t log_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t log_ring_key;
+static uint64_t log_dropped;
+static int log_fd = -1;
+
+static pthread_t log_thread;
+static int log_thread_running;
+static int log_thread_shutdown;
+
+/* The thread went away, the writer frees the ring once it is drained */
+static void
+log_ring_orphan(void *arg)
+{
+	struct log_ring *ring = arg;
+
+	__atomic_store_n(&ring->orphaned, 1, __ATOMIC_RELEASE);
+}
+
+static void
+log_key_create(void)
+{
+	pthread_key_create(&log_ring_key, log_ring_orphan);
+}
+
+static struct log_ring *
+log_ring_new(void)
+{
+	struct log_ring *ring;
+
+	ring = calloc(1, sizeof(struct log_ring));
+	if (ring == NULL) {
+		return NULL;
+	}
+	pthread_once(&log_key_once, log_key_create);
+	pthread_setspecific(log_ring_key, ring);
+
+	pthread_mutex_lock(&log_rings_mutex);
+	ring->next = log_rings;
+	log_rings = ring;
+	pthread_mutex_unlock(&log_rings_mutex);
+
+	log_thread_ring = ring;
+	return ring;
+}
+
+static void __attribute__((format(printf, 1, 2)))
+log_write(const char *fmt, ...)
+{
+	struct log_ring *ring = log_thread_ring;
+	struct log_record *rec;
+	unsigned int head;
+	va_list ap;
+
+	if (ring == NULL) {
+		ring = log_ring_new();
+		if (ring == NULL) {
+			__sync_fetch_and_add(&log_dropped, 1);
+			return;
+		}
+	}
+	head = ring->head;
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SIZE) {
+		__sync_fetch_and_add(&log_dropped, 1);
+		return;
+	}
+
+	rec = &ring->recs[head % LOG_RING_SIZE];
+	clock_gettime(CLOCK_REALTIME, &rec->ts);
+	va_start(ap, fmt);
+	vsnprintf(rec->msg, sizeof(rec->msg), fmt, ap);
+	va_end(ap);
+
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void
+log_out(char *buf, size_t *len)
+{
+	if (*len && log_fd != -1) {
+		if (write(log_fd, buf, *len) < 0) {
+			/* nowhere left to report this */
+		}
+	}
+	*len = 0;
+}
+
+/* Write out everything the rings hold. Called by the writer thread, and
+ * by main() once the writer is gone.
+ */
+static void
+log_flush(void)
+{
+	static char buf[65536];
+	struct log_ring *ring, **pp;
+	struct log_record *rec;
+	unsigned int head, tail;
+	uint64_t dropped;
+	size_t len = 0;
+	struct tm tm;
+	char tmp[32];
+	int n;
+
+	pthread_mutex_lock(&log_flush_mutex);
+	if (log_fd == -1) {
+		log_fd = open(logfile, O_WRONLY|O_CREAT|O_APPEND, 0644);
+	}
+
+	pthread_mutex_lock(&log_rings_mutex);
+	pp = &log_rings;
+	while ((ring = *pp) != NULL) {
+		int orphaned = __atomic_load_n(&ring->orphaned, __ATOMIC_ACQUIRE);
+
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		for (tail = ring->tail; tail != head; tail++) {
+			rec = &ring->recs[tail % LOG_RING_SIZE];
+			if (len + LOG_RECORD_SIZE + 64 > sizeof(buf)) {
+				log_out(buf, &len);
+			}
+			localtime_r(&rec->ts.tv_sec, &tm);
+			strftime(tmp, sizeof(tmp), "%T", &tm);
+			n = snprintf(buf + len, sizeof(buf) - len, "[NFS] %s.%06ld %s",
+				     tmp, rec->ts.tv_nsec / 1000, rec->msg);
+			len += n < (int)(sizeof(buf) - len) ? n : sizeof(buf) - len - 1;
+		}
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+		if (orphaned) {
+			*pp = ring->next;
+			free(ring);
+			continue;
+		}
+		pp = &ring->next;
+	}
+	pthread_mutex_unlock(&log_rings_mutex);
+
+	dropped = __sync_fetch_and_and(&log_dropped, 0);
+	if (dropped) {
+		if (len + 64 > sizeof(buf)) {
+			log_out(buf, &len);
+		}
+		len += snprintf(buf + len, sizeof(buf) - len,
+				"[NFS] dropped %llu log messages\n",
+				(unsigned long long)dropped);
+	}
+	log_out(buf, &len);
+	pthread_mutex_unlock(&log_flush_mutex);
+}
+
+static void *
+log_writer_loop(void *arg)
+{
+	struct timespec ts = { 0, 20 * 1000 * 1000 };
+
+	while (!__atomic_load_n(&log_thread_shutdown, __ATOMIC_ACQUIRE)) {
+		log_flush();
+		nanosleep(&ts, NULL);
+	}
+	log_flush();
+
+	return NULL;
+}
 
-/* Only one thread at a time can enter libnfs */
-static pthread_mutex_t nfs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static void
+log_start(void)
+{
+	if (logfile == NULL || log_thread_running) {
+		return;
+	}
+	log_thread_shutdown = 0;
+	if (pthread_create(&log_thread, NULL, log_writer_loop, NULL) == 0) {
+		log_thread_running = 1;
+	}
+}
+
+static void
+log_stop(void)
+{
+	if (!log_thread_running) {
+		return;
+	}
+	__atomic_store_n(&log_thread_shutdown, 1, __ATOMIC_RELEASE);
+	pthread_join(log_thread, NULL);
+	log_thread_running = 0;
+}
 
 #define discard_const(ptr) ((void *)((intptr_t)(ptr)))
 
-struct nfs_context *nfs = NULL;
+/*
+ * Statistics, served from the virtual file /.fuse-nfs/stats.
+ *
+ * Every handler starts an op timer that records the call count and a
+ * log2 latency histogram when the handler returns. Besides the FUSE
+ * operations we time how long callers wait for conn->mutex and for
+ * replies in wait_for_nfs_reply(), which separates client side
+ * contention from server latency. Each thread updates its own block of
+ * counters; reading the stats file sums them up.
+ */
+enum {
+	STAT_GETATTR,
+	STAT_LOOKUP,
+	STAT_FORGET,
+	STAT_SETATTR,
+	STAT_READDIR,
+	STAT_OPENDIR,
+	STAT_RELEASEDIR,
+	STAT_READLINK,
+	STAT_OPEN,
+	STAT_RELEASE,
+	STAT_READ,
+	STAT_WRITE,
+	STAT_CREATE,
+	STAT_UTIME,
+	STAT_UNLINK,
+	STAT_RMDIR,
+	STAT_MKDIR,
+	STAT_MKNOD,
+	STAT_SYMLINK,
+	STAT_RENAME,
+	STAT_LINK,
+	STAT_CHMOD,
+	STAT_CHOWN,
+	STAT_TRUNCATE,
+	STAT_FSYNC,
+	STAT_FLUSH,
+	STAT_STATFS,
+	STAT_FGETATTR,
+	STAT_FTRUNCATE,
+	STAT_LOCK_WAIT,
+	STAT_RPC_WAIT,
+	STAT_NUM_OPS
+};
+
+static const char *stat_names[STAT_NUM_OPS] = {
+	"getattr", "lookup", "forget", "setattr", "readdir", "opendir",
+	"releasedir", "readlink", "open", "release", "read", "write",
+	"create", "utime", "unlink", "rmdir", "mkdir", "mknod", "symlink",
+	"rename", "link", "chmod", "chown", "truncate", "fsync", "flush",
+	"statfs", "fgetattr", "ftruncate", "lock_wait", "rpc_wait",
+};
+
+/* Bucket n counts latencies below 2^n nanoseconds */
+#define STATS_BUCKETS		40
+
+struct thread_stats {
+	struct thread_stats *next;
+	uint64_t count[STAT_NUM_OPS];
+	uint64_t bytes[STAT_NUM_OPS];
+	uint64_t hist[STAT_NUM_OPS][STATS_BUCKETS];
+};
+
+static __thread struct thread_stats *thread_stats;
+/* Holds the counts of threads that have exited, always on the list */
+static struct thread_stats retired_thread_stats;
+static struct thread_stats *all_thread_stats = &retired_thread_stats;
+static pthread_mutex_t all_thread_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+
+static uint64_t
+stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* The thread went away. Fold its counts into the retired block, which
+ * keeps reporting them, and free its own block.
+ */
+static void
+stats_retire(void *arg)
+{
+	struct thread_stats *ts = arg, **pp;
+	int op, b;
+
+	pthread_mutex_lock(&all_thread_stats_mutex);
+	for (pp = &all_thread_stats; *pp; pp = &(*pp)->next) {
+		if (*pp == ts) {
+			*pp = ts->next;
+			break;
+		}
+	}
+	for (op = 0; op < STAT_NUM_OPS; op++) {
+		retired_thread_stats.count[op] += ts->count[op];
+		retired_thread_stats.bytes[op] += ts->bytes[op];
+		for (b = 0; b < STATS_BUCKETS; b++) {
+			retired_thread_stats.hist[op][b] += ts->hist[op][b];
+		}
+	}
+	pthread_mutex_unlock(&all_thread_stats_mutex);
+	free(ts);
+	thread_stats = NULL;
+}
+
+static void
+stats_key_create(void)
+{
+	pthread_key_create(&stats_key, stats_retire);
+}
+
+/* The block of the calling thread */
+static struct thread_stats *
+stats_self(void)
+{
+	struct thread_stats *ts = thread_stats;
+
+	if (ts) {
+		return ts;
+	}
+	ts = calloc(1, sizeof(struct thread_stats));
+	if (ts == NULL) {
+		return NULL;
+	}
+	pthread_once(&stats_key_once, stats_key_create);
+	pthread_setspecific(stats_key, ts);
+	pthread_mutex_lock(&all_thread_stats_mutex);
+	ts->next = all_thread_stats;
+	all_thread_stats = ts;
+	pthread_mutex_unlock(&all_thread_stats_mutex);
+	thread_stats = ts;
+
+	return ts;
+}
+
+static void
+stats_record(int op, uint64_t start)
+{
+	struct thread_stats *ts = stats_self();
+	uint64_t ns = stats_now() - start;
+	int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+
+	if (ts == NULL) {
+		return;
+	}
+	if (bucket >= STATS_BUCKETS) {
+		bucket = STATS_BUCKETS - 1;
+	}
+	__atomic_store_n(&ts->count[op], ts->count[op] + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&ts->hist[op][bucket], ts->hist[op][bucket] + 1,
+			 __ATOMIC_RELAXED);
+}
+
+static void
+stats_bytes(int op, uint64_t bytes)
+{
+	struct thread_stats *ts = stats_self();
+
+	if (ts == NULL) {
+		return;
+	}
+	__atomic_store_n(&ts->bytes[op], ts->bytes[op] + bytes, __ATOMIC_RELAXED);
+}
+
+struct op_timer {
+	int op;
+	uint64_t start;
+};
+
+static void
+op_timer_end(struct op_timer *timer)
+{
+	stats_record(timer->op, timer->start);
+}
+
+/* Times the rest of the enclosing block */
+#define STATS_OP(op)							\
+	struct op_timer op_timer __attribute__((cleanup(op_timer_end))) = \
+		{ (op), stats_now() }
+
+/* Render the statistics as text into a malloc'ed buffer */
+static char *
+stats_format(size_t *len)
+{
+	static uint64_t count[STAT_NUM_OPS], bytes[STAT_NUM_OPS];
+	static uint64_t hist[STAT_NUM_OPS][STATS_BUCKETS];
+	static pthread_mutex_t format_mutex = PTHREAD_MUTEX_INITIALIZER;
+	static const double quantiles[] = { 0.5, 0.99, 0.999 };
+	struct thread_stats *ts;
+	size_t size = 256 + STAT_NUM_OPS * 128, pos;
+	uint64_t seen, want;
+	char *buf;
+	int op, b, q;
+
+	buf = malloc(size);
+	if (buf == NULL) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&format_mutex);
+	memset(count, 0, sizeof(count));
+	memset(bytes, 0, sizeof(bytes));
+	memset(hist, 0, sizeof(hist));
+	pthread_mutex_lock(&all_thread_stats_mutex);
+	for (ts = all_thread_stats; ts; ts = ts->next) {
+		for (op = 0; op < STAT_NUM_OPS; op++) {
+			count[op] += __atomic_load_n(&ts->count[op], __ATOMIC_RELAXED);
+			bytes[op] += __atomic_load_n(&ts->bytes[op], __ATOMIC_RELAXED);
+			for (b = 0; b < STATS_BUCKETS; b++) {
+				hist[op][b] += __atomic_load_n(&ts->hist[op][b],
+							       __ATOMIC_RELAXED);
+			}
+		}
+	}
+	pthread_mutex_unlock(&all_thread_stats_mutex);
+
+	/* Percentiles are the upper bound of the bucket they fall in */
+	pos = snprintf(buf, size, "%-12s %12s %16s %12s %12s %12s\n",
+		       "op", "count", "bytes", "p50(us)", "p99(us)", "p999(us)");
+	for (op = 0; op < STAT_NUM_OPS; op++) {
+		if (count[op] == 0) {
+			continue;
+		}
+		pos += snprintf(buf + pos, size - pos, "%-12s %12llu %16llu",
+				stat_names[op], (unsigned long long)count[op],
+				(unsigned long long)bytes[op]);
+		for (q = 0; q < 3; q++) {
+			want = (uint64_t)(count[op] * quantiles[q]);
+			if (want == 0) {
+				want = 1;
+			}
+			for (seen = 0, b = 0; b < STATS_BUCKETS - 1; b++) {
+				seen += hist[op][b];
+				if (seen >= want) {
+					break;
+				}
+			}
+			pos += snprintf(buf + pos, size - pos, " %12.1f",
+					(double)(1ULL << b) / 1000);
+		}
+		pos += snprintf(buf + pos, size - pos, "\n");
+	}
+	pthread_mutex_unlock(&format_mutex);
+
+	*len = pos;
+	return buf;
+}
+
+/*
+ * Operation trace (--trace_file).
+ *
+ * Each path based handler records its arguments, the caller and how long
+ * it took when it returns, see fuse-nfs-trace.h for the format. The trace
+ * is replayed against a mount with fuse-nfs-replay. A record and its
+ * paths go out in a single fwrite so that concurrent handlers do not
+ * interleave, and stdio buffers them into large writes.
+ */
+static char *trace_file;
+static FILE *trace_fp;
+static uint64_t trace_start;
+
+struct trace_call {
+	uint32_t op;
+	const char *path;
+	const char *path2;
+	struct fuse_file_info *fi;
+	uint64_t handle;
+	uint64_t offset;
+	uint64_t size;
+	uint32_t mode;
+	uint32_t flags;
+	uint64_t start;
+};
+
+static void
+trace_call_end(struct trace_call *call)
+{
+	char buf[sizeof(struct trace_record) + 2 * TRACE_MAX_PATH];
+	struct trace_record *rec = (struct trace_record *)buf;
+	struct fuse_context *ctx = fuse_get_context();
+	size_t len = sizeof(*rec);
+
+	if (trace_fp == NULL) {
+		return;
+	}
+
+	memset(rec, 0, sizeof(*rec));
+	rec->time = call->start - trace_start;
+	rec->duration = stats_now() - call->start;
+	rec->offset = call->offset;
+	rec->size = call->size;
+	/* Open and create hand out the handle, release clears it */
+	if (call->op == TRACE_OPEN || call->op == TRACE_CREATE) {
+		rec->handle = call->fi ? call->fi->fh : 0;
+	} else {
+		rec->handle = call->handle;
+	}
+	rec->op = call->op;
+	if (ctx) {
+		rec->uid = ctx->uid;
+		rec->gid = ctx->gid;
+		rec->pid = ctx->pid;
+	}
+	rec->mode = call->mode;
+	rec->flags = call->flags;
+	if (call->path) {
+		rec->path_len = strnlen(call->path, TRACE_MAX_PATH);
+		memcpy(buf + len, call->path, rec->path_len);
+		len += rec->path_len;
+	}
+	if (call->path2) {
+		rec->path2_len = strnlen(call->path2, TRACE_MAX_PATH);
+		memcpy(buf + len, call->path2, rec->path2_len);
+		len += rec->path2_len;
+	}
+	fwrite(buf, len, 1, trace_fp);
+}
+
+/* The handle as the call found it */
+static uint64_t
+trace_handle(struct fuse_file_info *fi)
+{
+	return fi ? fi->fh : 0;
+}
+
+/* Traces the enclosing handler, written when it returns */
+#define TRACE_OP(op, path, path2, fi, offset, size, mode, flags)	\
+	struct trace_call trace_call __attribute__((cleanup(trace_call_end))) = \
+		{ (op), (path), (path2), (fi), trace_handle(fi),	\
+		  (offset), (size), (mode), (flags),			\
+		  trace_fp ? stats_now() : 0 }
+
+static int
+trace_open(void)
+{
+	struct trace_header hdr;
+
+	trace_fp = fopen(trace_file, "w");
+	if (trace_fp == NULL) {
+		return -1;
+	}
+	setvbuf(trace_fp, NULL, _IOFBF, 1024 * 1024);
+	hdr.magic = TRACE_MAGIC;
+	hdr.version = TRACE_VERSION;
+	fwrite(&hdr, sizeof(hdr), 1, trace_fp);
+	/* Nothing may be left in the buffer when fuse_main() forks */
+	fflush(trace_fp);
+	trace_start = stats_now();
+
+	return 0;
+}
+
+static void
+trace_close(void)
+{
+	if (trace_fp) {
+		fclose(trace_fp);
+		trace_fp = NULL;
+	}
+}
+
+/*
+ * One mounted nfs_context, its socket and the service thread that owns it.
+ * We keep a pool of these (--connections) so that independent requests
+ * can be spread over several TCP connections to the server.
+ */
+/* Classes of data requests, see sched_lock() */
+enum {
+	SCHED_INTERACTIVE,
+	SCHED_BULK,
+	SCHED_CLASSES
+};
+
+struct nfs_conn {
+	struct nfs_context *nfs;
+
+	/* Only one thread at a time can enter libnfs for this context */
+	pthread_mutex_t mutex;
+
+	pthread_t service_thread;
+	int service_running;
+	int service_shutdown;
+	int service_failed;
+	int wakeup_fd[2];
+
+	/* Callers currently sleeping in wait_for_nfs_reply(), under mutex */
+	struct sync_cb_data *waiters;
+
+	/* The credentials the context sends, see update_rpc_credentials() */
+	int cred_set;
+	uid_t cred_uid;
+	gid_t cred_gid;
+
+	/* Data request scheduling, see sched_lock(). Under mutex. */
+	size_t sched_inflight[SCHED_CLASSES];
+	uid_t sched_last_uid[SCHED_CLASSES];
+	struct sched_waiter *sched_waiters;
+};
+
+static struct nfs_conn *conns;
+static int num_conns = 1;
+
+/*
+ * With --user_connections=N there are N more connections after the
+ * --connections pool, each owned by the (uid, gid) that used it last.
+ * Path operations of a caller go to its own connection, so requests of
+ * different users no longer rewrite the credentials of a shared context
+ * between them. When more users than that are active, the one that has
+ * been idle the longest hands its connection over.
+ */
+struct user_conn {
+	int used;
+	uid_t uid;
+	gid_t gid;
+	uint64_t last_used;
+};
+
+static int num_user_conns;
+static struct user_conn *user_conns;
+static uint64_t user_conn_clock;
+static pthread_mutex_t user_conn_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t user_conn_handovers;
+static uint64_t cred_switches;
+
+/* Take conn->mutex for sending a request, recording how long we waited */
+static void
+conn_lock(struct nfs_conn *conn)
+{
+	uint64_t start = stats_now();
+
+	pthread_mutex_lock(&conn->mutex);
+	stats_record(STAT_LOCK_WAIT, start);
+}
+
+/* The NFS version from the url, some fast paths talk NFSv3 directly */
+static int nfs_version = 3;
+
+/* What we store in fi->fh for an open file */
+struct fuse_nfs_fh {
+	struct nfs_conn *conn;
+	struct nfsfh *nfsfh;
+
+	/* Read-ahead state, see fuse_nfs_ra_read() */
+	pthread_mutex_t ra_mutex;
+	pthread_cond_t ra_cond;
+	uint64_t ra_gen;
+	int ra_writers;
+	int ra_waiters;
+	uint64_t ra_next;
+	uint64_t ra_ahead;
+	uint64_t ra_eof;
+	size_t ra_window;
+	struct ra_slot *ra_slots;
+
+	/* Write-back state, see fuse_nfs_wb_write() */
+	pthread_mutex_t wb_mutex;
+	struct wb_extent *wb_cur;
+	struct wb_extent *wb_inflight;
+	int wb_num_inflight;
+	int wb_error;
+	int wb_unstable;
+	int wb_verf_set;
+	char wb_verf[NFS3_WRITEVERFSIZE];
+
+	/* Handles open for writing, see wb_flush_path() */
+	char *wb_path;
+	struct fuse_nfs_fh *wb_prev, *wb_next;
+	int wb_refs;
+
+	/* Set when reads are served from the disk cache */
+	char *dc_name;
+	uint64_t dc_size;
+	uint32_t dc_gen;
+
+	/* Set instead of nfsfh for the stats file, see stats_file_open() */
+	char *stats_buf;
+	size_t stats_len;
+
+	/* The credentials the file was opened with */
+	uid_t uid;
+	gid_t gid;
+
+	/* Bytes read and written through the handle, see sched_class() */
+	uint64_t io_bytes;
+};
+
 int custom_uid = -1;
 int custom_gid = -1;
 
@@ -90,16 +823,31 @@ uid_t getuid(){
 }
 #endif
 
+/* The low-level frontend has no fuse_get_context(), it tells us who the
+ * caller is through these instead.
+ */
+static __thread int ll_caller_set;
+static __thread uid_t ll_caller_uid;
+static __thread gid_t ll_caller_gid;
+
+static uid_t caller_uid(void) {
+    return ll_caller_set ? ll_caller_uid : fuse_get_context()->uid;
+}
+
+static gid_t caller_gid(void) {
+    return ll_caller_set ? ll_caller_gid : fuse_get_context()->gid;
+}
+
 static int map_uid(int possible_uid) {
     if (custom_uid != -1 && possible_uid == custom_uid){
-        return fuse_get_context()->uid;
+        return caller_uid();
     }
     return possible_uid;
 }
 
 static int map_gid(int possible_gid) {
     if (custom_gid != -1 && possible_gid == custom_gid){
-        return fuse_get_context()->gid;
+        return caller_gid();
     }
     return possible_gid;
 }
@@ -124,715 +872,6922 @@ struct sync_cb_data {
 
 	void *return_data;
 	size_t max_size;
+
+	/* Only used while a caller is sleeping in wait_for_nfs_reply() */
+	int has_waiter;
+	pthread_cond_t cond;
+	struct sync_cb_data *prev, *next;
+
+	/* Set while the request holds part of a data budget */
+	struct nfs_conn *sched_conn;
+	int sched_class;
+	size_t sched_bytes;
 };
 
-static void
-wait_for_nfs_reply(struct nfs_context *nfs, struct sync_cb_data *cb_data)
+/*
+ * Data request scheduler (--sched_bulk_bytes).
+ *
+ * All requests on a connection share one socket and go out in the order
+ * they were queued, so a GETATTR queued behind megabytes of READ and
+ * WRITE payload waits for all of it. With the scheduler, READs and
+ * WRITEs first have to fit into the budget of their class on the
+ * connection, counted from when they are queued until their reply
+ * arrives. Everything else is queued right away, so metadata never
+ * finds more than the budgets ahead of it.
+ *
+ * Read-ahead, write-back, and reads and writes on a handle that has
+ * already moved SCHED_BULK_AFTER bytes are bulk. Other reads and writes
+ * are interactive and have a budget of their own, so opening and reading
+ * a small file is not held up by a backup either. A request larger than
+ * the budget is let through once its class is idle. Waiters are served
+ * in order, or with --sched_per_uid round robin by uid so that one user
+ * streaming many files does not starve the others.
+ */
+#define SCHED_BULK_AFTER	(1024 * 1024)
+
+static size_t sched_bulk_bytes;
+static int sched_per_uid;
+static uint64_t sched_waits;
+
+struct sched_waiter {
+	struct sched_waiter *next;
+	pthread_cond_t cond;
+	uid_t uid;
+	int sched_class;
+	size_t bytes;
+	int granted;
+};
+
+static int
+sched_class(uint64_t io_bytes)
 {
-	struct pollfd pfd;
-	int revents;
-	int ret;
-	static pthread_mutex_t reply_mutex = PTHREAD_MUTEX_INITIALIZER;
+	return io_bytes >= SCHED_BULK_AFTER ? SCHED_BULK : SCHED_INTERACTIVE;
+}
 
-	pthread_mutex_lock(&reply_mutex);
-	while (!cb_data->is_finished) {
+static int
+sched_fits(struct nfs_conn *conn, int sched_class, size_t bytes)
+{
+	size_t inflight = conn->sched_inflight[sched_class];
 
-		pfd.fd = nfs_get_fd(nfs);
-		pfd.events = nfs_which_events(nfs);
-		pfd.revents = 0;
+	return inflight == 0 || inflight + bytes <= sched_bulk_bytes;
+}
 
-		ret = poll(&pfd, 1, 100);
-		if (ret < 0) {
-			revents = -1;
-		} else {
-			revents = pfd.revents;
-		}
+/* The waiter of a class to serve next: the oldest one, or with per-uid
+ * fairness the oldest one of the lowest uid above the one served last.
+ * Called with conn->mutex held.
+ */
+static struct sched_waiter **
+sched_next(struct nfs_conn *conn, int sched_class)
+{
+	uid_t last = conn->sched_last_uid[sched_class];
+	struct sched_waiter **pp, **first = NULL, **next = NULL;
 
-		pthread_mutex_lock(&nfs_mutex);
-		ret = nfs_service(nfs, revents);
-		pthread_mutex_unlock(&nfs_mutex);
-		if (ret < 0) {
-			cb_data->status = -EIO;
-			break;
+	for (pp = &conn->sched_waiters; *pp; pp = &(*pp)->next) {
+		if ((*pp)->sched_class != sched_class) {
+			continue;
+		}
+		if (!sched_per_uid) {
+			return pp;
+		}
+		if (first == NULL || (*pp)->uid < (*first)->uid) {
+			first = pp;
+		}
+		if ((*pp)->uid > last &&
+		    (next == NULL || (*pp)->uid < (*next)->uid)) {
+			next = pp;
 		}
 	}
-	pthread_mutex_unlock(&reply_mutex);
+	return next ? next : first;
 }
 
+/* Hand budget that has come free to waiters. Called with conn->mutex
+ * held. Once the connection has failed everybody goes through and gets
+ * the error.
+ */
 static void
-generic_cb(int status, struct nfs_context *nfs, void *data, void *private_data)
+sched_dispatch(struct nfs_conn *conn)
 {
-	struct sync_cb_data *cb_data = private_data;
+	struct sched_waiter **pp, *w;
+	int c;
 
-	cb_data->is_finished = 1;
-	cb_data->status = status;
+	for (c = 0; c < SCHED_CLASSES; c++) {
+		while ((pp = sched_next(conn, c)) != NULL) {
+			w = *pp;
+			if (!conn->service_failed && !sched_fits(conn, c, w->bytes)) {
+				break;
+			}
+			*pp = w->next;
+			conn->sched_inflight[c] += w->bytes;
+			conn->sched_last_uid[c] = w->uid;
+			w->granted = 1;
+			pthread_cond_signal(&w->cond);
+		}
+	}
 }
 
-/* Update the rpc credentials to the current user unless
- * have are overriding the credentials via url arguments.
- */
-static void update_rpc_credentials(void) {
-	if (custom_uid == -1  && !fusenfs_allow_other_own_ids) {
-		nfs_set_uid(nfs, fuse_get_context()->uid);
+static void
+sched_admit(struct nfs_conn *conn, struct sync_cb_data *cb_data,
+	    int sched_class, size_t bytes)
+{
+	cb_data->sched_conn = conn;
+	cb_data->sched_class = sched_class;
+	cb_data->sched_bytes = bytes;
+}
+
+/* Return the budget of a request, from nfs_reply_done() or when it
+ * could not be queued after all. Called with conn->mutex held.
+ */
+static void
+sched_done(struct sync_cb_data *cb_data)
+{
+	struct nfs_conn *conn = cb_data->sched_conn;
+
+	if (conn == NULL) {
+		return;
+	}
+	cb_data->sched_conn = NULL;
+	conn->sched_inflight[cb_data->sched_class] -= cb_data->sched_bytes;
+	sched_dispatch(conn);
+}
+
+static int
+sched_can_admit(struct nfs_conn *conn, int sched_class, size_t bytes)
+{
+	struct sched_waiter *w;
+
+	if (conn->service_failed) {
+		return 1;
+	}
+	for (w = conn->sched_waiters; w; w = w->next) {
+		if (w->sched_class == sched_class) {
+			return 0;
+		}
+	}
+	return sched_fits(conn, sched_class, bytes);
+}
+
+/* Like conn_lock() for a READ or WRITE of bytes bytes, which cb_data
+ * completes. Waits until the request fits into the budget of its class
+ * and returns with conn->mutex held.
+ */
+static void
+sched_lock(struct nfs_conn *conn, struct sync_cb_data *cb_data,
+	   int sched_class, size_t bytes)
+{
+	struct sched_waiter w, **pp;
+
+	conn_lock(conn);
+	if (sched_bulk_bytes == 0) {
+		return;
+	}
+	if (sched_can_admit(conn, sched_class, bytes)) {
+		conn->sched_inflight[sched_class] += bytes;
+		sched_admit(conn, cb_data, sched_class, bytes);
+		return;
+	}
+
+	memset(&w, 0, sizeof(w));
+	pthread_cond_init(&w.cond, NULL);
+	w.uid = caller_uid();
+	w.sched_class = sched_class;
+	w.bytes = bytes;
+	for (pp = &conn->sched_waiters; *pp; pp = &(*pp)->next)
+		;
+	*pp = &w;
+	sched_waits++;
+
+	while (!w.granted) {
+		pthread_cond_wait(&w.cond, &conn->mutex);
+	}
+	pthread_cond_destroy(&w.cond);
+	sched_admit(conn, cb_data, sched_class, bytes);
+}
+
+/* Like sched_lock() but fails instead of waiting, for requests we can
+ * just as well send later. Returns 0 with conn->mutex held.
+ */
+static int
+sched_trylock(struct nfs_conn *conn, struct sync_cb_data *cb_data,
+	      int sched_class, size_t bytes)
+{
+	conn_lock(conn);
+	if (sched_bulk_bytes == 0) {
+		return 0;
+	}
+	if (!sched_can_admit(conn, sched_class, bytes)) {
+		pthread_mutex_unlock(&conn->mutex);
+		return -1;
+	}
+	conn->sched_inflight[sched_class] += bytes;
+	sched_admit(conn, cb_data, sched_class, bytes);
+	return 0;
+}
+
+/*
+ * Every connection has a service thread that owns the socket and runs
+ * nfs_service(). Callers queue their *_async request under conn->mutex,
+ * poke the service thread through wakeup_fd so it picks up the new POLLOUT
+ * interest and then sleep on their own condition variable until the
+ * callback fires.
+ */
+static void
+wake_service_thread(struct nfs_conn *conn)
+{
+	char c = 0;
+
+	if (conn->wakeup_fd[1] == -1) {
+		return;
+	}
+	/* EAGAIN just means there is already a wakeup pending */
+	if (write(conn->wakeup_fd[1], &c, 1) < 0) {
+		return;
+	}
+}
+
+/* Must be called with conn->mutex held, i.e. from the libnfs callbacks */
+static void
+nfs_reply_done(struct sync_cb_data *cb_data, int status)
+{
+	cb_data->status = status;
+	cb_data->is_finished = 1;
+	sched_done(cb_data);
+	if (cb_data->has_waiter) {
+		pthread_cond_signal(&cb_data->cond);
+	}
+}
+
+static void
+wait_for_nfs_reply(struct nfs_conn *conn, struct sync_cb_data *cb_data)
+{
+	STATS_OP(STAT_RPC_WAIT);
+
+	wake_service_thread(conn);
+
+	pthread_mutex_lock(&conn->mutex);
+	if (cb_data->is_finished) {
+		pthread_mutex_unlock(&conn->mutex);
+		return;
+	}
+	if (conn->service_failed) {
+		cb_data->status = -EIO;
+		pthread_mutex_unlock(&conn->mutex);
+		return;
+	}
+
+	pthread_cond_init(&cb_data->cond, NULL);
+	cb_data->has_waiter = 1;
+	cb_data->prev = NULL;
+	cb_data->next = conn->waiters;
+	if (conn->waiters) {
+		conn->waiters->prev = cb_data;
+	}
+	conn->waiters = cb_data;
+
+	while (!cb_data->is_finished) {
+		pthread_cond_wait(&cb_data->cond, &conn->mutex);
+	}
+
+	if (cb_data->prev) {
+		cb_data->prev->next = cb_data->next;
+	} else {
+		conn->waiters = cb_data->next;
+	}
+	if (cb_data->next) {
+		cb_data->next->prev = cb_data->prev;
+	}
+	cb_data->has_waiter = 0;
+	pthread_mutex_unlock(&conn->mutex);
+	pthread_cond_destroy(&cb_data->cond);
+}
+
+static void open_cache_tick(void);
+
+static void *
+nfs_service_loop(void *arg)
+{
+	struct nfs_conn *conn = arg;
+	struct pollfd pfd[2];
+	struct sync_cb_data *cb_data;
+	int nfds = 1;
+	int revents;
+	int ret;
+	char buf[64];
+
+	pfd[1].revents = 0;
+	if (conn->wakeup_fd[0] != -1) {
+		pfd[1].fd = conn->wakeup_fd[0];
+		pfd[1].events = POLLIN;
+		nfds = 2;
+	}
+
+	pthread_mutex_lock(&conn->mutex);
+	while (!conn->service_shutdown) {
+		pfd[0].fd = nfs_get_fd(conn->nfs);
+		pfd[0].events = nfs_which_events(conn->nfs);
+		pfd[0].revents = 0;
+		pthread_mutex_unlock(&conn->mutex);
+
+		pfd[1].revents = 0;
+		ret = poll(pfd, nfds, 100);
+		if (ret < 0) {
+			revents = errno == EINTR ? 0 : -1;
+		} else {
+			revents = pfd[0].revents;
+		}
+		if (pfd[1].revents & POLLIN) {
+			while (read(conn->wakeup_fd[0], buf, sizeof(buf)) > 0)
+				;
+		}
+		/* The poll timeout doubles as the clock for idle handles */
+		if (conn == &conns[0]) {
+			open_cache_tick();
+		}
+
+		pthread_mutex_lock(&conn->mutex);
+		ret = nfs_service(conn->nfs, revents);
+		if (ret < 0) {
+			LOG_AT(LOG_LEVEL_ERROR, "nfs_service failed: %s\n", nfs_get_error(conn->nfs));
+			/* Stop servicing the socket so no callback can ever
+			 * fire into a caller that we have already failed.
+			 */
+			conn->service_failed = 1;
+			for (cb_data = conn->waiters; cb_data; cb_data = cb_data->next) {
+				nfs_reply_done(cb_data, -EIO);
+			}
+			sched_dispatch(conn);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&conn->mutex);
+
+	return NULL;
+}
+
+static int
+start_service_thread(struct nfs_conn *conn)
+{
+#ifndef WIN32
+	if (pipe(conn->wakeup_fd) == 0) {
+		fcntl(conn->wakeup_fd[0], F_SETFL, O_NONBLOCK);
+		fcntl(conn->wakeup_fd[1], F_SETFL, O_NONBLOCK);
+	} else {
+		conn->wakeup_fd[0] = conn->wakeup_fd[1] = -1;
+	}
+#endif
+	if (pthread_create(&conn->service_thread, NULL, nfs_service_loop, conn)) {
+		return -1;
+	}
+	conn->service_running = 1;
+	return 0;
+}
+
+static void
+stop_service_thread(struct nfs_conn *conn)
+{
+	if (!conn->service_running) {
+		return;
+	}
+	pthread_mutex_lock(&conn->mutex);
+	conn->service_shutdown = 1;
+	pthread_mutex_unlock(&conn->mutex);
+	wake_service_thread(conn);
+	pthread_join(conn->service_thread, NULL);
+	conn->service_running = 0;
+
+	if (conn->wakeup_fd[0] != -1) {
+		close(conn->wakeup_fd[0]);
+		close(conn->wakeup_fd[1]);
+		conn->wakeup_fd[0] = conn->wakeup_fd[1] = -1;
+	}
+}
+
+/* FNV-1a */
+static uint32_t
+path_hash(const char *path)
+{
+	uint32_t hash = 2166136261u;
+
+	while (*path) {
+		hash ^= (unsigned char)*path++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/* Path based operations are sharded over the pool by a hash of the path
+ * so that requests for the same object always use the same connection.
+ * With --user_connections they all go to the caller's own connection
+ * instead and the pool is left unused.
+ */
+static struct nfs_conn *conn_for_caller(void);
+
+static struct nfs_conn *
+conn_for_path(const char *path)
+{
+	if (num_user_conns) {
+		return conn_for_caller();
+	}
+	if (num_conns == 1) {
+		return &conns[0];
+	}
+	return &conns[path_hash(path) % num_conns];
+}
+
+static void
+generic_cb(int status, struct nfs_context *nfs, void *data, void *private_data)
+{
+	struct sync_cb_data *cb_data = private_data;
+
+	nfs_reply_done(cb_data, status);
+}
+
+/* The rpc credentials for the current user unless we
+ * are overriding the credentials via url arguments.
+ */
+static void rpc_credentials(uid_t *uid, gid_t *gid) {
+	if (custom_uid == -1  && !fusenfs_allow_other_own_ids) {
+		*uid = caller_uid();
 	} else if ((custom_uid == -1 ||
-                    fuse_get_context()->uid != mount_user_uid)
+                    caller_uid() != mount_user_uid)
                    && fusenfs_allow_other_own_ids) {
-		nfs_set_uid(nfs, fuse_get_context()->uid);
+		*uid = caller_uid();
 	} else {
-		nfs_set_uid(nfs, custom_uid);
+		*uid = custom_uid;
 	}
 	if (custom_gid == -1 && !fusenfs_allow_other_own_ids) {
-		nfs_set_gid(nfs, fuse_get_context()->gid);
+		*gid = caller_gid();
         } else if ((custom_gid == -1 ||
-                    fuse_get_context()->gid != mount_user_gid)
+                    caller_gid() != mount_user_gid)
                    && fusenfs_allow_other_own_ids) {
-		nfs_set_gid(nfs, fuse_get_context()->gid);
+		*gid = caller_gid();
 	} else {
-		nfs_set_gid(nfs, custom_gid);
+		*gid = custom_gid;
 	}
 }
 
-static void
-stat64_cb(int status, struct nfs_context *nfs, void *data, void *private_data)
+/* Update the rpc credentials of conn to the current user. Setting them
+ * makes libnfs build a new AUTH_UNIX, so it is skipped when they are
+ * already what the context sends. Called with conn->mutex held.
+ */
+static void update_rpc_credentials(struct nfs_conn *conn) {
+	uid_t uid;
+	gid_t gid;
+
+	rpc_credentials(&uid, &gid);
+	if (conn->cred_set && conn->cred_uid == uid && conn->cred_gid == gid) {
+		return;
+	}
+	if (conn->cred_set) {
+		__sync_fetch_and_add(&cred_switches, 1);
+	}
+	nfs_set_uid(conn->nfs, uid);
+	nfs_set_gid(conn->nfs, gid);
+	conn->cred_set = 1;
+	conn->cred_uid = uid;
+	conn->cred_gid = gid;
+}
+
+/* The --user_connections connection of the caller */
+static struct nfs_conn *
+conn_for_caller(void)
 {
-	struct sync_cb_data *cb_data = private_data;
+	struct user_conn *uc, *lru = NULL;
+	uid_t uid;
+	gid_t gid;
+	int i;
 
-	cb_data->is_finished = 1;
-	cb_data->status = status;
+	rpc_credentials(&uid, &gid);
 
-	LOG("stat64_cb status:%d\n", status);
+	pthread_mutex_lock(&user_conn_mutex);
+	for (i = 0; i < num_user_conns; i++) {
+		uc = &user_conns[i];
+		if (uc->used && uc->uid == uid && uc->gid == gid) {
+			break;
+		}
+		if (lru == NULL || uc->last_used < lru->last_used) {
+			lru = uc;
+		}
+	}
+	if (i == num_user_conns) {
+		uc = lru;
+		if (uc->used) {
+			user_conn_handovers++;
+		}
+		uc->used = 1;
+		uc->uid = uid;
+		uc->gid = gid;
+		i = uc - user_conns;
+	}
+	uc->last_used = ++user_conn_clock;
+	pthread_mutex_unlock(&user_conn_mutex);
+
+	return &conns[num_conns + i];
+}
+
+static double
+monotonic_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+/*
+ * Single-flight metadata requests (--single_flight).
+ *
+ * When a parallel build starts, dozens of threads stat, readlink or list
+ * the same paths at the same moment. With single flight the first caller
+ * for an (operation, path, credentials) key sends the request and the
+ * callers that arrive while it is in flight wait for it and get the same
+ * result. Modifying a path through this mount removes the requests for
+ * it from the table, so nobody joins a request that was sent before a
+ * change they have already seen complete.
+ */
+#define FLIGHT_BUCKETS		256
+
+enum {
+	FLIGHT_GETATTR,
+	FLIGHT_READLINK,
+	FLIGHT_READDIR
+};
 
-	if (status < 0) {
+struct flight {
+	struct flight *next;
+	uint32_t hash;
+	int op;
+	size_t arg;
+	uid_t uid;
+	gid_t gid;
+	int in_table;
+	int refs;
+	int done;
+	int status;
+	void *result;
+	size_t result_len;
+	void (*result_free)(void *result, size_t len);
+	pthread_cond_t cond;
+	char path[];
+};
+
+static int single_flight;
+static pthread_mutex_t flight_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct flight *flights[FLIGHT_BUCKETS];
+static uint64_t flight_joins;
+
+/* Called with flight_mutex held */
+static void
+flight_unlink(struct flight *f)
+{
+	struct flight **pp;
+
+	if (!f->in_table) {
 		return;
 	}
-	memcpy(cb_data->return_data, data, sizeof(struct nfs_stat_64));
+	for (pp = &flights[f->hash % FLIGHT_BUCKETS]; *pp != f; pp = &(*pp)->next)
+		;
+	*pp = f->next;
+	f->in_table = 0;
+}
+
+/* Called with flight_mutex held */
+static struct flight *
+flight_find(int op, const char *path, uint32_t hash, size_t arg,
+	    uid_t uid, gid_t gid)
+{
+	struct flight *f;
+
+	for (f = flights[hash % FLIGHT_BUCKETS]; f; f = f->next) {
+		if (f->hash == hash && f->op == op && f->arg == arg &&
+		    f->uid == uid && f->gid == gid && !strcmp(f->path, path)) {
+			return f;
+		}
+	}
+	return NULL;
+}
+
+/* Called with flight_mutex held */
+static struct flight *
+flight_new(int op, const char *path, uint32_t hash, size_t arg,
+	   uid_t uid, gid_t gid)
+{
+	struct flight *f;
+
+	f = calloc(1, sizeof(struct flight) + strlen(path) + 1);
+	if (f == NULL) {
+		return NULL;
+	}
+	f->hash = hash;
+	f->op = op;
+	f->arg = arg;
+	f->uid = uid;
+	f->gid = gid;
+	f->refs = 1;
+	pthread_cond_init(&f->cond, NULL);
+	strcpy(f->path, path);
+	f->next = flights[hash % FLIGHT_BUCKETS];
+	flights[hash % FLIGHT_BUCKETS] = f;
+	f->in_table = 1;
+
+	return f;
+}
+
+/* Join the request for op on path that is in flight, or start one.
+ * Returns NULL if single flight is off, which the caller handles like
+ * being the leader of a request nobody else can join. Otherwise *leader
+ * says if we have to send the request and flight_finish() it, or if it
+ * has already finished and we only need to use its result. Either way
+ * the flight has to be flight_put() afterwards.
+ */
+static struct flight *
+flight_begin(int op, const char *path, size_t arg, int *leader)
+{
+	uint32_t hash = path_hash(path);
+	struct flight *f;
+	uid_t uid;
+	gid_t gid;
+
+	*leader = 1;
+	if (!single_flight) {
+		return NULL;
+	}
+	rpc_credentials(&uid, &gid);
+
+	pthread_mutex_lock(&flight_mutex);
+	f = flight_find(op, path, hash, arg, uid, gid);
+	if (f) {
+		f->refs++;
+		flight_joins++;
+		while (!f->done) {
+			pthread_cond_wait(&f->cond, &flight_mutex);
+		}
+		pthread_mutex_unlock(&flight_mutex);
+		*leader = 0;
+		return f;
+	}
+	f = flight_new(op, path, hash, arg, uid, gid);
+	pthread_mutex_unlock(&flight_mutex);
+
+	return f;
 }
 
+/* Like flight_begin() for requests nobody waits for: returns -1 instead
+ * of joining when the request is already in flight, otherwise 0 and in
+ * *fp the flight to finish, which may be NULL.
+ */
 static int
-fuse_nfs_getattr(const char *path, struct FUSE_STAT *stbuf)
+flight_start(int op, const char *path, size_t arg, struct flight **fp)
 {
-	struct nfs_stat_64 st;
-	struct sync_cb_data cb_data;
-	int ret;
+	uint32_t hash = path_hash(path);
+	uid_t uid;
+	gid_t gid;
 
-	LOG("fuse_nfs_getattr entered [%s]\n", path);
+	*fp = NULL;
+	if (!single_flight) {
+		return 0;
+	}
+	rpc_credentials(&uid, &gid);
 
-        memset(&cb_data, 0, sizeof(struct sync_cb_data));
-	cb_data.return_data = &st;
+	pthread_mutex_lock(&flight_mutex);
+	if (flight_find(op, path, hash, arg, uid, gid)) {
+		pthread_mutex_unlock(&flight_mutex);
+		return -1;
+	}
+	*fp = flight_new(op, path, hash, arg, uid, gid);
+	pthread_mutex_unlock(&flight_mutex);
 
-	pthread_mutex_lock(&nfs_mutex);
-	update_rpc_credentials();
-	ret = nfs_lstat64_async(nfs, path, stat64_cb, &cb_data);
-	pthread_mutex_unlock(&nfs_mutex);
-	if (ret < 0) {
-		return ret;
+	return 0;
+}
+
+/* Hand the result to everybody waiting. The flight owns result from now
+ * on and frees it with result_free, or free() if that is NULL.
+ */
+static void
+flight_finish(struct flight *f, int status, void *result, size_t len,
+	      void (*result_free)(void *result, size_t len))
+{
+	if (f == NULL) {
+		if (result_free) {
+			result_free(result, len);
+		} else {
+			free(result);
+		}
+		return;
 	}
-	wait_for_nfs_reply(nfs, &cb_data);
+	pthread_mutex_lock(&flight_mutex);
+	flight_unlink(f);
+	f->status = status;
+	f->result = result;
+	f->result_len = len;
+	f->result_free = result_free;
+	f->done = 1;
+	pthread_cond_broadcast(&f->cond);
+	pthread_mutex_unlock(&flight_mutex);
+}
 
-	stbuf->st_dev          = st.nfs_dev;
-	stbuf->st_ino          = st.nfs_ino;
-	stbuf->st_mode         = st.nfs_mode;
-	stbuf->st_nlink        = st.nfs_nlink;
-	stbuf->st_uid          = map_uid(st.nfs_uid);
-	stbuf->st_gid          = map_gid(st.nfs_gid);
-	stbuf->st_rdev         = st.nfs_rdev;
-	stbuf->st_size         = st.nfs_size;
-	stbuf->st_blksize      = st.nfs_blksize;
-	stbuf->st_blocks       = st.nfs_blocks;
+static void
+flight_put(struct flight *f)
+{
+	if (f == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&flight_mutex);
+	if (--f->refs) {
+		pthread_mutex_unlock(&flight_mutex);
+		return;
+	}
+	pthread_mutex_unlock(&flight_mutex);
 
-#if defined(HAVE_ST_ATIM) || defined(__MINGW32__)
-	stbuf->st_atim.tv_sec  = st.nfs_atime;
-	stbuf->st_atim.tv_nsec = st.nfs_atime_nsec;
-	stbuf->st_mtim.tv_sec  = st.nfs_mtime;
-	stbuf->st_mtim.tv_nsec = st.nfs_mtime_nsec;
-	stbuf->st_ctim.tv_sec  = st.nfs_ctime;
-	stbuf->st_ctim.tv_nsec = st.nfs_ctime_nsec;
-#else
-	stbuf->st_atime      = st.nfs_atime;
-	stbuf->st_mtime      = st.nfs_mtime;
-	stbuf->st_ctime      = st.nfs_ctime;
-	stbuf->st_atime_nsec = st.nfs_atime_nsec;
-	stbuf->st_mtime_nsec = st.nfs_mtime_nsec;
-	stbuf->st_ctime_nsec = st.nfs_ctime_nsec;
-#endif
-	return cb_data.status;
+	if (f->result_free) {
+		f->result_free(f->result, f->result_len);
+	} else {
+		free(f->result);
+	}
+	pthread_cond_destroy(&f->cond);
+	free(f);
+}
+
+/* Stop new callers from joining requests for path, or with tree for
+ * anything below it too.
+ */
+static void
+flight_forget(const char *path, int tree)
+{
+	size_t len = strlen(path);
+	struct flight *f, *next;
+	int i;
+
+	if (!single_flight) {
+		return;
+	}
+	pthread_mutex_lock(&flight_mutex);
+	if (!tree) {
+		i = path_hash(path) % FLIGHT_BUCKETS;
+		for (f = flights[i]; f; f = next) {
+			next = f->next;
+			if (!strcmp(f->path, path)) {
+				flight_unlink(f);
+			}
+		}
+		pthread_mutex_unlock(&flight_mutex);
+		return;
+	}
+	for (i = 0; i < FLIGHT_BUCKETS; i++) {
+		for (f = flights[i]; f; f = next) {
+			next = f->next;
+			if (!strncmp(f->path, path, len) &&
+			    (f->path[len] == 0 || f->path[len] == '/')) {
+				flight_unlink(f);
+			}
+		}
+	}
+	pthread_mutex_unlock(&flight_mutex);
+}
+
+/*
+ * Attribute cache, keyed by path and sharded to keep lock contention down.
+ * We store the raw nfs_stat_64 rather than the converted struct stat since
+ * the uid/gid mapping depends on the calling user.
+ *
+ * Every invalidation bumps the generation of the shard so that a GETATTR
+ * that was already in flight when the object was modified will not put
+ * the stale reply back into the cache.
+ *
+ * Paths that came back ENOENT are kept as negative entries for
+ * negative_cache_ttl seconds. Everything that can create a name
+ * invalidates that path, so only other clients creating it are subject
+ * to the timeout.
+ */
+#define ATTR_CACHE_SHARDS	64
+#define ATTR_CACHE_BUCKETS	1024
+#define ATTR_CACHE_MAX_ENTRIES	4096
+
+struct attr_cache_entry {
+	struct attr_cache_entry *next;
+	struct attr_cache_entry *lru_prev, *lru_next;
+	uint32_t hash;
+	double expires;
+	int negative;
+	struct nfs_stat_64 st;
+	char path[];
+};
+
+struct attr_cache_shard {
+	pthread_mutex_t mutex;
+	uint64_t generation;
+	int num_entries;
+	struct attr_cache_entry *lru_head, *lru_tail;
+	struct attr_cache_entry *buckets[ATTR_CACHE_BUCKETS];
+};
+
+static struct attr_cache_shard *attr_cache;
+static double attr_cache_ttl;
+static double negative_cache_ttl;
+static uint64_t attr_cache_hits;
+static uint64_t attr_cache_misses;
+static uint64_t negative_cache_hits;
+
+static void
+attr_cache_init(void)
+{
+	int i;
+
+	if (attr_cache_ttl <= 0 && negative_cache_ttl <= 0) {
+		return;
+	}
+	attr_cache = calloc(ATTR_CACHE_SHARDS, sizeof(struct attr_cache_shard));
+	if (attr_cache == NULL) {
+		return;
+	}
+	for (i = 0; i < ATTR_CACHE_SHARDS; i++) {
+		pthread_mutex_init(&attr_cache[i].mutex, NULL);
+	}
+}
+
+static struct attr_cache_shard *
+attr_cache_shard(uint32_t hash)
+{
+	return &attr_cache[hash % ATTR_CACHE_SHARDS];
+}
+
+static struct attr_cache_entry **
+attr_cache_bucket(struct attr_cache_shard *shard, uint32_t hash)
+{
+	return &shard->buckets[(hash / ATTR_CACHE_SHARDS) % ATTR_CACHE_BUCKETS];
+}
+
+/* Must be called with the shard mutex held */
+static void
+attr_cache_unlink(struct attr_cache_shard *shard, struct attr_cache_entry *ent)
+{
+	struct attr_cache_entry **pp;
+
+	for (pp = attr_cache_bucket(shard, ent->hash); *pp; pp = &(*pp)->next) {
+		if (*pp == ent) {
+			*pp = ent->next;
+			break;
+		}
+	}
+	if (ent->lru_prev) {
+		ent->lru_prev->lru_next = ent->lru_next;
+	} else {
+		shard->lru_head = ent->lru_next;
+	}
+	if (ent->lru_next) {
+		ent->lru_next->lru_prev = ent->lru_prev;
+	} else {
+		shard->lru_tail = ent->lru_prev;
+	}
+	shard->num_entries--;
+	free(ent);
+}
+
+/* Must be called with the shard mutex held */
+static struct attr_cache_entry *
+attr_cache_find(struct attr_cache_shard *shard, uint32_t hash, const char *path)
+{
+	struct attr_cache_entry *ent;
+
+	for (ent = *attr_cache_bucket(shard, hash); ent; ent = ent->next) {
+		if (ent->hash == hash && !strcmp(ent->path, path)) {
+			return ent;
+		}
+	}
+	return NULL;
+}
+
+/* Returns 1 and fills in st if we have fresh attributes for path,
+ * -ENOENT if we know that path does not exist and 0 if we do not know.
+ */
+static int
+attr_cache_lookup(const char *path, struct nfs_stat_64 *st)
+{
+	struct attr_cache_shard *shard;
+	struct attr_cache_entry *ent;
+	uint32_t hash;
+	int found = 0;
+
+	if (attr_cache == NULL) {
+		return 0;
+	}
+	hash = path_hash(path);
+	shard = attr_cache_shard(hash);
+
+	pthread_mutex_lock(&shard->mutex);
+	ent = attr_cache_find(shard, hash, path);
+	if (ent && ent->expires < monotonic_time()) {
+		attr_cache_unlink(shard, ent);
+		ent = NULL;
+	}
+	if (ent) {
+		if (ent->negative) {
+			found = -ENOENT;
+		} else {
+			*st = ent->st;
+			found = 1;
+		}
+		/* move to the front of the lru */
+		if (ent->lru_prev) {
+			ent->lru_prev->lru_next = ent->lru_next;
+			if (ent->lru_next) {
+				ent->lru_next->lru_prev = ent->lru_prev;
+			} else {
+				shard->lru_tail = ent->lru_prev;
+			}
+			ent->lru_prev = NULL;
+			ent->lru_next = shard->lru_head;
+			shard->lru_head->lru_prev = ent;
+			shard->lru_head = ent;
+		}
+	}
+	pthread_mutex_unlock(&shard->mutex);
+
+	if (found == -ENOENT) {
+		__sync_fetch_and_add(&negative_cache_hits, 1);
+	} else if (found) {
+		__sync_fetch_and_add(&attr_cache_hits, 1);
+	} else {
+		__sync_fetch_and_add(&attr_cache_misses, 1);
+	}
+	return found;
+}
+
+/* Sample this before sending the request whose reply you want to cache. */
+static uint64_t
+attr_cache_generation(const char *path)
+{
+	struct attr_cache_shard *shard;
+	uint64_t generation;
+
+	if (attr_cache == NULL) {
+		return 0;
+	}
+	shard = attr_cache_shard(path_hash(path));
+	pthread_mutex_lock(&shard->mutex);
+	generation = shard->generation;
+	pthread_mutex_unlock(&shard->mutex);
+
+	return generation;
+}
+
+static void
+attr_cache_insert(const char *path, const struct nfs_stat_64 *st,
+		  double ttl, uint64_t generation)
+{
+	struct attr_cache_shard *shard;
+	struct attr_cache_entry *ent;
+	uint32_t hash;
+	size_t len;
+
+	if (attr_cache == NULL || ttl <= 0) {
+		return;
+	}
+	hash = path_hash(path);
+	shard = attr_cache_shard(hash);
+
+	pthread_mutex_lock(&shard->mutex);
+	if (shard->generation != generation) {
+		pthread_mutex_unlock(&shard->mutex);
+		return;
+	}
+	ent = attr_cache_find(shard, hash, path);
+	if (ent) {
+		attr_cache_unlink(shard, ent);
+	}
+	while (shard->num_entries >= ATTR_CACHE_MAX_ENTRIES) {
+		attr_cache_unlink(shard, shard->lru_tail);
+	}
+
+	len = strlen(path);
+	ent = malloc(sizeof(struct attr_cache_entry) + len + 1);
+	if (ent == NULL) {
+		pthread_mutex_unlock(&shard->mutex);
+		return;
+	}
+	memcpy(ent->path, path, len + 1);
+	ent->hash = hash;
+	ent->expires = monotonic_time() + ttl;
+	ent->negative = st == NULL;
+	if (st) {
+		ent->st = *st;
+	}
+
+	ent->next = *attr_cache_bucket(shard, hash);
+	*attr_cache_bucket(shard, hash) = ent;
+	ent->lru_prev = NULL;
+	ent->lru_next = shard->lru_head;
+	if (shard->lru_head) {
+		shard->lru_head->lru_prev = ent;
+	} else {
+		shard->lru_tail = ent;
+	}
+	shard->lru_head = ent;
+	shard->num_entries++;
+	pthread_mutex_unlock(&shard->mutex);
+}
+
+static void
+attr_cache_update(const char *path, const struct nfs_stat_64 *st,
+		  uint64_t generation)
+{
+	attr_cache_insert(path, st, attr_cache_ttl, generation);
+}
+
+/* Remember that path does not exist */
+static void
+attr_cache_update_negative(const char *path, uint64_t generation)
+{
+	attr_cache_insert(path, NULL, negative_cache_ttl, generation);
+}
+
+/* Sample the generation of every shard, for callers that are about to
+ * learn the attributes of many paths from one request, like READDIRPLUS.
+ */
+static void
+attr_cache_snapshot(uint64_t *generations)
+{
+	int i;
+
+	if (attr_cache == NULL) {
+		return;
+	}
+	for (i = 0; i < ATTR_CACHE_SHARDS; i++) {
+		pthread_mutex_lock(&attr_cache[i].mutex);
+		generations[i] = attr_cache[i].generation;
+		pthread_mutex_unlock(&attr_cache[i].mutex);
+	}
+}
+
+static void
+attr_cache_prime(const char *path, const struct nfs_stat_64 *st,
+		 const uint64_t *generations)
+{
+	if (attr_cache == NULL) {
+		return;
+	}
+	attr_cache_update(path, st,
+			  generations[path_hash(path) % ATTR_CACHE_SHARDS]);
+}
+
+static void
+attr_cache_invalidate(const char *path)
+{
+	struct attr_cache_shard *shard;
+	struct attr_cache_entry *ent;
+	uint32_t hash;
+
+	flight_forget(path, 0);
+	if (attr_cache == NULL) {
+		return;
+	}
+	hash = path_hash(path);
+	shard = attr_cache_shard(hash);
+
+	pthread_mutex_lock(&shard->mutex);
+	shard->generation++;
+	ent = attr_cache_find(shard, hash, path);
+	if (ent) {
+		attr_cache_unlink(shard, ent);
+	}
+	pthread_mutex_unlock(&shard->mutex);
+}
+
+/* Drop the entry for the directory that contains path */
+static void
+attr_cache_invalidate_parent(const char *path)
+{
+	char *parent, *p;
+
+	if (attr_cache == NULL && !single_flight) {
+		return;
+	}
+	parent = strdup(path);
+	if (parent == NULL) {
+		return;
+	}
+	p = strrchr(parent, '/');
+	if (p == parent) {
+		p[1] = 0;
+	} else if (p) {
+		*p = 0;
+	}
+	attr_cache_invalidate(parent);
+	free(parent);
+}
+
+/* Drop path and everything below it. Used when a directory is renamed or
+ * removed, which is rare enough that walking the whole cache is fine.
+ */
+static void
+attr_cache_invalidate_tree(const char *path)
+{
+	struct attr_cache_entry *ent, *next;
+	size_t len = strlen(path);
+	int i;
+
+	flight_forget(path, 1);
+	if (attr_cache == NULL) {
+		return;
+	}
+	for (i = 0; i < ATTR_CACHE_SHARDS; i++) {
+		struct attr_cache_shard *shard = &attr_cache[i];
+
+		pthread_mutex_lock(&shard->mutex);
+		shard->generation++;
+		for (ent = shard->lru_head; ent; ent = next) {
+			next = ent->lru_next;
+			if (!strncmp(ent->path, path, len) &&
+			    (ent->path[len] == 0 || ent->path[len] == '/')) {
+				attr_cache_unlink(shard, ent);
+			}
+		}
+		pthread_mutex_unlock(&shard->mutex);
+	}
+}
+
+static void
+nfs_stat_to_stat(const struct nfs_stat_64 *st, struct FUSE_STAT *stbuf)
+{
+	stbuf->st_dev          = st->nfs_dev;
+	stbuf->st_ino          = st->nfs_ino;
+	stbuf->st_mode         = st->nfs_mode;
+	stbuf->st_nlink        = st->nfs_nlink;
+	stbuf->st_uid          = map_uid(st->nfs_uid);
+	stbuf->st_gid          = map_gid(st->nfs_gid);
+	stbuf->st_rdev         = st->nfs_rdev;
+	stbuf->st_size         = st->nfs_size;
+	stbuf->st_blksize      = st->nfs_blksize;
+	stbuf->st_blocks       = st->nfs_blocks;
+
+#if defined(HAVE_ST_ATIM) || defined(__MINGW32__)
+	stbuf->st_atim.tv_sec  = st->nfs_atime;
+	stbuf->st_atim.tv_nsec = st->nfs_atime_nsec;
+	stbuf->st_mtim.tv_sec  = st->nfs_mtime;
+	stbuf->st_mtim.tv_nsec = st->nfs_mtime_nsec;
+	stbuf->st_ctim.tv_sec  = st->nfs_ctime;
+	stbuf->st_ctim.tv_nsec = st->nfs_ctime_nsec;
+#else
+	stbuf->st_atime      = st->nfs_atime;
+	stbuf->st_mtime      = st->nfs_mtime;
+	stbuf->st_ctime      = st->nfs_ctime;
+	stbuf->st_atime_nsec = st->nfs_atime_nsec;
+	stbuf->st_mtime_nsec = st->nfs_mtime_nsec;
+	stbuf->st_ctime_nsec = st->nfs_ctime_nsec;
+#endif
+}
+
+/* Convert the attributes READDIRPLUS returned for a directory entry.
+ * Returns 0 if the server did not send any attributes for it.
+ */
+static int
+nfsdirent_to_nfs_stat(const struct nfsdirent *ent, struct nfs_stat_64 *st)
+{
+	if (ent->nlink == 0) {
+		return 0;
+	}
+
+	memset(st, 0, sizeof(struct nfs_stat_64));
+	st->nfs_dev        = ent->dev;
+	st->nfs_ino        = ent->inode;
+	st->nfs_mode       = ent->mode;
+	st->nfs_nlink      = ent->nlink;
+	st->nfs_uid        = ent->uid;
+	st->nfs_gid        = ent->gid;
+	st->nfs_rdev       = ent->rdev;
+	st->nfs_size       = ent->size;
+	st->nfs_blksize    = ent->blksize;
+	st->nfs_blocks     = ent->blocks;
+	st->nfs_used       = ent->used;
+	st->nfs_atime      = ent->atime.tv_sec;
+	st->nfs_atime_nsec = ent->atime_nsec;
+	st->nfs_mtime      = ent->mtime.tv_sec;
+	st->nfs_mtime_nsec = ent->mtime_nsec;
+	st->nfs_ctime      = ent->ctime.tv_sec;
+	st->nfs_ctime_nsec = ent->ctime_nsec;
+
+	/* Older libnfs only gives us the permission bits in mode */
+	if ((st->nfs_mode & S_IFMT) == 0) {
+		switch (ent->type) {
+		case NF3REG:  st->nfs_mode |= S_IFREG;  break;
+		case NF3DIR:  st->nfs_mode |= S_IFDIR;  break;
+		case NF3BLK:  st->nfs_mode |= S_IFBLK;  break;
+		case NF3CHR:  st->nfs_mode |= S_IFCHR;  break;
+		case NF3LNK:  st->nfs_mode |= S_IFLNK;  break;
+		case NF3SOCK: st->nfs_mode |= S_IFSOCK; break;
+		case NF3FIFO: st->nfs_mode |= S_IFIFO;  break;
+		}
+	}
+	return 1;
+}
+
+static void
+fattr3_to_nfs_stat(const fattr3 *attr, struct nfs_stat_64 *st)
+{
+	memset(st, 0, sizeof(struct nfs_stat_64));
+	st->nfs_dev        = attr->fsid;
+	st->nfs_ino        = attr->fileid;
+	st->nfs_mode       = attr->mode;
+	st->nfs_nlink      = attr->nlink;
+	st->nfs_uid        = attr->uid;
+	st->nfs_gid        = attr->gid;
+	st->nfs_rdev       = makedev(attr->rdev.specdata1, attr->rdev.specdata2);
+	st->nfs_size       = attr->size;
+	st->nfs_blksize    = 4096;
+	st->nfs_blocks     = (attr->used + 511) >> 9;
+	st->nfs_used       = attr->used;
+	st->nfs_atime      = attr->atime.seconds;
+	st->nfs_atime_nsec = attr->atime.nseconds;
+	st->nfs_mtime      = attr->mtime.seconds;
+	st->nfs_mtime_nsec = attr->mtime.nseconds;
+	st->nfs_ctime      = attr->ctime.seconds;
+	st->nfs_ctime_nsec = attr->ctime.nseconds;
+
+	switch (attr->type) {
+	case NF3REG:  st->nfs_mode |= S_IFREG;  break;
+	case NF3DIR:  st->nfs_mode |= S_IFDIR;  break;
+	case NF3BLK:  st->nfs_mode |= S_IFBLK;  break;
+	case NF3CHR:  st->nfs_mode |= S_IFCHR;  break;
+	case NF3LNK:  st->nfs_mode |= S_IFLNK;  break;
+	case NF3SOCK: st->nfs_mode |= S_IFSOCK; break;
+	case NF3FIFO: st->nfs_mode |= S_IFIFO;  break;
+	}
+}
+
+/* For the replies to the raw NFSv3 calls we make ourselves */
+static int
+nfs3_errno(int status)
+{
+	switch (status) {
+	case NFS3_OK:             return 0;
+	case NFS3ERR_PERM:        return -EPERM;
+	case NFS3ERR_NOENT:       return -ENOENT;
+	case NFS3ERR_IO:          return -EIO;
+	case NFS3ERR_NXIO:        return -ENXIO;
+	case NFS3ERR_ACCES:       return -EACCES;
+	case NFS3ERR_EXIST:       return -EEXIST;
+	case NFS3ERR_XDEV:        return -EXDEV;
+	case NFS3ERR_NODEV:       return -ENODEV;
+	case NFS3ERR_NOTDIR:      return -ENOTDIR;
+	case NFS3ERR_ISDIR:       return -EISDIR;
+	case NFS3ERR_INVAL:       return -EINVAL;
+	case NFS3ERR_FBIG:        return -EFBIG;
+	case NFS3ERR_NOSPC:       return -ENOSPC;
+	case NFS3ERR_ROFS:        return -EROFS;
+	case NFS3ERR_MLINK:       return -EMLINK;
+	case NFS3ERR_NAMETOOLONG: return -ENAMETOOLONG;
+	case NFS3ERR_NOTEMPTY:    return -ENOTEMPTY;
+	case NFS3ERR_DQUOT:       return -EDQUOT;
+	case NFS3ERR_STALE:       return -ESTALE;
+	case NFS3ERR_NOTSUPP:     return -ENOTSUP;
+	case NFS3ERR_JUKEBOX:     return -EAGAIN;
+	}
+	return -EIO;
+}
+
+/* Returns a malloced "dir/name" */
+static char *
+path_join(const char *dir, const char *name)
+{
+	size_t dlen = strlen(dir);
+	size_t nlen = strlen(name);
+	char *path;
+
+	while (dlen > 0 && dir[dlen - 1] == '/') {
+		dlen--;
+	}
+	path = malloc(dlen + nlen + 2);
+	if (path == NULL) {
+		return NULL;
+	}
+	memcpy(path, dir, dlen);
+	path[dlen] = '/';
+	memcpy(path + dlen + 1, name, nlen + 1);
+
+	return path;
+}
+
+/*
+ * /.fuse-nfs/stats is answered by us and never reaches the server. It
+ * is not listed in the root directory. The text is generated when the
+ * file is opened and read with direct_io since its size is not known
+ * up front.
+ */
+#define STATS_DIR	"/.fuse-nfs"
+#define STATS_FILE	STATS_DIR "/stats"
+
+static int
+is_stats_path(const char *path)
+{
+	return !strncmp(path, STATS_DIR, sizeof(STATS_DIR) - 1) &&
+		(path[sizeof(STATS_DIR) - 1] == 0 ||
+		 path[sizeof(STATS_DIR) - 1] == '/');
+}
+
+static int
+stats_file_getattr(const char *path, struct FUSE_STAT *stbuf)
+{
+	memset(stbuf, 0, sizeof(struct FUSE_STAT));
+	stbuf->st_uid = getuid();
+	stbuf->st_gid = getgid();
+	stbuf->st_mtime = time(NULL);
+	stbuf->st_atime = stbuf->st_ctime = stbuf->st_mtime;
+	if (!strcmp(path, STATS_DIR)) {
+		stbuf->st_mode = S_IFDIR | 0555;
+		stbuf->st_nlink = 2;
+		return 0;
+	}
+	if (!strcmp(path, STATS_FILE)) {
+		stbuf->st_mode = S_IFREG | 0444;
+		stbuf->st_nlink = 1;
+		return 0;
+	}
+	return -ENOENT;
+}
+
+static int
+stats_file_open(struct fuse_file_info *fi)
+{
+	struct fuse_nfs_fh *fh;
+
+	if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+		return -EACCES;
+	}
+	fh = calloc(1, sizeof(struct fuse_nfs_fh));
+	if (fh == NULL) {
+		return -ENOMEM;
+	}
+	fh->stats_buf = stats_format(&fh->stats_len);
+	if (fh->stats_buf == NULL) {
+		free(fh);
+		return -ENOMEM;
+	}
+	fi->fh = (uint64_t)fh;
+	fi->direct_io = 1;
+
+	return 0;
+}
+
+static int
+stats_file_read(struct fuse_nfs_fh *fh, char *buf, size_t size, off_t offset)
+{
+	if ((size_t)offset >= fh->stats_len) {
+		return 0;
+	}
+	if (size > fh->stats_len - offset) {
+		size = fh->stats_len - offset;
+	}
+	memcpy(buf, fh->stats_buf + offset, size);
+
+	return size;
+}
+
+static void
+stat64_cb(int status, struct nfs_context *nfs, void *data, void *private_data)
+{
+	struct sync_cb_data *cb_data = private_data;
+
+	LOG("stat64_cb status:%d\n", status);
+
+	if (status >= 0) {
+		memcpy(cb_data->return_data, data, sizeof(struct nfs_stat_64));
+	}
+	nfs_reply_done(cb_data, status);
+}
+
+static int wb_flush_path(const char *path);
+
+static int
+fuse_nfs_getattr(const char *path, struct FUSE_STAT *stbuf)
+{
+	STATS_OP(STAT_GETATTR);
+	TRACE_OP(TRACE_GETATTR, path, NULL, NULL, 0, 0, 0, 0);
+	struct nfs_stat_64 st, *copy;
+	struct sync_cb_data cb_data;
+	struct nfs_conn *conn = conn_for_path(path);
+	uint64_t generation;
+	struct flight *f;
+	int leader;
+	int ret;
+
+	LOG("fuse_nfs_getattr entered [%s]\n", path);
+
+	if (is_stats_path(path)) {
+		return stats_file_getattr(path, stbuf);
+	}
+
+	/* The server only knows the size once buffered writes reach it */
+	if (wb_flush_path(path)) {
+		attr_cache_invalidate(path);
+	}
+
+	ret = attr_cache_lookup(path, &st);
+	if (ret < 0) {
+		return ret;
+	}
+	if (ret) {
+		nfs_stat_to_stat(&st, stbuf);
+		return 0;
+	}
+	generation = attr_cache_generation(path);
+
+	f = flight_begin(FLIGHT_GETATTR, path, 0, &leader);
+	if (!leader) {
+		ret = f->status;
+		if (ret == 0) {
+			if (f->result) {
+				nfs_stat_to_stat(f->result, stbuf);
+			} else {
+				ret = -ENOMEM;
+			}
+		}
+		flight_put(f);
+		return ret;
+	}
+
+        memset(&cb_data, 0, sizeof(struct sync_cb_data));
+	cb_data.return_data = &st;
+
+	conn_lock(conn);
+	update_rpc_credentials(conn);
+	ret = nfs_lstat64_async(conn->nfs, path, stat64_cb, &cb_data);
+	pthread_mutex_unlock(&conn->mutex);
+	if (ret < 0) {
+		flight_finish(f, ret, NULL, 0, NULL);
+		flight_put(f);
+		return ret;
+	}
+	wait_for_nfs_reply(conn, &cb_data);
+	copy = NULL;
+	if (f && cb_data.status == 0) {
+		copy = malloc(sizeof(struct nfs_stat_64));
+		if (copy) {
+			*copy = st;
+		}
+	}
+	flight_finish(f, cb_data.status, copy, 0, NULL);
+	flight_put(f);
+	if (cb_data.status == -ENOENT) {
+		attr_cache_update_negative(path, generation);
+	}
+	if (cb_data.status < 0) {
+		return cb_data.status;
+	}
+
+	attr_cache_update(path, &st, generation);
+	nfs_stat_to_stat(&st, stbuf);
+
+	return cb_data.status;
+}
+
+/*
+ * Attribute prefetch (--prefetch_max).
+ *
+ * du, rsync and find list a directory and then stat every entry, one
+ * round trip at a time. When a listing comes back without attributes
+ * for some entries, because the server has no READDIRPLUS or left them
+ * out, readdir queues those entries and a thread sends GETATTRs for
+ * them in the background, at most prefetch_max at a time, as the caller
+ * that listed the directory. The replies go into the attribute cache,
+ * where the getattr calls that follow find them. With --single_flight a
+ * getattr that comes in while its prefetch is in flight waits for that
+ * instead of sending another.
+ */
+#define PREFETCH_QUEUE_MAX	65536
+
+struct prefetch {
+	struct prefetch *next;
+	uid_t uid;
+	gid_t gid;
+	uint64_t generation;
+	struct flight *flight;
+	char path[];
+};
+
+static int prefetch_max;
+static pthread_mutex_t prefetch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
+static struct prefetch *prefetch_head, *prefetch_tail;
+static int prefetch_queued;
+static int prefetch_inflight;
+static int prefetch_thread_running;
+static int prefetch_thread_shutdown;
+static pthread_t prefetch_thread;
+static uint64_t prefetch_sent;
+static uint64_t prefetch_cached;
+static uint64_t prefetch_dropped;
+
+/* Queue dir/name for prefetching, as the current caller */
+static void
+prefetch_attr(const char *dir, const char *name)
+{
+	struct prefetch *pf;
+	char *path;
+
+	if (prefetch_max <= 0 || attr_cache == NULL || dir == NULL ||
+	    !strcmp(name, ".") || !strcmp(name, "..")) {
+		return;
+	}
+	path = path_join(dir, name);
+	if (path == NULL) {
+		return;
+	}
+	pf = malloc(sizeof(struct prefetch) + strlen(path) + 1);
+	if (pf == NULL) {
+		free(path);
+		return;
+	}
+	pf->next = NULL;
+	pf->uid = caller_uid();
+	pf->gid = caller_gid();
+	pf->flight = NULL;
+	strcpy(pf->path, path);
+	free(path);
+
+	pthread_mutex_lock(&prefetch_mutex);
+	if (!prefetch_thread_running || prefetch_queued >= PREFETCH_QUEUE_MAX) {
+		prefetch_dropped++;
+		pthread_mutex_unlock(&prefetch_mutex);
+		free(pf);
+		return;
+	}
+	if (prefetch_tail) {
+		prefetch_tail->next = pf;
+	} else {
+		prefetch_head = pf;
+	}
+	prefetch_tail = pf;
+	prefetch_queued++;
+	pthread_cond_signal(&prefetch_cond);
+	pthread_mutex_unlock(&prefetch_mutex);
+}
+
+static void
+prefetch_done(struct prefetch *pf)
+{
+	free(pf);
+	pthread_mutex_lock(&prefetch_mutex);
+	prefetch_inflight--;
+	pthread_cond_signal(&prefetch_cond);
+	pthread_mutex_unlock(&prefetch_mutex);
+}
+
+static void
+prefetch_cb(int status, struct nfs_context *nfs, void *data, void *private_data)
+{
+	struct prefetch *pf = private_data;
+	struct nfs_stat_64 *copy = NULL;
+
+	if (status == 0) {
+		attr_cache_update(pf->path, data, pf->generation);
+	} else if (status == -ENOENT) {
+		attr_cache_update_negative(pf->path, pf->generation);
+	}
+	if (pf->flight && status == 0) {
+		copy = malloc(sizeof(struct nfs_stat_64));
+		if (copy) {
+			*copy = *(struct nfs_stat_64 *)data;
+		}
+	}
+	flight_finish(pf->flight, status, copy, 0, NULL);
+	flight_put(pf->flight);
+	prefetch_done(pf);
+}
+
+static void *
+prefetch_loop(void *arg)
+{
+	struct nfs_stat_64 st;
+	struct nfs_conn *conn;
+	struct prefetch *pf;
+	int ret;
+
+	pthread_mutex_lock(&prefetch_mutex);
+	while (!prefetch_thread_shutdown) {
+		if (prefetch_head == NULL || prefetch_inflight >= prefetch_max) {
+			pthread_cond_wait(&prefetch_cond, &prefetch_mutex);
+			continue;
+		}
+		pf = prefetch_head;
+		prefetch_head = pf->next;
+		if (prefetch_head == NULL) {
+			prefetch_tail = NULL;
+		}
+		prefetch_queued--;
+		prefetch_inflight++;
+		pthread_mutex_unlock(&prefetch_mutex);
+
+		/* Act as the caller that listed the directory, the same way
+		 * the low-level frontend tells caller_uid() who it is.
+		 */
+		ll_caller_set = 1;
+		ll_caller_uid = pf->uid;
+		ll_caller_gid = pf->gid;
+
+		/* A getattr may have fetched it while it was queued */
+		if (attr_cache_lookup(pf->path, &st) != 0) {
+			prefetch_done(pf);
+			pthread_mutex_lock(&prefetch_mutex);
+			prefetch_cached++;
+			continue;
+		}
+
+		pf->generation = attr_cache_generation(pf->path);
+		if (flight_start(FLIGHT_GETATTR, pf->path, 0, &pf->flight) < 0) {
+			/* A getattr is already fetching it */
+			prefetch_done(pf);
+			pthread_mutex_lock(&prefetch_mutex);
+			continue;
+		}
+
+		conn = conn_for_path(pf->path);
+		conn_lock(conn);
+		update_rpc_credentials(conn);
+		ret = nfs_lstat64_async(conn->nfs, pf->path, prefetch_cb, pf);
+		pthread_mutex_unlock(&conn->mutex);
+		if (ret < 0) {
+			flight_finish(pf->flight, ret, NULL, 0, NULL);
+			flight_put(pf->flight);
+			prefetch_done(pf);
+		} else {
+			wake_service_thread(conn);
+		}
+
+		pthread_mutex_lock(&prefetch_mutex);
+		if (ret == 0) {
+			prefetch_sent++;
+		}
+	}
+	pthread_mutex_unlock(&prefetch_mutex);
+
+	return NULL;
+}
+
+static void
+prefetch_start(void)
+{
+	if (prefetch_max <= 0 || attr_cache == NULL || prefetch_thread_running) {
+		return;
+	}
+	prefetch_thread_shutdown = 0;
+	if (pthread_create(&prefetch_thread, NULL, prefetch_loop, NULL) == 0) {
+		prefetch_thread_running = 1;
+	}
+}
+
+/* Stop sending prefetches and throw away the queue. The ones in flight
+ * complete into the attribute cache as long as the connections run.
+ */
+static void
+prefetch_stop(void)
+{
+	struct prefetch *pf;
+
+	if (!prefetch_thread_running) {
+		return;
+	}
+	pthread_mutex_lock(&prefetch_mutex);
+	prefetch_thread_shutdown = 1;
+	pthread_cond_signal(&prefetch_cond);
+	pthread_mutex_unlock(&prefetch_mutex);
+	pthread_join(prefetch_thread, NULL);
+
+	pthread_mutex_lock(&prefetch_mutex);
+	prefetch_thread_running = 0;
+	while ((pf = prefetch_head) != NULL) {
+		prefetch_head = pf->next;
+		free(pf);
+	}
+	prefetch_tail = NULL;
+	prefetch_queued = 0;
+	pthread_mutex_unlock(&prefetch_mutex);
+}
+
+static void
+readdir_cb(int status, struct nfs_context *nfs, void *data, void *private_data)
+{
+	struct sync_cb_data *cb_data = private_data;
+
+	LOG("readdir_cb status:%d\n", status);
+
+	if (status >= 0) {
+		cb_data->return_data = data;
+	}
+	nfs_reply_done(cb_data, status);
+}
+
+/*
+ * Streaming readdir. Instead of letting nfs_opendir_async() pull the whole
+ * directory into memory on every readdir call we keep a READDIRPLUS cursor
+ * per open directory and hand the NFS cookies to FUSE as the offsets, so
+ * the kernel pages through the listing one bounded batch at a time.
+ * This talks NFSv3 directly and is only used with --readdir_stream.
+ */
+#define READDIR_STREAM_DIRCOUNT	8192
+#define READDIR_STREAM_MAXCOUNT	32768
+
+static int readdir_stream;
+
+struct dir_batch_entry {
+	char *name;
+	uint64_t cookie;
+	int has_attr;
+	struct nfs_stat_64 st;
+};
+
+/* What we store in fi->fh for a streamed directory */
+struct fuse_nfs_dir {
+	struct nfs_conn *conn;
+	struct nfsfh *nfsfh;
+	struct nfs_fh3 fh;
+	cookieverf3 cookieverf;
+
+	/* The batch we got back for the READDIRPLUS at batch_cookie */
+	uint64_t batch_cookie;
+	int eof;
+	int num_entries;
+	struct dir_batch_entry *entries;
+	uint64_t generations[ATTR_CACHE_SHARDS];
+};
+
+static void
+free_dir_batch(struct fuse_nfs_dir *dir)
+{
+	int i;
+
+	for (i = 0; i < dir->num_entries; i++) {
+		free(dir->entries[i].name);
+	}
+	free(dir->entries);
+	dir->entries = NULL;
+	dir->num_entries = 0;
+}
+
+static void
+readdirplus_cb(struct rpc_context *rpc, int status, void *data,
+	       void *private_data)
+{
+	struct sync_cb_data *cb_data = private_data;
+	struct fuse_nfs_dir *dir = cb_data->return_data;
+	READDIRPLUS3res *res = data;
+	READDIRPLUS3resok *resok;
+	entryplus3 *e;
+	int num = 0;
+
+	if (status != RPC_STATUS_SUCCESS) {
+		nfs_reply_done(cb_data, -EIO);
+		return;
+	}
+	if (res->status != NFS3_OK) {
+		nfs_reply_done(cb_data, nfs3_errno(res->status));
+		return;
+	}
+	resok = &res->READDIRPLUS3res_u.resok;
+
+	for (e = resok->reply.entries; e; e = e->nextentry) {
+		num++;
+	}
+	dir->entries = calloc(num ? num : 1, sizeof(struct dir_batch_entry));
+	if (dir->entries == NULL) {
+		nfs_reply_done(cb_data, -ENOMEM);
+		return;
+	}
+	for (e = resok->reply.entries; e; e = e->nextentry) {
+		struct dir_batch_entry *ent = &dir->entries[dir->num_entries];
+
+		ent->name = strdup(e->name);
+		if (ent->name == NULL) {
+			nfs_reply_done(cb_data, -ENOMEM);
+			return;
+		}
+		ent->cookie = e->cookie;
+		if (e->name_attributes.attributes_follow) {
+			fattr3_to_nfs_stat(&e->name_attributes.post_op_attr_u.attributes,
+					   &ent->st);
+			ent->has_attr = 1;
+		}
+		dir->num_entries++;
+	}
+	memcpy(dir->cookieverf, resok->cookieverf, NFS3_COOKIEVERFSIZE);
+	/* A batch without entries can not move the cursor forward */
+	dir->eof = resok->reply.eof || num == 0;
+
+	nfs_reply_done(cb_data, 0);
+}
+
+static int
+fetch_dir_batch(struct fuse_nfs_dir *dir, uint64_t cookie)
+{
+	struct nfs_conn *conn = dir->conn;
+	struct READDIRPLUS3args args;
+	struct sync_cb_data cb_data;
+	int ret;
+
+	free_dir_batch(dir);
+	if (cookie == 0) {
+		memset(dir->cookieverf, 0, NFS3_COOKIEVERFSIZE);
+	}
+	attr_cache_snapshot(dir->generations);
+
+	memset(&args, 0, sizeof(args));
+	args.dir = dir->fh;
+	args.cookie = cookie;
+	memcpy(args.cookieverf, dir->cookieverf, NFS3_COOKIEVERFSIZE);
+	args.dircount = READDIR_STREAM_DIRCOUNT;
+	args.maxcount = READDIR_STREAM_MAXCOUNT;
+
+        memset(&cb_data, 0, sizeof(struct sync_cb_data));
+	cb_data.return_data = dir;
+
+	conn_lock(conn);
+	update_rpc_credentials(conn);
+	ret = rpc_nfs3_readdirplus_async(nfs_get_rpc_context(conn->nfs),
+					 readdirplus_cb, &args, &cb_data);
+	pthread_mutex_unlock(&conn->mutex);
+	if (ret < 0) {
+		return -ENOMEM;
+	}
+	wait_for_nfs_reply(conn, &cb_data);
+	if (cb_data.status < 0) {
+		free_dir_batch(dir);
+		dir->batch_cookie = -1;
+		return cb_data.status;
+	}
+	dir->batch_cookie = cookie;
+
+	return 0;
+}
+
+static int
+fuse_nfs_readdir_stream(const char *path, struct fuse_nfs_dir *dir, void *buf,
+			fuse_fill_dir_t filler, off_t offset)
+{
+	uint64_t cookie = offset;
+	struct FUSE_STAT st;
+	int i, ret;
+
+	for (;;) {
+		/* Find where offset puts us in the batch we already have */
+		i = -1;
+		if (dir->entries && cookie == dir->batch_cookie) {
+			i = 0;
+		} else if (dir->entries) {
+			for (i = dir->num_entries - 1; i >= 0; i--) {
+				if (dir->entries[i].cookie == cookie) {
+					break;
+				}
+			}
+			if (i >= 0) {
+				i++;
+			}
+		}
+		if (i < 0 || (i == dir->num_entries && !dir->eof)) {
+			ret = fetch_dir_batch(dir, cookie);
+			if (ret < 0) {
+				return ret;
+			}
+			i = 0;
+		}
+
+		for (; i < dir->num_entries; i++) {
+			struct dir_batch_entry *ent = &dir->entries[i];
+
+			if (!ent->has_attr) {
+				if (filler(buf, ent->name, NULL, ent->cookie)) {
+					return 0;
+				}
+				prefetch_attr(path, ent->name);
+				continue;
+			}
+			memset(&st, 0, sizeof(st));
+			nfs_stat_to_stat(&ent->st, &st);
+			if (filler(buf, ent->name, &st, ent->cookie)) {
+				return 0;
+			}
+			if (attr_cache && path && strcmp(ent->name, ".") &&
+			    strcmp(ent->name, "..")) {
+				char *child = path_join(path, ent->name);
+
+				if (child) {
+					attr_cache_prime(child, &ent->st,
+							 dir->generations);
+					free(child);
+				}
+			}
+		}
+		if (dir->eof) {
+			return 0;
+		}
+		cookie = dir->entries[dir->num_entries - 1].cookie;
+	}
+}
+
+static int
+fuse_nfs_opendir(const char *path, struct fuse_file_info *fi)
+{
+	STATS_OP(STAT_OPENDIR);
+	TRACE_OP(TRACE_OPENDIR, path, NULL, fi, 0, 0, 0, 0);
+	struct sync_cb_data cb_data;
+	struct nfs_conn *conn = conn_for_path(path);
+	struct fuse_nfs_dir *dir;
+	int ret;
+
+	LOG("fuse_nfs_opendir entered [%s]\n", path);
+
+	fi->fh = 0;
+	if (!readdir_stream || nfs_version != 3 || is_stats_path(path)) {
+		return 0;
+	}
+
+        memset(&cb_data, 0, sizeof(struct sync_cb_data));
+
+	dir = calloc(1, sizeof(struct fuse_nfs_dir));
+	if (dir == NULL) {
+		return -ENOMEM;
+	}
+
+	conn_lock(conn);
+	update_rpc_credentials(conn);
+	ret = nfs_open_async(conn->nfs, path, O_RDONLY, readdir_cb, &cb_data);
+	pthread_mutex_unlock(&conn->mutex);
+	if (ret < 0) {
+		free(dir);
+		return ret;
+	}
+	wait_for_nfs_reply(conn, &cb_data);
+	if (cb_data.status < 0) {
+		free(dir);
+		/* Let readdir fall back to listing the whole directory */
+		if (cb_data.status == -EISDIR || cb_data.status == -EINVAL) {
+			return 0;
+		}
+		return cb_data.status;
+	}
+
+	dir->conn = conn;
+	dir->nfsfh = cb_data.return_data;
+	dir->fh.data.data_len = nfs_get_fh(dir->nfsfh)->len;
+	dir->fh.data.data_val = nfs_get_fh(dir->nfsfh)->val;
+	dir->batch_cookie = -1;
+	fi->fh = (uint64_t)dir;
+
+	return 0;
+}
+
+static int
+fuse_nfs_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	STATS_OP(STAT_RELEASEDIR);
+	TRACE_OP(TRACE_RELEASEDIR, path, NULL, fi, 0, 0, 0, 0);
+	struct fuse_nfs_dir *dir = (struct fuse_nfs_dir *)fi->fh;
+	struct sync_cb_data cb_data;
+
+	if (dir == NULL) {
+		return 0;
+	}
+
+        memset(&cb_data, 0, sizeof(struct sync_cb_data));
+
+	conn_lock(dir->conn);
+	nfs_close_async(dir->conn->nfs, dir->nfsfh, generic_cb, &cb_data);
+	pthread_mutex_unlock(&dir->conn->mutex);
+	wait_for_nfs_reply(dir->conn, &cb_data);
+
+	free_dir_batch(dir);
+	free(dir);
+	fi->fh = 0;
+
+	return 0;
+}
+
+/* A whole directory listing, as single flight shares it between callers */
+struct dir_listing {
+	int num_entries;
+	struct dir_batch_entry entries[];
+};
+
+static void
+dir_listing_free(void *result, size_t len)
+{
+	struct dir_listing *listing = result;
+	int i;
+
+	if (listing == NULL) {
+		return;
+	}
+	for (i = 0; i < listing->num_entries; i++) {
+		free(listing->entries[i].name);
+	}
+	free(listing);
+}
+
+/* Copy what libnfs read into a listing, priming the attribute cache */
+static struct dir_listing *
+dir_listing_read(struct nfs_conn *conn, const char *path,
+		 struct nfsdir *nfsdir, uint64_t *generations)
+{
+	struct dir_listing *listing, *bigger;
+	struct dir_batch_entry *ent;
+	struct nfsdirent *nfsdirent;
+	int size = 64;
+
+	listing = calloc(1, sizeof(struct dir_listing) +
+			 size * sizeof(struct dir_batch_entry));
+	if (listing == NULL) {
+		return NULL;
+	}
+
+	while ((nfsdirent = nfs_readdir(conn->nfs, nfsdir)) != NULL) {
+		if (listing->num_entries == size) {
+			size *= 2;
+			bigger = realloc(listing, sizeof(struct dir_listing) +
+					 size * sizeof(struct dir_batch_entry));
+			if (bigger == NULL) {
+				dir_listing_free(listing, 0);
+				return NULL;
+			}
+			listing = bigger;
+		}
+		ent = &listing->entries[listing->num_entries];
+		memset(ent, 0, sizeof(struct dir_batch_entry));
+		ent->name = strdup(nfsdirent->name);
+		if (ent->name == NULL) {
+			dir_listing_free(listing, 0);
+			return NULL;
+		}
+		listing->num_entries++;
+		if (!nfsdirent_to_nfs_stat(nfsdirent, &ent->st)) {
+			prefetch_attr(path, nfsdirent->name);
+			continue;
+		}
+		ent->has_attr = 1;
+		if (attr_cache && strcmp(nfsdirent->name, ".") &&
+		    strcmp(nfsdirent->name, "..")) {
+			char *child = path_join(path, nfsdirent->name);
+
+			if (child) {
+				attr_cache_prime(child, &ent->st, generations);
+				free(child);
+			}
+		}
+	}
+
+	return listing;
+}
+
+static void
+dir_listing_fill(const struct dir_listing *listing, void *buf,
+		 fuse_fill_dir_t filler)
+{
+	struct FUSE_STAT st;
+	int i;
+
+	for (i = 0; i < listing->num_entries; i++) {
+		const struct dir_batch_entry *ent = &listing->entries[i];
+
+		if (!ent->has_attr) {
+			filler(buf, ent->name, NULL, 0);
+			continue;
+		}
+		memset(&st, 0, sizeof(st));
+		nfs_stat_to_stat(&ent->st, &st);
+		filler(buf, ent->name, &st, 0);
+	}
+}
+
+static int
+fuse_nfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+		 off_t offset, struct fuse_file_info *fi)
+{
+	STATS_OP(STAT_READDIR);
+	TRACE_OP(TRACE_READDIR, path, NULL, fi, offset, 0, 0, 0);
+	struct nfsdir *nfsdir;
+	struct nfsdirent *nfsdirent;
+	struct sync_cb_data cb_data;
+	struct nfs_conn *conn = conn_for_path(path);
+	uint64_t generations[ATTR_CACHE_SHARDS];
+	struct dir_listing *listing;
+	struct nfs_stat_64 nst;
+	struct FUSE_STAT st;
+	struct flight *f;
+	int leader;
+	int ret;
+
+	LOG("fuse_nfs_readdir entered [%s]\n", path);
+
+	if (!strcmp(path, STATS_DIR)) {
+		filler(buf, ".", NULL, 0);
+		filler(buf, "..", NULL, 0);
+		filler(buf, "stats", NULL, 0);
+		return 0;
+	}
+	if (fi->fh) {
+		return fuse_nfs_readdir_stream(path, (struct fuse_nfs_dir *)fi->fh,
+					       buf, filler, offset);
+	}
+
+	f = flight_begin(FLIGHT_READDIR, path, 0, &leader);
+	if (!leader) {
+		ret = f->status;
+		if (ret == 0) {
+			if (f->result) {
+				dir_listing_fill(f->result, buf, filler);
+			} else {
+				ret = -ENOMEM;
+			}
+		}
+		flight_put(f);
+		return ret;
+	}
+
+        memset(&cb_data, 0, sizeof(struct sync_cb_data));
+	attr_cache_snapshot(generations);
+
+	conn_lock(conn);
+        update_rpc_credentials(conn);
+	ret = nfs_opendir_async(conn->nfs, path, readdir_cb, &cb_data);
+	pthread_mutex_unlock(&conn->mutex);
+	if (ret < 0) {
+		flight_finish(f, ret, NULL, 0, NULL);
+		flight_put(f);
+		return ret;
+	}
+	wait_for_nfs_reply(conn, &cb_data);
+	if (cb_data.status < 0) {
+		flight_finish(f, cb_data.status, NULL, 0, NULL);
+		flight_put(f);
+		return cb_data.status;
+	}
+
+	/* libnfs fetches the listing with READDIRPLUS, so hand the attributes
+	 * to FUSE and keep them around for the getattr calls that follow.
+	 */
+	nfsdir = cb_data.return_data;
+	if (f) {
+		/* Keep a copy the callers that joined us can fill from */
+		listing = dir_listing_read(conn, path, nfsdir, generations);
+		nfs_closedir(conn->nfs, nfsdir);
+		ret = listing ? 0 : -ENOMEM;
+		flight_finish(f, ret, listing, 0, dir_listing_free);
+		if (listing) {
+			dir_listing_fill(listing, buf, filler);
+		}
+		flight_put(f);
+		return ret;
+	}
+	while ((nfsdirent = nfs_readdir(conn->nfs, nfsdir)) != NULL) {
+		if (!nfsdirent_to_nfs_stat(nfsdirent, &nst)) {
+			if (filler(buf, nfsdirent->name, NULL, 0) == 0) {
+				prefetch_attr(path, nfsdirent->name);
+			}
+			continue;
+		}
+		if (attr_cache && strcmp(nfsdirent->name, ".") &&
+		    strcmp(nfsdirent->name, "..")) {
+			char *child = path_join(path, nfsdirent->name);
+
+			if (child) {
+				attr_cache_prime(child, &nst, generations);
+				free(child);
+			}
+		}
+		memset(&st, 0, sizeof(st));
+		nfs_stat_to_stat(&nst, &st);
+		filler(buf, nfsdirent->name, &st, 0);
+	}
+
+	nfs_closedir(conn->nfs, nfsdir);
+
+	return cb_data.status;
+}
+
+static void
+readlink_cb(int status, struct nfs_context *nfs, void *data, void *private_data)
+{
+	struct sync_cb_data *cb_data = private_data;
+
+	if (status >= 0) {
+		strncat(cb_data->return_data, data, cb_data->max_size);
+	}
+	nfs_reply_done(cb_data, status);
+}
+
+static int
+fuse_nfs_readlink(const char *path, char *buf, size_t size)
+{
+	STATS_OP(STAT_READLINK);
+	TRACE_OP(TRACE_READLINK, path, NULL, NULL, 0, size, 0, 0);
+	struct sync_cb_data cb_data;
+	struct nfs_conn *conn = conn_for_path(path);
+	struct flight *f;
+	int leader;
+	int ret;
+
+	LOG("fuse_nfs_readlink entered [%s]\n", path);
+
+	*buf = 0;
+	f = flight_begin(FLIGHT_READLINK, path, size, &leader);
+	if (!leader) {
+		ret = f->status;
+		if (ret == 0) {
+			if (f->result) {
+				memcpy(buf, f->result, f->result_len);
+			} else {
+				ret = -ENOMEM;
+			}
+		}
+		flight_put(f);
+		return ret;
+	}
+
+        memset(&cb_data, 0, sizeof(struct sync_cb_data));
+	cb_data.return_data = buf;
+	cb_data.max_size = size;
+
+	conn_lock(conn);
+        update_rpc_credentials(conn);
+	ret = nfs_readlink_async(conn->nfs, path, readlink_cb, &cb_data);
+	pthread_mutex_unlock(&conn->mutex);
+	if (ret < 0) {
+		flight_finish(f, ret, NULL, 0, NULL);
+		flight_put(f);
+		return ret;
+	}
+	wait_for_nfs_reply(conn, &cb_data);
+	flight_finish(f, cb_data.status, f ? strdup(buf) : NULL,
+		      strlen(buf) + 1, NULL);
+	flight_put(f);
+
+	return cb_data.status;
+}
+
+static void
+open_cb(int status, struct nfs_context *nfs, void *data, void *private_data)
+{
+	struct sync_cb_data *cb_data = private_data;
+
+	LOG("open_cb status:%d\n", status);
+
+	if (status >= 0) {
+		cb_data->return_data = data;
+	}
+	nfs_reply_done(cb_data, status);
+}
+
+static void
+fuse_nfs_fh_init(struct fuse_nfs_fh *fh)
+{
+	pthread_mutex_init(&fh->ra_mutex, NULL);
+	pthread_cond_init(&fh->ra_cond, NULL);
+	fh->ra_eof = UINT64_MAX;
+	pthread_mutex_init(&fh->wb_mutex, NULL);
+	rpc_credentials(&fh->uid, &fh->gid);
+}
+
+/*
+ * Open handle cache (--open_cache_max, --open_cache_timeout).
+ *
+ * nfs_open_async() costs a LOOKUP per path component plus ACCESS and
+ * GETATTR. With the cache, release parks the nfsfh instead of closing
+ * it, and the next open of the same path with the same flags by the
+ * same user takes it back after a single GETATTR on the handle has shown
+ * that the file is still there. Handles that have been idle for the
+ * timeout, or that do not fit under the cap, are closed without waiting,
+ * idle ones by the service thread of the first connection.
+ *
+ * Removing or renaming a path through this mount drops its handles at
+ * once. A file replaced by another client is only noticed after the
+ * timeout, as with the attribute cache. NFSv3 only, where an open file
+ * holds no state on the server.
+ */
+#define OPEN_CACHE_BUCKETS	1024
+
+/* The open flags that make two handles of a path different */
+#define OPEN_CACHE_FLAGS	(O_ACCMODE|O_APPEND|O_SYNC|O_DSYNC)
+
+struct open_cache_entry {
+	struct open_cache_entry *next;
+	struct open_cache_entry *lru_prev, *lru_next;
+	uint32_t hash;
+	int flags;
+	uid_t uid;
+	gid_t gid;
+	double parked;
+	struct nfs_conn *conn;
+	struct nfsfh *nfsfh;
+	char path[];
+};
+
+static int open_cache_max;
+static double open_cache_timeout = 1.0;
+static pthread_mutex_t open_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct open_cache_entry *open_cache_buckets[OPEN_CACHE_BUCKETS];
+static struct open_cache_entry *open_cache_head, *open_cache_tail;
+static int open_cache_entries;
+static uint64_t open_cache_hits;
+static uint64_t open_cache_misses;
+static uint64_t open_cache_stale;
+
+/* Must be called with open_cache_mutex held */
+static void
+open_cache_unlink(struct open_cache_entry *ent)
+{
+	struct open_cache_entry **pp;
+
+	for (pp = &open_cache_buckets[ent->hash % OPEN_CACHE_BUCKETS]; *pp;
+	     pp = &(*pp)->next) {
+		if (*pp == ent) {
+			*pp = ent->next;
+			break;
+		}
+	}
+	if (ent->lru_prev) {
+		ent->lru_prev->lru_next = ent->lru_next;
+	} else {
+		open_cache_head = ent->lru_next;
+	}
+	if (ent->lru_next) {
+		ent->lru_next->lru_prev = ent->lru_prev;
+	} else {
+		open_cache_tail = ent->lru_prev;
+	}
+	open_cache_entries--;
+}
+
+static void
+open_cache_close_cb(int status, struct nfs_context *nfs, void *data,
+		    void *private_data)
+{
+}
+
+/* Close the handles on the list, linked through next, and free them */
+static void
+open_cache_close(struct open_cache_entry *list)
+{
+	struct open_cache_entry *ent;
+
+	while ((ent = list) != NULL) {
+		list = ent->next;
+		conn_lock(ent->conn);
+		nfs_close_async(ent->conn->nfs, ent->nfsfh, open_cache_close_cb,
+				NULL);
+		pthread_mutex_unlock(&ent->conn->mutex);
+		free(ent);
+	}
+}
+
+/* Take the handles that have been idle too long, or are over the cap, out
+ * of the cache and return them as a list for open_cache_close().
+ * Must be called with open_cache_mutex held.
+ */
+static struct open_cache_entry *
+open_cache_expire(double now)
+{
+	struct open_cache_entry *ent, *list = NULL;
+
+	while ((ent = open_cache_tail) != NULL &&
+	       (open_cache_entries > open_cache_max ||
+		ent->parked + open_cache_timeout < now)) {
+		open_cache_unlink(ent);
+		ent->next = list;
+		list = ent;
+	}
+	return list;
+}
+
+/* Park the handle of a file being released. Returns 0 if the cache took
+ * it, otherwise the caller has to close it.
+ */
+static int
+open_cache_put(const char *path, int flags, struct fuse_nfs_fh *fh)
+{
+	struct open_cache_entry *ent, **bucket, *expired;
+	double now = monotonic_time();
+
+	if (open_cache_max <= 0 || (flags & O_TRUNC)) {
+		return -1;
+	}
+	ent = malloc(sizeof(*ent) + strlen(path) + 1);
+	if (ent == NULL) {
+		return -1;
+	}
+	strcpy(ent->path, path);
+	ent->flags = flags & OPEN_CACHE_FLAGS;
+	ent->hash = path_hash(path) ^ ent->flags;
+	ent->uid = fh->uid;
+	ent->gid = fh->gid;
+	ent->parked = now;
+	ent->conn = fh->conn;
+	ent->nfsfh = fh->nfsfh;
+
+	pthread_mutex_lock(&open_cache_mutex);
+	bucket = &open_cache_buckets[ent->hash % OPEN_CACHE_BUCKETS];
+	ent->next = *bucket;
+	*bucket = ent;
+	ent->lru_prev = NULL;
+	ent->lru_next = open_cache_head;
+	if (open_cache_head) {
+		open_cache_head->lru_prev = ent;
+	} else {
+		open_cache_tail = ent;
+	}
+	open_cache_head = ent;
+	open_cache_entries++;
+	expired = open_cache_expire(now);
+	pthread_mutex_unlock(&open_cache_mutex);
+
+	open_cache_close(expired);
+	return 0;
+}
+
+/* Take a parked handle for opening path with flags, NULL if there is none */
+static struct open_cache_entry *
+open_cache_get(const char *path, int flags)
+{
+	struct open_cache_entry *ent, *expired;
+	uint32_t hash;
+	uid_t uid;
+	gid_t gid;
+
+	if (open_cache_max <= 0 || (flags & O_TRUNC)) {
+		return NULL;
+	}
+	flags &= OPEN_CACHE_FLAGS;
+	hash = path_hash(path) ^ flags;
+	rpc_credentials(&uid, &gid);
+
+	pthread_mutex_lock(&open_cache_mutex);
+	expired = open_cache_expire(monotonic_time());
+	for (ent = open_cache_buckets[hash % OPEN_CACHE_BUCKETS]; ent;
+	     ent = ent->next) {
+		if (ent->hash == hash && ent->flags == flags &&
+		    ent->uid == uid && ent->gid == gid &&
+		    !strcmp(ent->path, path)) {
+			open_cache_unlink(ent);
+			break;
+		}
+	}
+	if (ent) {
+		open_cache_hits++;
+	} else {
+		open_cache_misses++;
+	}
+	pthread_mutex_unlock(&open_cache_mutex);
+
+	open_cache_close(expired);
+	return ent;
+}
+
+/* Close handles that have been idle for the timeout even when no open or
+ * release comes along to do it. Called from the service loop of the
+ * first connection, without its mutex held.
+ */
+static void
+open_cache_tick(void)
+{
+	static double next_tick;
+	struct open_cache_entry *expired;
+	double now;
+
+	if (open_cache_max <= 0) {
+		return;
+	}
+	now = monotonic_time();
+	if (now < next_tick) {
+		return;
+	}
+	next_tick = now + 0.1;
+
+	pthread_mutex_lock(&open_cache_mutex);
+	expired = open_cache_expire(now);
+	pthread_mutex_unlock(&open_cache_mutex);
+
+	open_cache_close(expired);
+}
+
+/* Check that a handle from the cache still refers to a file */
+static int
+open_cache_revalidate(struct open_cache_entry *ent)
+{
+	struct nfs_conn *conn = ent->conn;
+	struct sync_cb_data cb_data;
+	struct nfs_stat_64 st;
+	int ret;
+
+	memset(&cb_data, 0, sizeof(struct sync_cb_data));
+	cb_data.return_data = &st;
+	conn_lock(conn);
+	update_rpc_credentials(conn);
+	ret = nfs_fstat64_async(conn->nfs, ent->nfsfh, stat64_cb, &cb_data);
+	pthread_mutex_unlock(&conn->mutex);
+	if (ret < 0) {
+		return ret;
+	}
+	wait_for_nfs_reply(conn, &cb_data);
+	if (cb_data.status < 0) {
+		return cb_data.status;
+	}
+	return S_ISREG(st.nfs_mode) ? 0 : -ESTALE;
+}
+
+/* Drop the handles of path and everything below it */
+static void
+open_cache_invalidate_tree(const char *path)
+{
+	struct open_cache_entry *ent, *next, *list = NULL;
+	size_t len = strlen(path);
+
+	if (open_cache_max <= 0) {
+		return;
+	}
+	pthread_mutex_lock(&open_cache_mutex);
+	for (ent = open_cache_head; ent; ent = next) {
+		next = ent->lru_next;
+		if (!strncmp(ent->path, path, len) &&
+		    (ent->path[len] == 0 || ent->path[len] == '/')) {
+			open_cache_unlink(ent);
+			ent->next = list;
+			list = ent;
+		}
+	}
+	pthread_mutex_unlock(&open_cache_mutex);
+
+	open_cache_close(list);
+}
+
+static void fuse_nfs_ra_drop(struct fuse_nfs_fh *fh);
+static int fuse_nfs_wb_sync(struct fuse_nfs_fh *fh, int commit);
+static void wb_open_add(struct fuse_nfs_fh *fh, const char *path, int flags);
+static void wb_open_remove(struct fuse_nfs_fh *fh);
+static void disk_cache_open(struct fuse_nfs_fh *fh, int flags);
+static void statfs_cache_wrote(uint64_t bytes);
+static void statfs_cache_kick(void);
+
+static int
+fuse_nfs_open(const char *path, struct fuse_file_info *fi)
+{
+	STATS_OP(STAT_OPEN);
+	TRACE_OP(TRACE_OPEN, path, NULL, fi, 0, 0, 0, fi->flags);
+	struct sync_cb_data cb_data;
+	struct nfs_conn *conn = conn_for_path(path);
+	struct open_cache_entry *ent;
+	struct fuse_nfs_fh *fh;
+	int ret;
+
+	LOG("fuse_nfs_open entered [%s]\n", path);
+
+	if (!strcmp(path, STATS_FILE)) {
+		return stats_file_open(fi);
+	}
+
+        memset(&cb_data, 0, sizeof(struct sync_cb_data));
+
+	fi->fh = 0;
+	fh = calloc(1, sizeof(struct fuse_nfs_fh));
+	if (fh == NULL) {
+		return -ENOMEM;
+	}
+
+	ent = open_cache_get(path, fi->flags);
+	if (ent) {
+		if (open_cache_revalidate(ent) == 0) {
+			fh->conn = ent->conn;
+			fh->nfsfh = ent->nfsfh;
+			free(ent);
+			goto opened;
+		}
+		__sync_fetch_and_add(&open_cache_stale, 1);
+		ent->next = NULL;
+		open_cache_close(ent);
+	}
+
+	conn_lock(conn);
+        update_rpc_credentials(conn);
+        ret = nfs_open_async(conn->nfs, path, fi->flags, open_cb, &cb_data);
+	pthread_mutex_unlock(&conn->mutex);
+	if (ret < 0) {
+		free(fh);
+		return ret;
+	}
+	wait_for_nfs_reply(conn, &cb_data);
+	if (cb_data.status < 0) {
+		free(fh);
+		return cb_data.status;
+	}
+
+	fh->conn = conn;
+	fh->nfsfh = cb_data.return_data;
+ opened:
+	fuse_nfs_fh_init(fh);
+	disk_cache_open(fh, fi->flags);
+	wb_open_add(fh, path, fi->flags);
+	fi->fh = (uint64_t)fh;
+
+	return 0;
+}
+
+static int fuse_nfs_release(const char *path, struct fuse_file_info *fi)
+{
+	STATS_OP(STAT_RELEASE);
+	TRACE_OP(TRACE_RELEASE, path, NULL, fi, 0, 0, 0, 0);
+	struct fuse_nfs_fh *fh = (struct fuse_nfs_fh *)fi->fh;
+	struct nfs_conn *conn = fh->conn;
+	struct sync_cb_data cb_data;
+
+	if (fh->stats_buf) {
+		free(fh->stats_buf);
+		free(fh);
+		fi->fh = 0;
+		return 0;
+	}
+
+        memset(&cb_data, 0, sizeof(struct sync_cb_data));
+
+	/* No read-ahead or write-back may still be in flight on the handle
+	 * we close. Errors have already been reported by flush.
+	 */
+	fuse_nfs_ra_drop(fh);
+	fuse_nfs_wb_sync(fh, 1);
+	wb_open_remove(fh);
+
+	if (open_cache_put(path, fi->flags, fh) != 0) {
+		conn_lock(conn);
+		nfs_close_async(conn->nfs, fh->nfsfh, generic_cb, &cb_data);
+		pthread_mutex_unlock(&conn->mutex);
+		wait_for_nfs_reply(conn, &cb_data);
+	}
+
+	pthread_mutex_destroy(&fh->ra_mutex);
+	pthread_cond_destroy(&fh->ra_cond);
+	pthread_mutex_destroy(&fh->wb_mutex);
+	free(fh->dc_name);
+	free(fh);
+	fi->fh = 0;
+
+	return 0;
+}
+
+static void
+read_cb(int status, struct nfs_context *nfs, void *data, void *private_data)
+{
+	struct sync_cb_data *cb_data = private_data;
+
+	if (status > 0 && data != cb_data->return_data) {
+		memcpy(cb_data->return_data, data, status);
+	}
+	nfs_reply_done(cb_data, status);
+}
+
+/*
+ * Adaptive I/O size (--adaptive_io).
+ *
+ * FSINFO tells us the largest READ and WRITE the server takes, which is
+ * not always the size it serves fastest. With --adaptive_io the reads
+ * and writes we split up use power of two sizes between 32KiB and that
+ * maximum instead. Read-ahead, write-back and low-level RPCs report how
+ * long they took and we keep a moving average of the throughput and
+ * latency of every size. New RPCs use the size with the lowest latency
+ * among those within 10% of the best throughput, and every 16th one
+ * tries a neighbouring size so that the averages follow the server.
+ */
+#define IO_TUNE_MIN		32768
+#define IO_TUNE_SIZES		16
+#define IO_TUNE_EXPLORE		16
+
+enum {
+	IO_TUNE_READ,
+	IO_TUNE_WRITE,
+	IO_TUNE_DIRS
+};
+
+struct io_tune_size {
+	size_t size;
+	double bps;
+	double latency;
+	uint64_t samples;
+};
+
+struct io_tuner {
+	pthread_mutex_t mutex;
+	struct io_tune_size sizes[IO_TUNE_SIZES];
+	int num_sizes;
+	int best;
+	uint64_t calls;
+};
+
+static int adaptive_io;
+static struct io_tuner io_tuners[IO_TUNE_DIRS];
+
+static void
+io_tune_init(int dir, size_t max)
+{
+	struct io_tuner *tuner = &io_tuners[dir];
+	size_t size;
+
+	pthread_mutex_init(&tuner->mutex, NULL);
+	tuner->num_sizes = 0;
+	for (size = IO_TUNE_MIN; size < max && tuner->num_sizes < IO_TUNE_SIZES - 1;
+	     size *= 2) {
+		tuner->sizes[tuner->num_sizes++].size = size;
+	}
+	tuner->sizes[tuner->num_sizes++].size = max;
+	/* Start out with what the server asked for */
+	tuner->best = tuner->num_sizes - 1;
+}
+
+/* The size to use for the next RPC, at most max */
+static size_t
+io_tune_size(int dir, size_t max)
+{
+	struct io_tuner *tuner = &io_tuners[dir];
+	size_t size;
+	int i;
+
+	if (!adaptive_io || tuner->num_sizes == 0) {
+		return max;
+	}
+	pthread_mutex_lock(&tuner->mutex);
+	i = tuner->best;
+	if (++tuner->calls % IO_TUNE_EXPLORE == 0) {
+		if ((tuner->calls / IO_TUNE_EXPLORE) & 1) {
+			i = i + 1 < tuner->num_sizes ? i + 1 : i - 1;
+		} else {
+			i = i > 0 ? i - 1 : i + 1;
+		}
+		if (i < 0 || i >= tuner->num_sizes) {
+			i = tuner->best;
+		}
+	}
+	size = tuner->sizes[i].size;
+	pthread_mutex_unlock(&tuner->mutex);
+
+	return size < max ? size : max;
+}
+
+/* An RPC of size bytes moved done of them in ns nanoseconds */
+static void
+io_tune_sample(int dir, size_t size, size_t done, uint64_t ns)
+{
+	struct io_tuner *tuner = &io_tuners[dir];
+	struct io_tune_size *ts;
+	double bps, latency, top;
+	int i, best;
+
+	/* Only complete transfers of one of our sizes say anything */
+	if (!adaptive_io || done != size || ns == 0) {
+		return;
+	}
+	latency = ns / 1000000000.0;
+	bps = size / latency;
+
+	pthread_mutex_lock(&tuner->mutex);
+	for (i = 0; i < tuner->num_sizes; i++) {
+		if (tuner->sizes[i].size == size) {
+			break;
+		}
+	}
+	if (i == tuner->num_sizes) {
+		pthread_mutex_unlock(&tuner->mutex);
+		return;
+	}
+	ts = &tuner->sizes[i];
+	if (ts->samples++ == 0) {
+		ts->bps = bps;
+		ts->latency = latency;
+	} else {
+		ts->bps += (bps - ts->bps) / 8;
+		ts->latency += (latency - ts->latency) / 8;
+	}
+
+	top = 0;
+	for (i = 0; i < tuner->num_sizes; i++) {
+		if (tuner->sizes[i].samples && tuner->sizes[i].bps > top) {
+			top = tuner->sizes[i].bps;
+		}
+	}
+	best = -1;
+	for (i = 0; i < tuner->num_sizes; i++) {
+		ts = &tuner->sizes[i];
+		if (ts->samples == 0 || ts->bps < top * 0.9) {
+			continue;
+		}
+		if (best < 0 || ts->latency < tuner->sizes[best].latency) {
+			best = i;
+		}
+	}
+	if (best >= 0) {
+		tuner->best = best;
+	}
+	pthread_mutex_unlock(&tuner->mutex);
+}
+
+/*
+ * Newer libnfs reads straight into a buffer we pass in and hands that
+ * same buffer to the callback, which saves copying every byte out of
+ * the RPC reply. Older versions only give us their own buffer.
+ */
+static int
+fuse_nfs_pread_async(struct nfs_context *nfs, struct nfsfh *nfsfh, char *buf,
+		     uint64_t offset, size_t count, nfs_cb cb, void *private_data)
+{
+#ifdef HAVE_NFS_PREAD_BUF
+	return nfs_pread_async(nfs, nfsfh, buf, count, offset, cb, private_data);
+#else
+	return nfs_pread_async(nfs, nfsfh, offset, count, cb, private_data);
+#endif
+}
+
+/* The same libnfs change moved the buffer of nfs_pwrite_async ahead of
+ * count and offset.
+ */
+static int
+fuse_nfs_pwrite_async(struct nfs_context *nfs, struct nfsfh *nfsfh,
+		      const char *buf, uint64_t offset, size_t count, nfs_cb cb,
+		      void *private_data)
+{
+#ifdef HAVE_NFS_PWRITE_BUF_FIRST
+	return nfs_pwrite_async(nfs, nfsfh, buf, count, offset, cb,
+				private_data);
+#else
+	return nfs_pwrite_async(nfs, nfsfh, offset, count, discard_const(buf),
+				cb, private_data);
+#endif
+}
+
+static int
+fuse_nfs_pread_one(struct fuse_nfs_fh *fh, char *buf, size_t size, off_t offset)
+{
+	struct nfs_conn *conn = fh->conn;
+	struct sync_cb_data cb_data;
+	int ret;
+
+        memset(&cb_data, 0, sizeof(struct sync_cb_data));
+	cb_data.return_data = buf;
+
+	sched_lock(conn, &cb_data, sched_class(fh->io_bytes), size);
+	update_rpc_credentials(conn);
+	ret = fuse_nfs_pread_async(conn->nfs, fh->nfsfh, buf, offset, size,
+				   read_cb, &cb_data);
+	if (ret < 0) {
+		sched_done(&cb_data);
+	}
+	pthread_mutex_unlock(&conn->mutex);
+	if (ret < 0) {
+		return ret;
+	}
+	wait_for_nfs_reply(conn, &cb_data);
+
+	return cb_data.status;
+}
+
+/*
+ * Reads larger than rsize are split into rsize aligned stripes that are
+ * all sent at once, each completing into its own part of the caller's
+ * buffer. With NFSv3 and several connections the handle is valid on
+ * every one of them, so the stripes are spread over all of them with
+ * plain READs. Otherwise they go through libnfs on the connection the
+ * file was opened on, which for NFSv4 owns the open state and lets newer
+ * libnfs read straight into buf.
+ */
+struct read_stripe {
+	struct sync_cb_data cb_data;
+	struct nfs_conn *conn;
+	uint64_t offset;
+	size_t size;
+	int eof;
+};
+
+static void
+stripe_read3_cb(struct rpc_context *rpc, int status, void *data, void *private_data)
+{
+	struct read_stripe *stripe = private_data;
+	READ3res *res = data;
+	READ3resok *resok;
+
+	if (status != RPC_STATUS_SUCCESS) {
+		nfs_reply_done(&stripe->cb_data, -EIO);
+		return;
+	}
+	if (res->status != NFS3_OK) {
+		nfs_reply_done(&stripe->cb_data, nfs3_errno(res->status));
+		return;
+	}
+	resok = &res->READ3res_u.resok;
+	if (resok->data.data_len > stripe->size) {
+		nfs_reply_done(&stripe->cb_data, -EIO);
+		return;
+	}
+	memcpy(stripe->cb_data.return_data, resok->data.data_val,
+	       resok->data.data_len);
+	stripe->eof = resok->eof;
+	nfs_reply_done(&stripe->cb_data, resok->data.data_len);
+}
+
+static int
+stripe_send(struct fuse_nfs_fh *fh, struct read_stripe *stripe)
+{
+	struct nfs_conn *conn = stripe->conn;
+	struct READ3args args;
+	const struct nfs_fh *nfs_fh;
+	int ret;
+
+	sched_lock(conn, &stripe->cb_data, sched_class(fh->io_bytes),
+		   stripe->size);
+	update_rpc_credentials(conn);
+	if (nfs_version == 3 && num_conns > 1) {
+		nfs_fh = nfs_get_fh(fh->nfsfh);
+		memset(&args, 0, sizeof(args));
+		args.file.data.data_len = nfs_fh->len;
+		args.file.data.data_val = discard_const(nfs_fh->val);
+		args.offset = stripe->offset;
+		args.count = stripe->size;
+		ret = rpc_nfs3_read_async(nfs_get_rpc_context(conn->nfs),
+					  stripe_read3_cb, &args, stripe);
+		ret = ret ? -ENOMEM : 0;
+	} else {
+		ret = fuse_nfs_pread_async(conn->nfs, fh->nfsfh,
+					   stripe->cb_data.return_data,
+					   stripe->offset, stripe->size,
+					   read_cb, &stripe->cb_data);
+	}
+	if (ret < 0) {
+		sched_done(&stripe->cb_data);
+	}
+	pthread_mutex_unlock(&conn->mutex);
+	if (ret == 0) {
+		wake_service_thread(conn);
+	}
+
+	return ret;
+}
+
+static int
+fuse_nfs_pread(struct fuse_nfs_fh *fh, char *buf, size_t size, off_t offset)
+{
+	size_t readmax = io_tune_size(IO_TUNE_READ,
+				      nfs_get_readmax(fh->conn->nfs));
+	struct read_stripe *stripes;
+	int first = fh->conn - conns;
+	int num, sent, i, ret;
+	size_t done, count;
+	uint64_t pos;
+
+	if (size <= readmax) {
+		return fuse_nfs_pread_one(fh, buf, size, offset);
+	}
+
+	num = (offset % readmax + size + readmax - 1) / readmax;
+	stripes = calloc(num, sizeof(struct read_stripe));
+	if (stripes == NULL) {
+		return fuse_nfs_pread_one(fh, buf, size, offset);
+	}
+
+	ret = 0;
+	pos = offset;
+	for (sent = 0; sent < num; sent++) {
+		count = readmax - pos % readmax;
+		if (count > offset + size - pos) {
+			count = offset + size - pos;
+		}
+		/* A file on a --user_connections connection keeps to it,
+		 * the pool runs with other credentials.
+		 */
+		stripes[sent].conn = nfs_version == 3 && first < num_conns ?
+			&conns[(first + sent) % num_conns] : fh->conn;
+		stripes[sent].offset = pos;
+		stripes[sent].size = count;
+		stripes[sent].cb_data.return_data = buf + (pos - offset);
+		ret = stripe_send(fh, &stripes[sent]);
+		if (ret < 0) {
+			break;
+		}
+		pos += count;
+	}
+
+	/* Every stripe we sent owns part of buf, wait for all of them */
+	for (i = 0; i < sent; i++) {
+		wait_for_nfs_reply(stripes[i].conn, &stripes[i].cb_data);
+	}
+
+	/* Use the stripes up to the first one that failed or came back
+	 * short. A short stripe that is not at EOF is read again directly.
+	 */
+	done = 0;
+	for (i = 0; i < sent; i++) {
+		ret = stripes[i].cb_data.status;
+		if (ret < 0) {
+			break;
+		}
+		done += ret;
+		if ((size_t)ret == stripes[i].size) {
+			continue;
+		}
+		if (stripes[i].eof) {
+			break;
+		}
+		ret = fuse_nfs_pread(fh, buf + done, size - done, offset + done);
+		if (ret > 0) {
+			done += ret;
+		}
+		break;
+	}
+	free(stripes);
+
+	if (done == 0 && ret < 0) {
+		return ret;
+	}
+	return done;
+}
+
+/*
+ * Read-ahead (--readahead_max).
+ *
+ * Each open file remembers where the previous read ended. As long as the
+ * reader keeps reading from there the window doubles, starting at twice
+ * the read size and up to readahead_max bytes, and we keep that much
+ * data requested past the reader in readmax sized PREADs. Reads are then
+ * copied out of those slots, usually without waiting at all. A read from
+ * anywhere else collapses the window again; slots that are still in
+ * flight at that point are reaped once they complete.
+ *
+ * ra_mutex only guards the slot list and the window. It is dropped while
+ * a reader waits for a slot, which is marked busy meanwhile so that
+ * nobody frees it, or reads directly from the server. A write bumps
+ * ra_gen, so that slots read before it are no longer used, and no new
+ * read-ahead is issued until the WRITE has completed.
+ */
+static size_t readahead_max;
+
+struct ra_slot {
+	struct sync_cb_data cb_data;
+	struct ra_slot *next;
+	uint64_t offset;
+	size_t size;
+	uint64_t sent;
+	uint64_t gen;
+	int busy;	/* a reader waits for the reply */
+	int ready;	/* the reply has been waited for */
+	char buf[];
+};
+
+static void
+ra_read_cb(int status, struct nfs_context *nfs, void *data, void *private_data)
+{
+	struct ra_slot *slot = private_data;
+
+	if (status > 0 && data != slot->buf) {
+		memcpy(slot->buf, data, status);
+	}
+	if (status > 0 && slot->sent) {
+		io_tune_sample(IO_TUNE_READ, slot->size, status,
+			       stats_now() - slot->sent);
+	}
+	nfs_reply_done(&slot->cb_data, status);
+}
+
+/* Wait for every read-ahead on the file and throw the data away */
+static void
+fuse_nfs_ra_drop(struct fuse_nfs_fh *fh)
+{
+	struct ra_slot *slot, *slots;
+
+	pthread_mutex_lock(&fh->ra_mutex);
+	while (fh->ra_waiters) {
+		pthread_cond_wait(&fh->ra_cond, &fh->ra_mutex);
+	}
+	slots = fh->ra_slots;
+	fh->ra_slots = NULL;
+	fh->ra_window = 0;
+	fh->ra_ahead = fh->ra_next;
+	fh->ra_eof = UINT64_MAX;
+	pthread_mutex_unlock(&fh->ra_mutex);
+
+	while ((slot = slots) != NULL) {
+		slots = slot->next;
+		wait_for_nfs_reply(fh->conn, &slot->cb_data);
+		free(slot);
+	}
+}
+
+/* A write to the file starts. Read-ahead from before it must not be
+ * used and none may be issued until fuse_nfs_ra_write_end().
+ */
+static void
+fuse_nfs_ra_write_begin(struct fuse_nfs_fh *fh)
+{
+	if (readahead_max == 0) {
+		return;
+	}
+	pthread_mutex_lock(&fh->ra_mutex);
+	fh->ra_writers++;
+	fh->ra_gen++;
+	fh->ra_window = 0;
+	fh->ra_ahead = fh->ra_next;
+	fh->ra_eof = UINT64_MAX;
+	pthread_mutex_unlock(&fh->ra_mutex);
+}
+
+static void
+fuse_nfs_ra_write_end(struct fuse_nfs_fh *fh)
+{
+	if (readahead_max == 0) {
+		return;
+	}
+	pthread_mutex_lock(&fh->ra_mutex);
+	fh->ra_writers--;
+	pthread_mutex_unlock(&fh->ra_mutex);
+}
+
+/* Free completed slots outside [start, end) or from before a write.
+ * Called with ra_mutex held.
+ */
+static void
+ra_reap(struct fuse_nfs_fh *fh, uint64_t start, uint64_t end)
+{
+	struct ra_slot **pp = &fh->ra_slots;
+	struct ra_slot *slot;
+
+	conn_lock(fh->conn);
+	while ((slot = *pp) != NULL) {
+		if (slot->cb_data.is_finished && !slot->busy &&
+		    (slot->gen != fh->ra_gen ||
+		     slot->offset + slot->size <= start || slot->offset >= end)) {
+			*pp = slot->next;
+			free(slot);
+			continue;
+		}
+		pp = &slot->next;
+	}
+	pthread_mutex_unlock(&fh->conn->mutex);
+}
+
+/* Keep ra_window bytes requested past ra_next. Called with ra_mutex held. */
+static void
+ra_issue(struct fuse_nfs_fh *fh)
+{
+	struct nfs_conn *conn = fh->conn;
+	uint64_t end = fh->ra_next + fh->ra_window;
+	size_t readmax = nfs_get_readmax(conn->nfs);
+	size_t chunk;
+	struct ra_slot *slot, **tail;
+	size_t count;
+	int issued = 0;
+	int ret;
+
+	if (fh->ra_writers) {
+		return;
+	}
+	if (end > fh->ra_eof) {
+		end = fh->ra_eof;
+	}
+	if (fh->ra_ahead < fh->ra_next) {
+		fh->ra_ahead = fh->ra_next;
+	}
+
+	for (tail = &fh->ra_slots; *tail; tail = &(*tail)->next)
+		;
+	while (fh->ra_ahead < end) {
+		chunk = io_tune_size(IO_TUNE_READ, readmax);
+		count = end - fh->ra_ahead;
+		if (count > chunk) {
+			count = chunk;
+		}
+		/* Wait until a full sized PREAD fits rather than
+		 * chopping the stream into small ones.
+		 */
+		if (count < chunk && end != fh->ra_eof &&
+		    fh->ra_ahead > fh->ra_next) {
+			break;
+		}
+		slot = calloc(1, sizeof(struct ra_slot) + count);
+		if (slot == NULL) {
+			break;
+		}
+		slot->offset = fh->ra_ahead;
+		slot->size = count;
+		slot->sent = adaptive_io ? stats_now() : 0;
+		slot->gen = fh->ra_gen;
+
+		/* Read-ahead is never worth waiting for budget */
+		if (sched_trylock(conn, &slot->cb_data, SCHED_BULK, count) < 0) {
+			free(slot);
+			break;
+		}
+		update_rpc_credentials(conn);
+		ret = fuse_nfs_pread_async(conn->nfs, fh->nfsfh, slot->buf,
+					   slot->offset, count, ra_read_cb, slot);
+		if (ret < 0) {
+			sched_done(&slot->cb_data);
+		}
+		pthread_mutex_unlock(&conn->mutex);
+		if (ret < 0) {
+			free(slot);
+			break;
+		}
+		*tail = slot;
+		tail = &slot->next;
+		fh->ra_ahead += count;
+		issued = 1;
+	}
+	if (issued) {
+		wake_service_thread(conn);
+	}
+}
+
+static int
+fuse_nfs_ra_read(struct fuse_nfs_fh *fh, char *buf, size_t size, off_t offset)
+{
+	struct ra_slot *slot, **pp;
+	uint64_t pos;
+	size_t done = 0, count;
+	int eof = 0;
+	int ret;
+
+	pthread_mutex_lock(&fh->ra_mutex);
+
+	if ((uint64_t)offset == fh->ra_next) {
+		fh->ra_window = fh->ra_window ? fh->ra_window * 2 : size * 2;
+		if (fh->ra_window > readahead_max) {
+			fh->ra_window = readahead_max;
+		}
+	} else {
+		fh->ra_window = 0;
+		fh->ra_ahead = offset;
+		fh->ra_eof = UINT64_MAX;
+	}
+
+	while (done < size && !eof) {
+		pos = offset + done;
+		for (pp = &fh->ra_slots; (slot = *pp) != NULL; pp = &slot->next) {
+			if (slot->gen == fh->ra_gen && slot->offset <= pos &&
+			    pos < slot->offset + slot->size) {
+				break;
+			}
+		}
+		if (slot == NULL) {
+			break;
+		}
+		if (slot->busy) {
+			/* Another reader is waiting for it, wait for them */
+			pthread_cond_wait(&fh->ra_cond, &fh->ra_mutex);
+			continue;
+		}
+		if (!slot->ready) {
+			slot->busy = 1;
+			fh->ra_waiters++;
+			pthread_mutex_unlock(&fh->ra_mutex);
+			wait_for_nfs_reply(fh->conn, &slot->cb_data);
+			pthread_mutex_lock(&fh->ra_mutex);
+			slot->busy = 0;
+			slot->ready = 1;
+			fh->ra_waiters--;
+			pthread_cond_broadcast(&fh->ra_cond);
+			/* A write may have started meanwhile, look again */
+			continue;
+		}
+		if (slot->cb_data.status < 0) {
+			/* Let the direct read below report the error */
+			*pp = slot->next;
+			free(slot);
+			break;
+		}
+		if ((size_t)slot->cb_data.status < slot->size) {
+			fh->ra_eof = slot->offset + slot->cb_data.status;
+			eof = 1;
+		}
+		if (pos >= slot->offset + slot->cb_data.status) {
+			break;
+		}
+		count = slot->offset + slot->cb_data.status - pos;
+		if (count > size - done) {
+			count = size - done;
+		}
+		memcpy(buf + done, slot->buf + (pos - slot->offset), count);
+		done += count;
+	}
+
+	if (done < size && !eof) {
+		pthread_mutex_unlock(&fh->ra_mutex);
+		ret = fuse_nfs_pread(fh, buf + done, size - done, offset + done);
+		if (ret < 0 && done == 0) {
+			return ret;
+		}
+		if (ret > 0) {
+			done += ret;
+		}
+		pthread_mutex_lock(&fh->ra_mutex);
+	}
+
+	fh->ra_next = offset + done;
+	if (fh->ra_window) {
+		ra_issue(fh);
+	}
+	ra_reap(fh, fh->ra_next, fh->ra_ahead);
+	pthread_mutex_unlock(&fh->ra_mutex);
+
+	return done;
+}
+
+/*
+ * Write-back (--writeback).
+ *
+ * Instead of one synchronous stable WRITE per FUSE write we gather
+ * contiguous writes into wsize sized extents and send them as UNSTABLE
+ * NFSv3 WRITEs without waiting, keeping at most writeback_max_inflight
+ * of them outstanding per file. flush, fsync and release wait for the
+ * outstanding writes and COMMIT them. Errors from writes that have
+ * already returned to the application are kept and reported by the next
+ * write, flush or fsync.
+ *
+ * The write verifier of every reply is compared with the first one and
+ * with the one COMMIT returns. If the server restarted in between, data
+ * it had not yet committed may be lost, which we report as EIO.
+ */
+static int writeback;
+static int writeback_max_inflight = 8;
+
+struct wb_extent {
+	struct sync_cb_data cb_data;
+	struct wb_extent *next;
+	uint64_t offset;
+	size_t len;
+	size_t size;
+	size_t written;
+	uint64_t sent;
+	char verf[NFS3_WRITEVERFSIZE];
+	char buf[];
+};
+
+static void
+wb_write_cb(struct rpc_context *rpc, int status, void *data, void *private_data)
+{
+	struct wb_extent *ext = private_data;
+	WRITE3res *res = data;
+
+	if (status != RPC_STATUS_SUCCESS) {
+		nfs_reply_done(&ext->cb_data, -EIO);
+		return;
+	}
+	if (res->status != NFS3_OK) {
+		nfs_reply_done(&ext->cb_data, nfs3_errno(res->status));
+		return;
+	}
+	ext->written = res->WRITE3res_u.resok.count;
+	memcpy(ext->verf, res->WRITE3res_u.resok.verf, NFS3_WRITEVERFSIZE);
+	if (ext->sent) {
+		io_tune_sample(IO_TUNE_WRITE, ext->size, ext->written,
+			       stats_now() - ext->sent);
+	}
+	nfs_reply_done(&ext->cb_data, 0);
+}
+
+static void
+wb_commit_cb(struct rpc_context *rpc, int status, void *data, void *private_data)
+{
+	struct wb_extent *ext = private_data;
+	COMMIT3res *res = data;
+
+	if (status != RPC_STATUS_SUCCESS) {
+		nfs_reply_done(&ext->cb_data, -EIO);
+		return;
+	}
+	if (res->status != NFS3_OK) {
+		nfs_reply_done(&ext->cb_data, nfs3_errno(res->status));
+		return;
+	}
+	memcpy(ext->verf, res->COMMIT3res_u.resok.verf, NFS3_WRITEVERFSIZE);
+	nfs_reply_done(&ext->cb_data, 0);
+}
+
+static void
+wb_fh3(struct fuse_nfs_fh *fh, nfs_fh3 *fh3)
+{
+	const struct nfs_fh *nfs_fh = nfs_get_fh(fh->nfsfh);
+
+	fh3->data.data_len = nfs_fh->len;
+	fh3->data.data_val = discard_const(nfs_fh->val);
+}
+
+static int
+wb_send(struct fuse_nfs_fh *fh, struct wb_extent *ext)
+{
+	struct nfs_conn *conn = fh->conn;
+	struct WRITE3args args;
+	int ret;
+
+	memset(&ext->cb_data, 0, sizeof(struct sync_cb_data));
+	ext->written = 0;
+	ext->sent = adaptive_io ? stats_now() : 0;
+
+	memset(&args, 0, sizeof(args));
+	wb_fh3(fh, &args.file);
+	args.offset = ext->offset;
+	args.count = ext->len;
+	args.stable = UNSTABLE;
+	args.data.data_len = ext->len;
+	args.data.data_val = ext->buf;
+
+	sched_lock(conn, &ext->cb_data, SCHED_BULK, ext->len);
+	update_rpc_credentials(conn);
+	ret = rpc_nfs3_write_async(nfs_get_rpc_context(conn->nfs), wb_write_cb,
+				   &args, ext);
+	if (ret != 0) {
+		sched_done(&ext->cb_data);
+	}
+	pthread_mutex_unlock(&conn->mutex);
+	if (ret != 0) {
+		return -ENOMEM;
+	}
+	wake_service_thread(conn);
+
+	return 0;
+}
+
+static void
+wb_set_error(struct fuse_nfs_fh *fh, int err)
+{
+	if (fh->wb_error == 0) {
+		fh->wb_error = err;
+	}
+}
+
+/* Record the verifier of a reply, it must never change until COMMIT */
+static void
+wb_check_verf(struct fuse_nfs_fh *fh, const char *verf)
+{
+	if (!fh->wb_verf_set) {
+		memcpy(fh->wb_verf, verf, NFS3_WRITEVERFSIZE);
+		fh->wb_verf_set = 1;
+	} else if (memcmp(fh->wb_verf, verf, NFS3_WRITEVERFSIZE)) {
+		wb_set_error(fh, -EIO);
+	}
+}
+
+/* Wait for the oldest extent in flight. Called with wb_mutex held. */
+static void
+wb_reap_one(struct fuse_nfs_fh *fh)
+{
+	struct wb_extent *ext = fh->wb_inflight;
+
+	for (;;) {
+		wait_for_nfs_reply(fh->conn, &ext->cb_data);
+		if (ext->cb_data.status < 0) {
+			wb_set_error(fh, ext->cb_data.status);
+			break;
+		}
+		wb_check_verf(fh, ext->verf);
+		fh->wb_unstable = 1;
+		if (ext->written == 0 || ext->written > ext->len) {
+			wb_set_error(fh, -EIO);
+			break;
+		}
+		if (ext->written == ext->len) {
+			break;
+		}
+		/* Short write, send the rest */
+		memmove(ext->buf, ext->buf + ext->written, ext->len - ext->written);
+		ext->offset += ext->written;
+		ext->len -= ext->written;
+		if (wb_send(fh, ext) < 0) {
+			wb_set_error(fh, -ENOMEM);
+			break;
+		}
+	}
+
+	fh->wb_inflight = ext->next;
+	fh->wb_num_inflight--;
+	free(ext);
+}
+
+/* Is any extent in flight for bytes of ext? Called with wb_mutex held. */
+static int
+wb_overlaps(struct fuse_nfs_fh *fh, const struct wb_extent *ext)
+{
+	struct wb_extent *e;
+
+	for (e = fh->wb_inflight; e; e = e->next) {
+		if (e->offset < ext->offset + ext->len &&
+		    ext->offset < e->offset + e->len) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Send the extent being filled. Called with wb_mutex held. */
+static void
+wb_send_cur(struct fuse_nfs_fh *fh)
+{
+	struct wb_extent *ext = fh->wb_cur, **pp;
+
+	if (ext == NULL) {
+		return;
+	}
+	fh->wb_cur = NULL;
+
+	/* The server may apply WRITEs in flight in any order, so a rewrite
+	 * of the same bytes has to wait for the older data to land first.
+	 * Extents are reaped oldest first, which covers the overlapping one.
+	 */
+	while (fh->wb_num_inflight >= writeback_max_inflight ||
+	       wb_overlaps(fh, ext)) {
+		wb_reap_one(fh);
+	}
+	if (wb_send(fh, ext) < 0) {
+		wb_set_error(fh, -ENOMEM);
+		free(ext);
+		return;
+	}
+	for (pp = &fh->wb_inflight; *pp; pp = &(*pp)->next)
+		;
+	*pp = ext;
+	ext->next = NULL;
+	fh->wb_num_inflight++;
+}
+
+static int
+fuse_nfs_wb_write(struct fuse_nfs_fh *fh, const char *buf, size_t size,
+		  off_t offset)
+{
+	struct wb_extent *ext;
+	size_t done = 0, count;
+	int ret;
+
+	pthread_mutex_lock(&fh->wb_mutex);
+	if (fh->wb_error) {
+		ret = fh->wb_error;
+		fh->wb_error = 0;
+		pthread_mutex_unlock(&fh->wb_mutex);
+		return ret;
+	}
+
+	while (done < size) {
+		ext = fh->wb_cur;
+		if (ext && ext->offset + ext->len != (uint64_t)offset + done) {
+			wb_send_cur(fh);
+			ext = NULL;
+		}
+		if (ext == NULL) {
+			count = io_tune_size(IO_TUNE_WRITE,
+					     nfs_get_writemax(fh->conn->nfs));
+			ext = malloc(sizeof(struct wb_extent) + count);
+			if (ext == NULL) {
+				pthread_mutex_unlock(&fh->wb_mutex);
+				return done ? (int)done : -ENOMEM;
+			}
+			ext->offset = offset + done;
+			ext->len = 0;
+			ext->size = count;
+			fh->wb_cur = ext;
+		}
+		count = ext->size - ext->len;
+		if (count > size - done) {
+			count = size - done;
+		}
+		memcpy(ext->buf + ext->len, buf + done, count);
+		ext->len += count;
+		done += count;
+		if (ext->len == ext->size) {
+			wb_send_cur(fh);
+		}
+	}
+	pthread_mutex_unlock(&fh->wb_mutex);
+
+	return done;
+}
+
+/* Push out everything we buffered, optionally COMMIT it, and return any
+ * error we have been holding on to. Without commit and with nothing
+ * buffered this does nothing, and keeps errors for the next write or
+ * flush.
+ */
+static int
+fuse_nfs_wb_sync(struct fuse_nfs_fh *fh, int commit)
+{
+	struct nfs_conn *conn = fh->conn;
+	struct COMMIT3args args;
+	struct wb_extent ext;
+	int ret;
+
+	pthread_mutex_lock(&fh->wb_mutex);
+	if (!commit && fh->wb_cur == NULL && fh->wb_inflight == NULL) {
+		pthread_mutex_unlock(&fh->wb_mutex);
+		return 0;
+	}
+	wb_send_cur(fh);
+	while (fh->wb_inflight) {
+		wb_reap_one(fh);
+	}
+
+	if (commit && fh->wb_unstable && fh->wb_error == 0) {
+		memset(&ext, 0, sizeof(ext));
+		memset(&args, 0, sizeof(args));
+		wb_fh3(fh, &args.file);
+
+		conn_lock(conn);
+		update_rpc_credentials(conn);
+		ret = rpc_nfs3_commit_async(nfs_get_rpc_context(conn->nfs),
+					    wb_commit_cb, &args, &ext);
+		pthread_mutex_unlock(&conn->mutex);
+		if (ret != 0) {
+			wb_set_error(fh, -ENOMEM);
+		} else {
+			wait_for_nfs_reply(conn, &ext.cb_data);
+			if (ext.cb_data.status < 0) {
+				wb_set_error(fh, ext.cb_data.status);
+			} else {
+				wb_check_verf(fh, ext.verf);
+			}
+		}
+	}
+	if (commit) {
+		fh->wb_unstable = 0;
+		fh->wb_verf_set = 0;
+	}
+
+	ret = fh->wb_error;
+	fh->wb_error = 0;
+	pthread_mutex_unlock(&fh->wb_mutex);
+
+	return ret;
+}
+
+/*
+ * Until buffered writes reach the server, GETATTR reports the size from
+ * before them and the kernel would shrink i_size to it, so an O_APPEND
+ * write or SEEK_END would land on top of data we still hold. Handles
+ * open for writing are kept on a list by path and getattr pushes theirs
+ * out first. A handle on the list is pinned by wb_refs while that runs.
+ */
+static pthread_mutex_t wb_open_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wb_open_cond = PTHREAD_COND_INITIALIZER;
+static struct fuse_nfs_fh *wb_open_list;
+
+static void
+wb_open_add(struct fuse_nfs_fh *fh, const char *path, int flags)
+{
+	if (!writeback || (flags & O_ACCMODE) == O_RDONLY) {
+		return;
+	}
+	fh->wb_path = strdup(path);
+	if (fh->wb_path == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&wb_open_mutex);
+	fh->wb_prev = NULL;
+	fh->wb_next = wb_open_list;
+	if (wb_open_list) {
+		wb_open_list->wb_prev = fh;
+	}
+	wb_open_list = fh;
+	pthread_mutex_unlock(&wb_open_mutex);
+}
+
+static void
+wb_open_remove(struct fuse_nfs_fh *fh)
+{
+	if (fh->wb_path == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&wb_open_mutex);
+	while (fh->wb_refs) {
+		pthread_cond_wait(&wb_open_cond, &wb_open_mutex);
+	}
+	if (fh->wb_prev) {
+		fh->wb_prev->wb_next = fh->wb_next;
+	} else {
+		wb_open_list = fh->wb_next;
+	}
+	if (fh->wb_next) {
+		fh->wb_next->wb_prev = fh->wb_prev;
+	}
+	pthread_mutex_unlock(&wb_open_mutex);
+	free(fh->wb_path);
+	fh->wb_path = NULL;
+}
+
+/* Send what is buffered and wait for it, without COMMIT. Errors stay
+ * for the next write or flush. Returns 1 if there was anything.
+ */
+static int
+wb_push(struct fuse_nfs_fh *fh)
+{
+	pthread_mutex_lock(&fh->wb_mutex);
+	if (fh->wb_cur == NULL && fh->wb_inflight == NULL) {
+		pthread_mutex_unlock(&fh->wb_mutex);
+		return 0;
+	}
+	wb_send_cur(fh);
+	while (fh->wb_inflight) {
+		wb_reap_one(fh);
+	}
+	pthread_mutex_unlock(&fh->wb_mutex);
+
+	return 1;
+}
+
+/* Push out the writes buffered on handles open on path. Returns 1 if
+ * there were any.
+ */
+static int
+wb_flush_path(const char *path)
+{
+	struct fuse_nfs_fh *fh, *next;
+	int pushed = 0;
+
+	if (!writeback) {
+		return 0;
+	}
+	pthread_mutex_lock(&wb_open_mutex);
+	for (fh = wb_open_list; fh; fh = next) {
+		if (strcmp(fh->wb_path, path)) {
+			next = fh->wb_next;
+			continue;
+		}
+		fh->wb_refs++;
+		pthread_mutex_unlock(&wb_open_mutex);
+		pushed |= wb_push(fh);
+		pthread_mutex_lock(&wb_open_mutex);
+		/* Still on the list, wb_open_remove() waits for us */
+		next = fh->wb_next;
+		if (--fh->wb_refs == 0) {
+			pthread_cond_broadcast(&wb_open_cond);
+		}
+	}
+	pthread_mutex_unlock(&wb_open_mutex);
+
+	return pushed;
+}
+
+/* Follow a rename of from, or of a directory above it, to to */
+static void
+wb_open_rename(const char *from, const char *to)
+{
+	size_t len = strlen(from);
+	struct fuse_nfs_fh *fh;
+	char *path;
+
+	if (!writeback) {
+		return;
+	}
+	pthread_mutex_lock(&wb_open_mutex);
+	for (fh = wb_open_list; fh; fh = fh->wb_next) {
+		if (strncmp(fh->wb_path, from, len) ||
+		    (fh->wb_path[len] != 0 && fh->wb_path[len] != '/')) {
+			continue;
+		}
+		path = malloc(strlen(to) + strlen(fh->wb_path + len) + 1);
+		if (path == NULL) {
+			continue;
+		}
+		sprintf(path, "%s%s", to, fh->wb_path + len);
+		free(fh->wb_path);
+		fh->wb_path = path;
+	}
+	pthread_mutex_unlock(&wb_open_mutex);
+}
+
+/*
+ * Local disk cache (--cache_dir, --cache_size).
+ *
+ * File data is kept in cache_block_size blocks below cache_dir, in
+ * one directory per NFS file named after its file handle with one file
+ * per block, plus a "meta" file holding the handle, size, mtime and ctime
+ * the blocks belong to. When a file is opened read-only its attributes
+ * are compared with meta and the blocks are dropped if anything changed,
+ * which gives the same close-to-open consistency as the kernel's fscache.
+ * Reads that find their blocks in the cache never go to the server.
+ * A handle remembers a hash of the meta it opened under, and a block it
+ * fetched is thrown away instead of stored if meta has changed since.
+ *
+ * Blocks are evicted least recently used first once the cache grows past
+ * cache_size. The LRU order lives in memory; at startup it is seeded from
+ * the mtimes of the block files.
+ */
+#define DISK_CACHE_BLOCK_SIZE	(1024 * 1024)
+#define DISK_CACHE_BLOCK_MIN	4096
+#define DISK_CACHE_BUCKETS	65536
+#define DISK_CACHE_MAGIC	0x66636e31
+#define DISK_CACHE_FH_SIZE	128
+
+struct disk_cache_meta {
+	uint32_t magic;
+	uint32_t fh_len;
+	char fh[DISK_CACHE_FH_SIZE];
+	uint64_t size;
+	uint64_t mtime;
+	uint64_t mtime_nsec;
+	uint64_t ctime;
+	uint64_t ctime_nsec;
+	uint64_t block_size;
+};
+
+struct disk_cache_block {
+	struct disk_cache_block *next;
+	struct disk_cache_block *lru_prev, *lru_next;
+	uint32_t hash;
+	size_t size;
+	time_t mtime;
+	/* "<handle>/<block number>", relative to disk_cache_dir */
+	char name[];
+};
+
+static char *disk_cache_dir;
+static uint64_t disk_cache_size = 1024ULL * 1024 * 1024;
+static size_t disk_cache_block_size = DISK_CACHE_BLOCK_SIZE;
+static uint64_t disk_cache_used;
+static pthread_mutex_t disk_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct disk_cache_block **disk_cache_table;
+static struct disk_cache_block *disk_cache_lru_head, *disk_cache_lru_tail;
+static uint64_t disk_cache_hits, disk_cache_misses, disk_cache_evictions;
+
+/* The following work on the index and need disk_cache_mutex held */
+static void
+disk_cache_lru_unlink(struct disk_cache_block *b)
+{
+	if (b->lru_prev) {
+		b->lru_prev->lru_next = b->lru_next;
+	} else {
+		disk_cache_lru_head = b->lru_next;
+	}
+	if (b->lru_next) {
+		b->lru_next->lru_prev = b->lru_prev;
+	} else {
+		disk_cache_lru_tail = b->lru_prev;
+	}
+	b->lru_prev = b->lru_next = NULL;
+}
+
+static void
+disk_cache_lru_push(struct disk_cache_block *b)
+{
+	b->lru_prev = NULL;
+	b->lru_next = disk_cache_lru_head;
+	if (disk_cache_lru_head) {
+		disk_cache_lru_head->lru_prev = b;
+	} else {
+		disk_cache_lru_tail = b;
+	}
+	disk_cache_lru_head = b;
+}
+
+static struct disk_cache_block *
+disk_cache_find(const char *name, uint32_t hash)
+{
+	struct disk_cache_block *b;
+
+	for (b = disk_cache_table[hash % DISK_CACHE_BUCKETS]; b; b = b->next) {
+		if (b->hash == hash && !strcmp(b->name, name)) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+static void
+disk_cache_remove(struct disk_cache_block *b)
+{
+	struct disk_cache_block **pp;
+
+	for (pp = &disk_cache_table[b->hash % DISK_CACHE_BUCKETS]; *pp; pp = &(*pp)->next) {
+		if (*pp == b) {
+			*pp = b->next;
+			break;
+		}
+	}
+	disk_cache_lru_unlink(b);
+	disk_cache_used -= b->size;
+	free(b);
+}
+
+static void
+disk_cache_evict(void)
+{
+	struct disk_cache_block *b;
+	char path[PATH_MAX];
+
+	while (disk_cache_used > disk_cache_size && (b = disk_cache_lru_tail) != NULL) {
+		snprintf(path, sizeof(path), "%s/%s", disk_cache_dir, b->name);
+		unlink(path);
+		disk_cache_remove(b);
+		disk_cache_evictions++;
+	}
+}
+
+static void
+disk_cache_insert(const char *name, size_t size)
+{
+	uint32_t hash = path_hash(name);
+	struct disk_cache_block *b;
+
+	b = disk_cache_find(name, hash);
+	if (b) {
+		disk_cache_used -= b->size;
+		b->size = size;
+		disk_cache_used += size;
+		disk_cache_lru_unlink(b);
+		disk_cache_lru_push(b);
+		return;
+	}
+	b = calloc(1, sizeof(struct disk_cache_block) + strlen(name) + 1);
+	if (b == NULL) {
+		return;
+	}
+	strcpy(b->name, name);
+	b->hash = hash;
+	b->size = size;
+	b->next = disk_cache_table[hash % DISK_CACHE_BUCKETS];
+	disk_cache_table[hash % DISK_CACHE_BUCKETS] = b;
+	disk_cache_lru_push(b);
+	disk_cache_used += size;
+}
+
+static int
+disk_cache_mtime_cmp(const void *a, const void *b)
+{
+	const struct disk_cache_block *ba = *(struct disk_cache_block * const *)a;
+	const struct disk_cache_block *bb = *(struct disk_cache_block * const *)b;
+
+	return (ba->mtime > bb->mtime) - (ba->mtime < bb->mtime);
+}
+
+/* Build the index from what an earlier run left in cache_dir */
+static int
+disk_cache_init(void)
+{
+	struct disk_cache_block **blocks = NULL, **tmp, *b;
+	size_t num = 0, alloced = 0, i;
+	char path[PATH_MAX], *dir;
+	struct dirent *de, *fde;
+	struct stat st;
+	DIR *d, *fd;
+
+	if (disk_cache_dir == NULL) {
+		return 0;
+	}
+	if (disk_cache_block_size < DISK_CACHE_BLOCK_MIN) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (mkdir(disk_cache_dir, 0700) != 0 && errno != EEXIST) {
+		return -1;
+	}
+	/* fuse_main() changes to / when it daemonizes */
+	dir = realpath(disk_cache_dir, NULL);
+	if (dir == NULL) {
+		return -1;
+	}
+	free(disk_cache_dir);
+	disk_cache_dir = dir;
+
+	disk_cache_table = calloc(DISK_CACHE_BUCKETS, sizeof(struct disk_cache_block *));
+	if (disk_cache_table == NULL) {
+		return -1;
+	}
+
+	d = opendir(disk_cache_dir);
+	if (d == NULL) {
+		return -1;
+	}
+	while ((de = readdir(d)) != NULL) {
+		if (de->d_name[0] == '.') {
+			continue;
+		}
+		snprintf(path, sizeof(path), "%s/%s", disk_cache_dir, de->d_name);
+		fd = opendir(path);
+		if (fd == NULL) {
+			continue;
+		}
+		while ((fde = readdir(fd)) != NULL) {
+			if (fde->d_name[0] == '.' || !strcmp(fde->d_name, "meta")) {
+				continue;
+			}
+			snprintf(path, sizeof(path), "%s/%s/%s", disk_cache_dir,
+				 de->d_name, fde->d_name);
+			/* Left over from a block we never finished writing */
+			if (strstr(fde->d_name, ".tmp")) {
+				unlink(path);
+				continue;
+			}
+			if (stat(path, &st) != 0) {
+				continue;
+			}
+			if (num == alloced) {
+				alloced = alloced ? alloced * 2 : 1024;
+				tmp = realloc(blocks, alloced * sizeof(*blocks));
+				if (tmp == NULL) {
+					break;
+				}
+				blocks = tmp;
+			}
+			b = calloc(1, sizeof(struct disk_cache_block) +
+				   strlen(de->d_name) + strlen(fde->d_name) + 2);
+			if (b == NULL) {
+				break;
+			}
+			sprintf(b->name, "%s/%s", de->d_name, fde->d_name);
+			b->size = st.st_size;
+			b->mtime = st.st_mtime;
+			blocks[num++] = b;
+		}
+		closedir(fd);
+	}
+	closedir(d);
+
+	/* Oldest first, so the most recently written block ends up at the
+	 * head of the LRU.
+	 */
+	qsort(blocks, num, sizeof(*blocks), disk_cache_mtime_cmp);
+	for (i = 0; i < num; i++) {
+		disk_cache_insert(blocks[i]->name, blocks[i]->size);
+		free(blocks[i]);
+	}
+	free(blocks);
+	disk_cache_evict();
+
+	return 0;
+}
+
+/* Drop every block we have for the file. Needs disk_cache_mutex held. */
+static void
+disk_cache_drop_file(const char *fhname)
+{
+	struct disk_cache_block *b;
+	char path[PATH_MAX], name[PATH_MAX];
+	struct dirent *de;
+	DIR *d;
+
+	snprintf(path, sizeof(path), "%s/%s", disk_cache_dir, fhname);
+	d = opendir(path);
+	if (d == NULL) {
+		return;
+	}
+	while ((de = readdir(d)) != NULL) {
+		if (de->d_name[0] == '.') {
+			continue;
+		}
+		snprintf(name, sizeof(name), "%s/%s", fhname, de->d_name);
+		snprintf(path, sizeof(path), "%s/%s", disk_cache_dir, name);
+		unlink(path);
+		b = disk_cache_find(name, path_hash(name));
+		if (b) {
+			disk_cache_remove(b);
+		}
+	}
+	closedir(d);
+}
+
+/* Write a whole file next to its final name, into tmp */
+static int
+disk_cache_write_tmp(const char *path, const void *buf, size_t size,
+		     char *tmp, size_t tmp_size)
+{
+	int fd, ret;
+
+	snprintf(tmp, tmp_size, "%s.%lx.tmp", path, (unsigned long)pthread_self());
+	fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	if (fd < 0) {
+		return -1;
+	}
+	ret = write(fd, buf, size) == (ssize_t)size ? 0 : -1;
+	close(fd);
+	if (ret != 0) {
+		unlink(tmp);
+	}
+	return ret;
+}
+
+/* Write a whole file next to its final name and rename it into place */
+static int
+disk_cache_write_file(const char *path, const void *buf, size_t size)
+{
+	char tmp[PATH_MAX];
+
+	if (disk_cache_write_tmp(path, buf, size, tmp, sizeof(tmp)) != 0) {
+		return -1;
+	}
+	if (rename(tmp, path) != 0) {
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+static uint32_t
+disk_cache_meta_gen(const struct disk_cache_meta *meta)
+{
+	const unsigned char *p = (const unsigned char *)meta;
+	uint32_t hash = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < sizeof(*meta); i++) {
+		hash ^= p[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/* Is meta of the file still what the handle opened under?
+ * Needs disk_cache_mutex held.
+ */
+static int
+disk_cache_meta_current(struct fuse_nfs_fh *fh)
+{
+	struct disk_cache_meta meta;
+	char path[PATH_MAX];
+	int fd, ret = 0;
+
+	snprintf(path, sizeof(path), "%s/%s/meta", disk_cache_dir, fh->dc_name);
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return 0;
+	}
+	if (read(fd, &meta, sizeof(meta)) == sizeof(meta)) {
+		ret = disk_cache_meta_gen(&meta) == fh->dc_gen;
+	}
+	close(fd);
+	return ret;
+}
+
+/* Decide at open time whether the cached blocks of the file can be used.
+ * Only files opened read-only read from the cache.
+ */
+static void
+disk_cache_open(struct fuse_nfs_fh *fh, int flags)
+{
+	struct nfs_conn *conn = fh->conn;
+	struct disk_cache_meta meta, old;
+	struct sync_cb_data cb_data;
+	const struct nfs_fh *nfs_fh;
+	struct nfs_stat_64 st;
+	char path[PATH_MAX];
+	char *name;
+	u_int i, len;
+	int fd, ret;
+
+	if (disk_cache_dir == NULL || (flags & O_ACCMODE) != O_RDONLY) {
+		return;
+	}
+
+	memset(&cb_data, 0, sizeof(struct sync_cb_data));
+	cb_data.return_data = &st;
+	conn_lock(conn);
+	update_rpc_credentials(conn);
+	ret = nfs_fstat64_async(conn->nfs, fh->nfsfh, stat64_cb, &cb_data);
+	pthread_mutex_unlock(&conn->mutex);
+	if (ret < 0) {
+		return;
+	}
+	wait_for_nfs_reply(conn, &cb_data);
+	if (cb_data.status < 0) {
+		return;
+	}
+
+	nfs_fh = nfs_get_fh(fh->nfsfh);
+	if (nfs_fh->len > DISK_CACHE_FH_SIZE) {
+		return;
+	}
+	memset(&meta, 0, sizeof(meta));
+	meta.magic = DISK_CACHE_MAGIC;
+	meta.fh_len = nfs_fh->len;
+	memcpy(meta.fh, nfs_fh->val, nfs_fh->len);
+	meta.size = st.nfs_size;
+	meta.mtime = st.nfs_mtime;
+	meta.mtime_nsec = st.nfs_mtime_nsec;
+	meta.ctime = st.nfs_ctime;
+	meta.ctime_nsec = st.nfs_ctime_nsec;
+	meta.block_size = disk_cache_block_size;
+
+	/* Long handles do not fit in a file name, those are named by a
+	 * prefix and a hash. meta has the whole handle to tell them apart.
+	 */
+	len = nfs_fh->len > 48 ? 48 : nfs_fh->len;
+	name = malloc(len * 2 + 10);
+	if (name == NULL) {
+		return;
+	}
+	for (i = 0; i < len; i++) {
+		sprintf(&name[i * 2], "%02x", (unsigned char)nfs_fh->val[i]);
+	}
+	if (len < nfs_fh->len) {
+		uint32_t hash = 2166136261u;
+
+		for (i = 0; i < nfs_fh->len; i++) {
+			hash ^= (unsigned char)nfs_fh->val[i];
+			hash *= 16777619u;
+		}
+		sprintf(&name[len * 2], "-%08x", hash);
+	}
+
+	snprintf(path, sizeof(path), "%s/%s", disk_cache_dir, name);
+	if (mkdir(path, 0700) != 0 && errno != EEXIST) {
+		free(name);
+		return;
+	}
+	snprintf(path, sizeof(path), "%s/%s/meta", disk_cache_dir, name);
+	memset(&old, 0, sizeof(old));
+	pthread_mutex_lock(&disk_cache_mutex);
+	fd = open(path, O_RDONLY);
+	if (fd >= 0) {
+		if (read(fd, &old, sizeof(old)) != sizeof(old)) {
+			old.magic = 0;
+		}
+		close(fd);
+	}
+	if (memcmp(&old, &meta, sizeof(meta))) {
+		disk_cache_drop_file(name);
+		if (disk_cache_write_file(path, &meta, sizeof(meta)) != 0) {
+			pthread_mutex_unlock(&disk_cache_mutex);
+			free(name);
+			return;
+		}
+	}
+	pthread_mutex_unlock(&disk_cache_mutex);
+
+	fh->dc_name = name;
+	fh->dc_size = st.nfs_size;
+	fh->dc_gen = disk_cache_meta_gen(&meta);
+}
+
+static int
+disk_cache_read_block(struct fuse_nfs_fh *fh, uint64_t block, size_t block_len,
+		      char *buf, size_t off, size_t count)
+{
+	struct disk_cache_block *b;
+	char name[PATH_MAX], path[PATH_MAX];
+	struct stat st;
+	int fd, ret = -1;
+
+	snprintf(name, sizeof(name), "%s/%llu", fh->dc_name, (unsigned long long)block);
+	snprintf(path, sizeof(path), "%s/%s", disk_cache_dir, name);
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+	if (fstat(fd, &st) == 0 && (size_t)st.st_size == block_len &&
+	    pread(fd, buf, count, off) == (ssize_t)count) {
+		ret = 0;
+	}
+	close(fd);
+	if (ret == 0) {
+		pthread_mutex_lock(&disk_cache_mutex);
+		b = disk_cache_find(name, path_hash(name));
+		if (b) {
+			disk_cache_lru_unlink(b);
+			disk_cache_lru_push(b);
+		}
+		pthread_mutex_unlock(&disk_cache_mutex);
+	}
+	return ret;
+}
+
+static void
+disk_cache_store_block(struct fuse_nfs_fh *fh, uint64_t block, const char *buf,
+		       size_t len)
+{
+	char name[PATH_MAX], path[PATH_MAX], tmp[PATH_MAX];
+
+	snprintf(name, sizeof(name), "%s/%llu", fh->dc_name, (unsigned long long)block);
+	snprintf(path, sizeof(path), "%s/%s", disk_cache_dir, name);
+	if (disk_cache_write_tmp(path, buf, len, tmp, sizeof(tmp)) != 0) {
+		return;
+	}
+	pthread_mutex_lock(&disk_cache_mutex);
+	/* Another open found the file changed while we fetched the block */
+	if (!disk_cache_meta_current(fh) || rename(tmp, path) != 0) {
+		pthread_mutex_unlock(&disk_cache_mutex);
+		unlink(tmp);
+		return;
+	}
+	disk_cache_insert(name, len);
+	disk_cache_evict();
+	pthread_mutex_unlock(&disk_cache_mutex);
+}
+
+static int
+fuse_nfs_disk_cache_read(struct fuse_nfs_fh *fh, char *buf, size_t size,
+			 off_t offset)
+{
+	uint64_t pos, block;
+	size_t done = 0, off, block_len, count;
+	char *tmp;
+	int ret;
+
+	if ((uint64_t)offset >= fh->dc_size) {
+		return 0;
+	}
+	if (size > fh->dc_size - offset) {
+		size = fh->dc_size - offset;
+	}
+
+	while (done < size) {
+		pos = offset + done;
+		block = pos / disk_cache_block_size;
+		off = pos % disk_cache_block_size;
+		block_len = fh->dc_size - block * disk_cache_block_size;
+		if (block_len > disk_cache_block_size) {
+			block_len = disk_cache_block_size;
+		}
+		count = block_len - off;
+		if (count > size - done) {
+			count = size - done;
+		}
+
+		if (disk_cache_read_block(fh, block, block_len, buf + done,
+					  off, count) == 0) {
+			__sync_fetch_and_add(&disk_cache_hits, 1);
+			done += count;
+			continue;
+		}
+		__sync_fetch_and_add(&disk_cache_misses, 1);
+
+		/* Fetch and keep the whole block */
+		tmp = malloc(block_len);
+		if (tmp == NULL) {
+			return done ? (int)done : -ENOMEM;
+		}
+		ret = fuse_nfs_pread(fh, tmp, block_len, block * disk_cache_block_size);
+		if (ret < 0) {
+			free(tmp);
+			return done ? (int)done : ret;
+		}
+		if ((size_t)ret == block_len) {
+			disk_cache_store_block(fh, block, tmp, block_len);
+		}
+		/* The file shrank since we opened it */
+		if ((size_t)ret <= off) {
+			free(tmp);
+			break;
+		}
+		if (count > ret - off) {
+			count = ret - off;
+		}
+		memcpy(buf + done, tmp + off, count);
+		free(tmp);
+		done += count;
+		if ((size_t)ret < block_len) {
+			break;
+		}
+	}
+
+	return done;
+}
+
+static int
+fuse_nfs_read(const char *path, char *buf, size_t size,
+	      off_t offset, struct fuse_file_info *fi)
+{
+	STATS_OP(STAT_READ);
+	TRACE_OP(TRACE_READ, path, NULL, fi, offset, size, 0, 0);
+	struct fuse_nfs_fh *fh = (struct fuse_nfs_fh *)fi->fh;
+	int ret;
+
+	LOG("fuse_nfs_read entered [%s]\n", path);
+
+	if (fh->stats_buf) {
+		return stats_file_read(fh, buf, size, offset);
+	}
+
+	/* Make sure we read back what was written through this handle.
+	 * A write error stays for the next write or flush to report.
+	 */
+	if (writeback) {
+		wb_push(fh);
+	}
+
+	if (fh->dc_name) {
+		ret = fuse_nfs_disk_cache_read(fh, buf, size, offset);
+	} else if (readahead_max) {
+		ret = fuse_nfs_ra_read(fh, buf, size, offset);
+	} else {
+		ret = fuse_nfs_pread(fh, buf, size, offset);
+	}
+	if (ret > 0) {
+		stats_bytes(STAT_READ, ret);
+		__sync_fetch_and_add(&fh->io_bytes, ret);
+	}
+	return ret;
+}
+
+static int fuse_nfs_write(const char *path, const char *buf, size_t size,
+       off_t offset, struct fuse_file_info *fi)
+{
+	STATS_OP(STAT_WRITE);
+	TRACE_OP(TRACE_WRITE, path, NULL, fi, offset, size, 0, 0);
+	struct fuse_nfs_fh *fh = (struct fuse_nfs_fh *)fi->fh;
+	struct nfs_conn *conn = fh->conn;
+	struct sync_cb_data cb_data;
+	int ret;
+
+	LOG("fuse_nfs_write entered [%s]\n", path);
+
+        memset(&cb_data, 0, sizeof(struct sync_cb_data));
+
+	/* Anything we read ahead may be overwritten now */
+	fuse_nfs_ra_write_begin(fh);
+
+	if (writeback) {
+		ret = fuse_nfs_wb_write(fh, buf, size, offset);
+		fuse_nfs_ra_write_end(fh);
+		attr_cache_invalidate(path);
+		if (ret > 0) {
+			stats_bytes(STAT_WRITE, ret);
+			statfs_cache_wrote(ret);
+			__sync_fetch_and_add(&fh->io_bytes, ret);
+		}
+		return ret;
+	}
+
+	sched_lock(conn, &cb_data, sched_class(fh->io_bytes), size);
+        update_rpc_credentials(conn);
+	ret = fuse_nfs_pwrite_async(conn->nfs, fh->nfsfh, buf, offset, size,
+				    generic_cb, &cb_data);
+	if (ret < 0) {
+		sched_done(&cb_data);
+	}
+	pthread_mutex_unlock(&conn->mutex);
+	if (ret < 0) {
+		fuse_nfs_ra_write_end(fh);
+		return ret;
+	}
+	wait_for_nfs_reply(conn, &cb_data);
+	fuse_nfs_ra_write_end(fh);
+	attr_cache_invalidate(path);
+	if (cb_data.status > 0) {
+		stats_bytes(STAT_WRITE, cb_data.status);
+		statfs_cache_wrote(cb_data.status);
+		__sync_fetch_and_add(&fh->io_bytes, cb_data.status);
+	}
+
+	return cb_data.status;
+}
+
+static int fuse_nfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+	STATS_OP(STAT_CREATE);
+	TRACE_OP(TRACE_CREATE, path, NULL, fi, 0, 0, mode, fi->flags);
+	struct sync_cb_data cb_data;
+	struct nfs_conn *conn = conn_for_path(path);
+	struct fuse_nfs_fh *fh;
+	int ret = 0;
+
+	LOG("fuse_nfs_create entered [%s]\n", path);
+
+        memset(&cb_data, 0, sizeof(struct sync_cb_data));
+
+	fi->fh = 0;
+	fh = calloc(1, sizeof(struct fuse_nfs_fh));
+	if (fh == NULL) {
+		return -ENOMEM;
+	}
+
+	conn_lock(conn);
+	update_rpc_credentials(conn);
+	ret = nfs_creat_async(conn->nfs, path, mode, open_cb, &cb_data);
+	pthread_mutex_unlock(&conn->mutex);
+	if (ret < 0) {
+		free(fh);
+		return ret;
+	}
+	wait_for_nfs_reply(conn, &cb_data);
+	attr_cache_invalidate(path);
+	attr_cache_invalidate_parent(path);
+	if (cb_data.status < 0) {
+		free(fh);
+		return cb_data.status;
+	}
+
+	fh->conn = conn;
+	fh->nfsfh = cb_data.return_data;
+	fuse_nfs_fh_init(fh);
+	wb_open_add(fh, path, fi->flags);
+	fi->fh = (uint64_t)fh;
+	
+	return cb_data.status;
+}
+
+static int fuse_nfs_utime(const char *path, struct utimbuf *times)
+{
+	STATS_OP(STAT_UTIME);
+	TRACE_OP(TRACE_UTIME, path, NULL, NULL, times ? times->actime : 0,
+		 times ? times->modtime : 0, 0, times == NULL);
+	struct sync_cb_data cb_data;
+	struct nfs_conn *conn = conn_for_path(path);
+	int ret;
+
+	LOG("fuse_nfs_utime entered [%s]\n", path);
+
+	/* A buffered write reaching the server later would bump mtime */
+	wb_flush_path(path);
+
+        memset(&cb_data, 0, sizeof(struct sync_cb_data));
+
+	conn_lock(conn);
+	update_rpc_credentials(conn);
+	ret = nfs_utime_async(conn->nfs, path, times, generic_cb, &cb_data);
+	pthread_mutex_unlock(&conn->mutex);
+	if (ret < 0) {
+                LOG("fuse_nfs_utime returned %d. %s\n", ret,
+                    nfs_get_error(conn->nfs));
+		return ret;
+	}
+	wait_for_nfs_reply(conn, &cb_data);
+	attr_cache_invalidate(path);
+
+	return cb_data.status;
+}
+
+static int fuse_nfs_unlink(const char *path)
+{
+	STATS_OP(STAT_UNLINK);
+	TRACE_OP(TRACE_UNLINK, path, NULL, NULL, 0, 0, 0, 0);
+	struct sync_cb_data cb_data;
+	struct nfs_conn *conn = conn_for_path(path);
+	int ret;
+
+	LOG("fuse_nfs_unlink entered [%s]\n", path);
+
+        memset(&cb_data, 0, sizeof(struct sync_cb_data));
+
+	conn_lock(conn);
+	update_rpc_credentials(conn);
+        ret = nfs_unlink_async(conn->nfs, path, generic_cb, &cb_data);
+	pthread_mutex_unlock(&conn->mutex);
+	if (ret < 0) {
+		return ret;
+	}
+	wait_for_nfs_reply(conn, &cb_data);
+	attr_cache_invalidate(path);
+	attr_cache_invalidate_parent(path);
+	open_cache_invalidate_tree(path);
+	if (cb_data.status == 0) {
+		statfs_cache_kick();
+	}
+
+	return cb_data.status;
+}
+
+static int fuse_nfs_rmdir(const char *path)
+{
+	STATS_OP(STAT_RMDIR);
+	TRACE_OP(TRACE_RMDIR, path, NULL, NULL, 0, 0, 0, 0);
+	struct sync_cb_data cb_data;
+	struct nfs_conn *conn = conn_for_path(path);
+	int ret;
+
+	LOG("fuse_nfs_mknod entered [%s]\n", path);
+
+        memset(&cb_data, 0, sizeof(struct sync_cb_data));
+
+	conn_lock(conn);
+	update_rpc_credentials(conn);
+	ret = nfs_rmdir_async(conn->nfs, path, generic_cb, &cb_data);
+	pthread_mutex_unlock(&conn->mutex);
+	if (ret < 0) {
+		return ret;
+	}
+	wait_for_nfs_reply(conn, &cb_data);
+	attr_cache_invalidate_tree(path);
+	attr_cache_invalidate_parent(path);
+	open_cache_invalidate_tree(path);
+
+	return cb_data.status;
+}
+
+static int
+fuse_nfs_mkdir(const char *path, mode_t mode)
+{
+	STATS_OP(STAT_MKDIR);
+	TRACE_OP(TRACE_MKDIR, path, NULL, NULL, 0, 0, mode, 0);
+	struct sync_cb_data cb_data;
+	struct nfs_conn *conn = conn_for_path(path);
+	int ret;
+
+	LOG("fuse_nfs_mkdir entered [%s]\n", path);
+
+        memset(&cb_data, 0, sizeof(struct sync_cb_data));
+
+	conn_lock(conn);
+	update_rpc_credentials(conn);
+	ret = nfs_mkdir_async(conn->nfs, path, generic_cb, &cb_data);
+	pthread_mutex_unlock(&conn->mutex);
+	if (ret < 0) {
+		return ret;
+	}
+	wait_for_nfs_reply(conn, &cb_data);
+
+	cb_data.is_finished = 0;
+
+	conn_lock(conn);
+	update_rpc_credentials(conn);
+	ret = nfs_chmod_async(conn->nfs, path, mode, generic_cb, &cb_data);
+	pthread_mutex_unlock(&conn->mutex);
+	if (ret < 0) {
+		return ret;
+	}
+	wait_for_nfs_reply(conn, &cb_data);
+	attr_cache_invalidate(path);
+	attr_cache_invalidate_parent(path);
+
+	return cb_data.status;
+}
+
+static int fuse_nfs_mknod(const char *path, mode_t mode, dev_t rdev)
+{
+	STATS_OP(STAT_MKNOD);
+	TRACE_OP(TRACE_MKNOD, path, NULL, NULL, 0, rdev, mode, 0);
+	struct sync_cb_data cb_data;
+	struct nfs_conn *conn = conn_for_path(path);
+	int ret;
+
+	LOG("fuse_nfs_mknod entered [%s]\n", path);
+
+        memset(&cb_data, 0, sizeof(struct sync_cb_data));
+
+	conn_lock(conn);
+	update_rpc_credentials(conn);
+	ret = nfs_mknod_async(conn->nfs, path, mode, rdev, generic_cb, &cb_data);
+	pthread_mutex_unlock(&conn->mutex);
+	if (ret < 0) {
+		return ret;
+	}
+	wait_for_nfs_reply(conn, &cb_data);
+	attr_cache_invalidate(path);
+	attr_cache_invalidate_parent(path);
+
+	return cb_data.status;
+}
+
+static int fuse_nfs_symlink(const char *from, const char *to)
+{
+	STATS_OP(STAT_SYMLINK);
+	TRACE_OP(TRACE_SYMLINK, to, from, NULL, 0, 0, 0, 0);
+	struct sync_cb_data cb_data;
+	struct nfs_conn *conn = conn_for_path(to);
+	int ret;
+
+	LOG("fuse_nfs_symlink entered [%s -> %s]\n", from, to);
+
+        memset(&cb_data, 0, sizeof(struct sync_cb_data));
+
+	conn_lock(conn);
+	update_rpc_credentials(conn);
+	ret = nfs_symlink_async(conn->nfs, from, to, generic_cb, &cb_data);
+	pthread_mutex_unlock(&conn->mutex);
+	if (ret < 0) {
+		return ret;
+	}
+	wait_for_nfs_reply(conn, &cb_data);
+	attr_cache_invalidate(to);
+	attr_cache_invalidate_parent(to);
+
+	return cb_data.status;
+}
+
+static int fuse_nfs_rename(const char *from, const char *to)
+{
+	STATS_OP(STAT_RENAME);
+	TRACE_OP(TRACE_RENAME, from, to, NULL, 0, 0, 0, 0);
+	struct sync_cb_data cb_data;
+	struct nfs_conn *conn = conn_for_path(from);
+	int ret;
+
+	LOG("fuse_nfs_rename entered [%s -> %s]\n", from, to);
+
+        memset(&cb_data, 0, sizeof(struct sync_cb_data));
+
+	conn_lock(conn);
+	update_rpc_credentials(conn);
+	ret = nfs_rename_async(conn->nfs, from, to, generic_cb, &cb_data);
+	pthread_mutex_unlock(&conn->mutex);
+	if (ret < 0) {
+		return ret;
+	}
+	wait_for_nfs_reply(conn, &cb_data);
+	attr_cache_invalidate_tree(from);
+	attr_cache_invalidate_parent(from);
+	attr_cache_invalidate_tree(to);
+	attr_cache_invalidate_parent(to);
+	open_cache_invalidate_tree(from);
+	open_cache_invalidate_tree(to);
+	if (cb_data.status == 0) {
+		wb_open_rename(from, to);
+	}
+
+	return cb_data.status;
+}
+
+static int
+fuse_nfs_link(const char *from, const char *to)
+{
+	STATS_OP(STAT_LINK);
+	TRACE_OP(TRACE_LINK, from, to, NULL, 0, 0, 0, 0);
+	struct sync_cb_data cb_data;
+	struct nfs_conn *conn = conn_for_path(from);
+	int ret;
+
+	LOG("fuse_nfs_link entered [%s -> %s]\n", from, to);
+
+        memset(&cb_data, 0, sizeof(struct sync_cb_data));
+
+	conn_lock(conn);
+	update_rpc_credentials(conn);
+	ret = nfs_link_async(conn->nfs, from, to, generic_cb, &cb_data);
+	pthread_mutex_unlock(&conn->mutex);
+	if (ret < 0) {
+		return ret;
+	}
+	wait_for_nfs_reply(conn, &cb_data);
+	attr_cache_invalidate(from);
+	attr_cache_invalidate(to);
+	attr_cache_invalidate_parent(to);
+	
+	return cb_data.status;
+}
+
+static int
+fuse_nfs_chmod(const char *path, mode_t mode)
+{
+	STATS_OP(STAT_CHMOD);
+	TRACE_OP(TRACE_CHMOD, path, NULL, NULL, 0, 0, mode, 0);
+	struct sync_cb_data cb_data;
+	struct nfs_conn *conn = conn_for_path(path);
+	int ret;
+
+	LOG("fuse_nfs_chmod entered [%s]\n", path);
+
+	/* Writes held from before must not be checked against the new mode */
+	wb_flush_path(path);
+
+        memset(&cb_data, 0, sizeof(struct sync_cb_data));
+
+	conn_lock(conn);
+	update_rpc_credentials(conn);
+	ret = nfs_chmod_async(conn->nfs, path, mode, generic_cb, &cb_data);
+	pthread_mutex_unlock(&conn->mutex);
+	if (ret < 0) {
+		return ret;
+	}
+	wait_for_nfs_reply(conn, &cb_data);
+	attr_cache_invalidate(path);
+	
+	return cb_data.status;
+}
+
+static int fuse_nfs_chown(const char *path, uid_t uid, gid_t gid)
+{
+	STATS_OP(STAT_CHOWN);
+	TRACE_OP(TRACE_CHOWN, path, NULL, NULL, uid, gid, 0, 0);
+	struct sync_cb_data cb_data;
+	struct nfs_conn *conn = conn_for_path(path);
+	int ret;
+
+	LOG("fuse_nfs_chown entered [%s]\n", path);
+
+	/* Send held writes before the server clears setuid/setgid on chown */
+	wb_flush_path(path);
+
+        memset(&cb_data, 0, sizeof(struct sync_cb_data));
+
+	conn_lock(conn);
+	update_rpc_credentials(conn);
+	ret = nfs_chown_async(conn->nfs, path,
+			      map_reverse_uid(uid), map_reverse_gid(gid),
+			      generic_cb, &cb_data);
+	pthread_mutex_unlock(&conn->mutex);
+	if (ret < 0) {
+		return ret;
+	}
+	wait_for_nfs_reply(conn, &cb_data);
+	attr_cache_invalidate(path);
+	
+	return cb_data.status;
+}
+
+/*
+ * fstat() and ftruncate() on an open file. These work on the handle with
+ * a single RPC instead of looking the path up again, and keep working
+ * when the file was renamed or removed while open.
+ */
+static int
+fuse_nfs_fgetattr(const char *path, struct FUSE_STAT *stbuf,
+		  struct fuse_file_info *fi)
+{
+	STATS_OP(STAT_FGETATTR);
+	TRACE_OP(TRACE_FGETATTR, path, NULL, fi, 0, 0, 0, 0);
+	struct fuse_nfs_fh *fh = (struct fuse_nfs_fh *)fi->fh;
+	struct nfs_conn *conn = fh->conn;
+	struct nfs_stat_64 st;
+	struct sync_cb_data cb_data;
+	uint64_t generation;
+	int ret;
+
+	LOG("fuse_nfs_fgetattr entered [%s]\n", path);
+
+	if (fh->stats_buf) {
+		return stats_file_getattr(STATS_FILE, stbuf);
+	}
+
+	/* The size has to include what we have not written yet.
+	 * A write error stays for the next write or flush to report.
+	 */
+	if (writeback) {
+		wb_push(fh);
+	}
+	generation = attr_cache_generation(path);
+
+        memset(&cb_data, 0, sizeof(struct sync_cb_data));
+	cb_data.return_data = &st;
+
+	conn_lock(conn);
+	update_rpc_credentials(conn);
+	ret = nfs_fstat64_async(conn->nfs, fh->nfsfh, stat64_cb, &cb_data);
+	pthread_mutex_unlock(&conn->mutex);
+	if (ret < 0) {
+		return ret;
+	}
+	wait_for_nfs_reply(conn, &cb_data);
+	if (cb_data.status < 0) {
+		return cb_data.status;
+	}
+
+	attr_cache_update(path, &st, generation);
+	nfs_stat_to_stat(&st, stbuf);
+
+	return 0;
+}
+
+static int
+fuse_nfs_ftruncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+	STATS_OP(STAT_FTRUNCATE);
+	TRACE_OP(TRACE_FTRUNCATE, path, NULL, fi, size, 0, 0, 0);
+	struct fuse_nfs_fh *fh = (struct fuse_nfs_fh *)fi->fh;
+	struct nfs_conn *conn = fh->conn;
+	struct sync_cb_data cb_data;
+	int ret;
+
+	LOG("fuse_nfs_ftruncate entered [%s]\n", path);
+
+	if (fh->stats_buf) {
+		return -EACCES;
+	}
+
+	/* Buffered writes must not land after the truncate.
+	 * A write error stays for the next write or flush to report.
+	 */
+	if (writeback) {
+		wb_push(fh);
+	}
+	fuse_nfs_ra_write_begin(fh);
+
+        memset(&cb_data, 0, sizeof(struct sync_cb_data));
+
+	conn_lock(conn);
+	update_rpc_credentials(conn);
+	ret = nfs_ftruncate_async(conn->nfs, fh->nfsfh, size, generic_cb, &cb_data);
+	pthread_mutex_unlock(&conn->mutex);
+	if (ret < 0) {
+		fuse_nfs_ra_write_end(fh);
+		return ret;
+	}
+	wait_for_nfs_reply(conn, &cb_data);
+	fuse_nfs_ra_write_end(fh);
+	attr_cache_invalidate(path);
+	if (cb_data.status == 0) {
+		statfs_cache_kick();
+	}
+
+	return cb_data.status;
+}
+
+static int fuse_nfs_truncate(const char *path, off_t size)
+{
+	STATS_OP(STAT_TRUNCATE);
+	TRACE_OP(TRACE_TRUNCATE, path, NULL, NULL, size, 0, 0, 0);
+	struct sync_cb_data cb_data;
+	struct nfs_conn *conn = conn_for_path(path);
+	int ret;
+
+	LOG("fuse_nfs_truncate entered [%s]\n", path);
+
+	/* Buffered writes must not land after the truncate */
+	wb_flush_path(path);
+
+        memset(&cb_data, 0, sizeof(struct sync_cb_data));
+
+	conn_lock(conn);
+	update_rpc_credentials(conn);
+	ret = nfs_truncate_async(conn->nfs, path, size, generic_cb, &cb_data);
+	pthread_mutex_unlock(&conn->mutex);
+	if (ret < 0) {
+		return ret;
+	}
+	wait_for_nfs_reply(conn, &cb_data);
+	attr_cache_invalidate(path);
+	if (cb_data.status == 0) {
+		statfs_cache_kick();
+	}
+
+	return cb_data.status;
+}
+
+static int
+fuse_nfs_fsync(const char *path, int isdatasync,
+	       struct fuse_file_info *fi)
+{
+	STATS_OP(STAT_FSYNC);
+	TRACE_OP(TRACE_FSYNC, path, NULL, fi, 0, 0, 0, isdatasync);
+	struct fuse_nfs_fh *fh = (struct fuse_nfs_fh *)fi->fh;
+	struct nfs_conn *conn = fh->conn;
+	struct sync_cb_data cb_data;
+	int ret;
+
+	LOG("fuse_nfs_fsync entered [%s]\n", path);
+
+	if (fh->stats_buf) {
+		return 0;
+	}
+
+	if (writeback) {
+		ret = fuse_nfs_wb_sync(fh, 1);
+		attr_cache_invalidate(path);
+		return ret;
+	}
+
+        memset(&cb_data, 0, sizeof(struct sync_cb_data));
+
+	conn_lock(conn);
+	update_rpc_credentials(conn);
+        ret = nfs_fsync_async(conn->nfs, fh->nfsfh, generic_cb, &cb_data);
+	pthread_mutex_unlock(&conn->mutex);
+	if (ret < 0) {
+		return ret;
+	}
+	wait_for_nfs_reply(conn, &cb_data);
+	
+	return cb_data.status;
+}
+
+/* Called on every close() of the file, the last chance to report errors */
+static int
+fuse_nfs_flush(const char *path, struct fuse_file_info *fi)
+{
+	STATS_OP(STAT_FLUSH);
+	TRACE_OP(TRACE_FLUSH, path, NULL, fi, 0, 0, 0, 0);
+	struct fuse_nfs_fh *fh = (struct fuse_nfs_fh *)fi->fh;
+	int ret;
+
+	LOG("fuse_nfs_flush entered [%s]\n", path);
+
+	if (!writeback || fh->stats_buf) {
+		return 0;
+	}
+	ret = fuse_nfs_wb_sync(fh, 1);
+	attr_cache_invalidate(path);
+
+	return ret;
+}
+
+static void
+statvfs_cb(int status, struct nfs_context *nfs, void *data, void *private_data)
+{
+	struct sync_cb_data *cb_data = private_data;
+
+	if (status >= 0) {
+		memcpy(cb_data->return_data, data, sizeof(struct statvfs));
+	}
+	nfs_reply_done(cb_data, status);
+}
+
+/*
+ * statfs cache (--statfs_cache_ttl).
+ *
+ * df loops, monitoring agents and applications that check for free space
+ * before every write call statfs all the time. With the cache a thread
+ * fetches STATVFS from the server every TIMEOUT seconds and statfs is
+ * answered from the last reply without waiting for the network. Writes
+ * through this mount take their size off the free space until the next
+ * refresh, truncate and unlink trigger a refresh right away since we do
+ * not know how much they freed. If the refresher has not managed to
+ * update the cache for two intervals statfs asks the server itself.
+ */
+static double statfs_cache_ttl;
+static pthread_mutex_t statfs_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t statfs_cache_cond = PTHREAD_COND_INITIALIZER;
+static struct statvfs statfs_cache;
+static double statfs_cache_time;
+static int statfs_cache_valid;
+static uint64_t statfs_cache_written;
+static int statfs_cache_refresh;
+static int statfs_thread_running;
+static int statfs_thread_shutdown;
+static pthread_t statfs_thread;
+
+static int
+statfs_fetch(struct nfs_conn *conn, const char *path, struct statvfs *svfs)
+{
+	struct sync_cb_data cb_data;
+	int ret;
+
+        memset(&cb_data, 0, sizeof(struct sync_cb_data));
+	cb_data.return_data = svfs;
+
+	conn_lock(conn);
+        ret = nfs_statvfs_async(conn->nfs, path, statvfs_cb, &cb_data);
+	pthread_mutex_unlock(&conn->mutex);
+	if (ret < 0) {
+		return ret;
+	}
+	wait_for_nfs_reply(conn, &cb_data);
+
+	return cb_data.status;
+}
+
+static void
+statfs_cache_store(const struct statvfs *svfs)
+{
+	pthread_mutex_lock(&statfs_cache_mutex);
+	statfs_cache = *svfs;
+	statfs_cache_time = monotonic_time();
+	statfs_cache_valid = 1;
+	statfs_cache_written = 0;
+	pthread_mutex_unlock(&statfs_cache_mutex);
+}
+
+/* Fill svfs from the cache. Returns -1 if it is not fresh */
+static int
+statfs_cache_get(struct statvfs *svfs)
+{
+	uint64_t used;
+
+	if (statfs_cache_ttl <= 0) {
+		return -1;
+	}
+	pthread_mutex_lock(&statfs_cache_mutex);
+	if (!statfs_cache_valid ||
+	    monotonic_time() - statfs_cache_time > 2 * statfs_cache_ttl) {
+		pthread_mutex_unlock(&statfs_cache_mutex);
+		return -1;
+	}
+	*svfs = statfs_cache;
+	if (svfs->f_frsize) {
+		used = statfs_cache_written / svfs->f_frsize;
+		svfs->f_bfree -= used < svfs->f_bfree ? used : svfs->f_bfree;
+		svfs->f_bavail -= used < svfs->f_bavail ? used : svfs->f_bavail;
+	}
+	pthread_mutex_unlock(&statfs_cache_mutex);
+
+	return 0;
+}
+
+static void
+statfs_cache_wrote(uint64_t bytes)
+{
+	if (statfs_cache_ttl <= 0) {
+		return;
+	}
+	pthread_mutex_lock(&statfs_cache_mutex);
+	statfs_cache_written += bytes;
+	pthread_mutex_unlock(&statfs_cache_mutex);
+}
+
+/* Space was freed, have the refresher fetch new numbers now */
+static void
+statfs_cache_kick(void)
+{
+	if (statfs_cache_ttl <= 0) {
+		return;
+	}
+	pthread_mutex_lock(&statfs_cache_mutex);
+	statfs_cache_refresh = 1;
+	pthread_cond_signal(&statfs_cache_cond);
+	pthread_mutex_unlock(&statfs_cache_mutex);
+}
+
+static void *
+statfs_refresh_loop(void *arg)
+{
+	struct statvfs svfs;
+	struct timespec ts;
+	double deadline;
+
+	pthread_mutex_lock(&statfs_cache_mutex);
+	while (!statfs_thread_shutdown) {
+		statfs_cache_refresh = 0;
+		pthread_mutex_unlock(&statfs_cache_mutex);
+		if (statfs_fetch(&conns[0], "/", &svfs) == 0) {
+			statfs_cache_store(&svfs);
+		}
+		pthread_mutex_lock(&statfs_cache_mutex);
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		deadline = ts.tv_sec + ts.tv_nsec / 1000000000.0 + statfs_cache_ttl;
+		ts.tv_sec = deadline;
+		ts.tv_nsec = (deadline - ts.tv_sec) * 1000000000;
+		while (!statfs_thread_shutdown && !statfs_cache_refresh) {
+			if (pthread_cond_timedwait(&statfs_cache_cond,
+						   &statfs_cache_mutex, &ts) != 0) {
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&statfs_cache_mutex);
+
+	return NULL;
+}
+
+static void
+statfs_cache_start(void)
+{
+	if (statfs_cache_ttl <= 0 || statfs_thread_running) {
+		return;
+	}
+	statfs_thread_shutdown = 0;
+	if (pthread_create(&statfs_thread, NULL, statfs_refresh_loop, NULL) == 0) {
+		statfs_thread_running = 1;
+	}
+}
+
+static void
+statfs_cache_stop(void)
+{
+	if (!statfs_thread_running) {
+		return;
+	}
+	pthread_mutex_lock(&statfs_cache_mutex);
+	statfs_thread_shutdown = 1;
+	pthread_cond_signal(&statfs_cache_cond);
+	pthread_mutex_unlock(&statfs_cache_mutex);
+	pthread_join(statfs_thread, NULL);
+	statfs_thread_running = 0;
+}
+
+static int
+fuse_nfs_statfs(const char *path, struct statvfs* stbuf)
+{
+	STATS_OP(STAT_STATFS);
+	TRACE_OP(TRACE_STATFS, path, NULL, NULL, 0, 0, 0, 0);
+        int ret;
+        struct statvfs svfs;
+
+	struct nfs_conn *conn = conn_for_path(path);
+
+	LOG("fuse_nfs_statfs entered [%s]\n", path);
+
+	if (statfs_cache_get(stbuf) == 0) {
+		return 0;
+	}
+
+	ret = statfs_fetch(conn, path, &svfs);
+	if (ret < 0) {
+		return ret;
+	}
+	if (statfs_cache_ttl > 0) {
+		statfs_cache_store(&svfs);
+	}
+  
+        stbuf->f_bsize      = svfs.f_bsize;
+        stbuf->f_frsize     = svfs.f_frsize;
+        stbuf->f_fsid       = svfs.f_fsid;
+        stbuf->f_flag       = svfs.f_flag;
+        stbuf->f_namemax    = svfs.f_namemax;
+        stbuf->f_blocks     = svfs.f_blocks;
+        stbuf->f_bfree      = svfs.f_bfree;
+        stbuf->f_bavail     = svfs.f_bavail;
+        stbuf->f_files      = svfs.f_files;
+        stbuf->f_ffree      = svfs.f_ffree;
+        stbuf->f_favail     = svfs.f_favail;
+
+	return ret;
+}
+
+/* fuse_main() may have forked into the background by now so this is
+ * the earliest point where we can start threads of our own.
+ */
+static void *
+fuse_nfs_init(struct fuse_conn_info *conn)
+{
+	int i;
+
+	/* Like the service threads this has to wait until we have forked */
+	log_start();
+
+	LOG("fuse_nfs_init entered\n");
+
+	for (i = 0; i < num_conns + num_user_conns; i++) {
+		if (start_service_thread(&conns[i]) != 0) {
+			fprintf(stderr, "Failed to start the nfs service thread\n");
+			exit(10);
+		}
+	}
+	statfs_cache_start();
+	prefetch_start();
+	return NULL;
+}
+
+static void
+fuse_nfs_destroy(void *private_data)
+{
+	int i;
+
+	LOG("fuse_nfs_destroy entered\n");
+
+	if (attr_cache) {
+		LOG_AT(LOG_LEVEL_INFO, "attribute cache: %llu hits %llu negative hits %llu misses\n",
+		    (unsigned long long)attr_cache_hits,
+		    (unsigned long long)negative_cache_hits,
+		    (unsigned long long)attr_cache_misses);
+	}
+	if (disk_cache_dir) {
+		LOG_AT(LOG_LEVEL_INFO, "disk cache: %llu hits %llu misses %llu evictions, %llu bytes used\n",
+		    (unsigned long long)disk_cache_hits,
+		    (unsigned long long)disk_cache_misses,
+		    (unsigned long long)disk_cache_evictions,
+		    (unsigned long long)disk_cache_used);
+	}
+	if (open_cache_max > 0) {
+		LOG_AT(LOG_LEVEL_INFO, "open cache: %llu hits %llu misses %llu stale\n",
+		    (unsigned long long)open_cache_hits,
+		    (unsigned long long)open_cache_misses,
+		    (unsigned long long)open_cache_stale);
+		/* Every path is below "" */
+		open_cache_invalidate_tree("");
+	}
+	LOG_AT(LOG_LEVEL_INFO, "credentials: %llu switches %llu user connection handovers\n",
+	    (unsigned long long)cred_switches,
+	    (unsigned long long)user_conn_handovers);
+	if (prefetch_max > 0) {
+		LOG_AT(LOG_LEVEL_INFO, "prefetch: %llu getattrs sent %llu already cached %llu dropped\n",
+		    (unsigned long long)prefetch_sent,
+		    (unsigned long long)prefetch_cached,
+		    (unsigned long long)prefetch_dropped);
+	}
+	if (single_flight) {
+		LOG_AT(LOG_LEVEL_INFO, "single flight: %llu calls joined a request in flight\n",
+		    (unsigned long long)flight_joins);
+	}
+	if (sched_bulk_bytes) {
+		LOG_AT(LOG_LEVEL_INFO, "scheduler: %llu waits for data budget\n",
+		    (unsigned long long)sched_waits);
+	}
+	if (adaptive_io) {
+		LOG_AT(LOG_LEVEL_INFO, "adaptive io: reads of %zu bytes, writes of %zu bytes\n",
+		    io_tuners[IO_TUNE_READ].sizes[io_tuners[IO_TUNE_READ].best].size,
+		    io_tuners[IO_TUNE_WRITE].sizes[io_tuners[IO_TUNE_WRITE].best].size);
+	}
+
+	statfs_cache_stop();
+	prefetch_stop();
+	for (i = 0; i < num_conns + num_user_conns; i++) {
+		stop_service_thread(&conns[i]);
+	}
+	trace_close();
+	log_stop();
+}
+
+static struct fuse_operations nfs_oper = {
+	.chmod		= fuse_nfs_chmod,
+	.chown		= fuse_nfs_chown,
+	.create		= fuse_nfs_create,
+	.destroy	= fuse_nfs_destroy,
+	.flush		= fuse_nfs_flush,
+	.fgetattr	= fuse_nfs_fgetattr,
+	.fsync		= fuse_nfs_fsync,
+	.ftruncate	= fuse_nfs_ftruncate,
+	.getattr	= fuse_nfs_getattr,
+	.init		= fuse_nfs_init,
+	.link		= fuse_nfs_link,
+	.mkdir		= fuse_nfs_mkdir,
+	.mknod		= fuse_nfs_mknod,
+	.open		= fuse_nfs_open,
+	.opendir	= fuse_nfs_opendir,
+	.read		= fuse_nfs_read,
+	.readdir	= fuse_nfs_readdir,
+	.readlink	= fuse_nfs_readlink,
+	.release	= fuse_nfs_release,
+	.releasedir	= fuse_nfs_releasedir,
+	.rmdir		= fuse_nfs_rmdir,
+	.unlink		= fuse_nfs_unlink,
+	.utime		= fuse_nfs_utime,
+	.rename		= fuse_nfs_rename,
+	.symlink	= fuse_nfs_symlink,
+	.truncate	= fuse_nfs_truncate,
+	.write		= fuse_nfs_write,
+        .statfs 	= fuse_nfs_statfs,
+};
+
+/*
+ * Low-level FUSE frontend (--lowlevel).
+ *
+ * The path based operations above make libnfs walk every component of
+ * the path with LOOKUP on every call. Here we instead map FUSE node ids
+ * to NFS file handles and talk NFSv3 directly, so every operation costs
+ * one RPC against the handle the kernel already resolved.
+ *
+ * Nodes are created by lookup/create/mkdir/symlink/link, which the kernel
+ * counts as lookups, and freed when forget drops the count to zero. The
+ * same file handle always maps to the same node id.
+ */
+#define LL_NODE_BUCKETS		65536
+#define LL_FH_SIZE		64
+
+struct ll_fh {
+	u_int len;
+	char val[LL_FH_SIZE];
+};
+
+struct ll_node {
+	struct ll_node *ino_next;
+	struct ll_node *fh_next;
+	fuse_ino_t ino;
+	uint64_t nlookup;
+	uint32_t fh_hash;
+	struct ll_fh fh;
+};
+
+static int lowlevel;
+static pthread_mutex_t ll_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct ll_node *ll_ino_table[LL_NODE_BUCKETS];
+static struct ll_node *ll_fh_table[LL_NODE_BUCKETS];
+static fuse_ino_t ll_next_ino = FUSE_ROOT_ID + 1;
+static double ll_timeout = 1.0;
+
+/* What we store in fi->fh for a file opened through the low-level API */
+struct ll_file {
+	struct nfs_conn *conn;
+	struct ll_fh fh;
+	uint64_t io_bytes;
+
+	/* The verifier of the server instance that holds our UNSTABLE
+	 * data. If it changes before COMMIT the server restarted and the
+	 * data may be gone. Protected by mutex, as is dirty.
+	 */
+	pthread_mutex_t mutex;
+	int dirty;		/* UNSTABLE data not COMMITted */
+	char verf[NFS3_WRITEVERFSIZE];
+	int verf_set;
+	int error;		/* reported by the next flush or fsync */
+};
+
+/* Reply data the callbacks copy out before libnfs frees the PDU */
+struct ll_reply {
+	struct sync_cb_data cb_data;
+
+	struct ll_fh fh;
+	int has_fh;
+	fattr3 attr;
+	int has_attr;
+
+	char *data;
+	size_t count;
+	int eof;
+	char verf[NFS3_WRITEVERFSIZE];
+	FSSTAT3resok fsstat;
+};
+
+static uint32_t
+ll_fh_hash(const struct ll_fh *fh)
+{
+	uint32_t hash = 2166136261u;
+	u_int i;
+
+	for (i = 0; i < fh->len; i++) {
+		hash ^= (unsigned char)fh->val[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static int
+ll_fh_set(struct ll_fh *fh, const nfs_fh3 *nfs_fh)
+{
+	if (nfs_fh->data.data_len > LL_FH_SIZE) {
+		return -EIO;
+	}
+	fh->len = nfs_fh->data.data_len;
+	memcpy(fh->val, nfs_fh->data.data_val, fh->len);
+	return 0;
+}
+
+static void
+ll_fh3(struct ll_fh *fh, nfs_fh3 *nfs_fh)
+{
+	nfs_fh->data.data_len = fh->len;
+	nfs_fh->data.data_val = fh->val;
+}
+
+/* Take a lookup reference on the node for fh, creating it if needed */
+static fuse_ino_t
+ll_node_get(const struct ll_fh *fh)
+{
+	uint32_t hash = ll_fh_hash(fh);
+	struct ll_node *node;
+	fuse_ino_t ino;
+
+	pthread_mutex_lock(&ll_mutex);
+	for (node = ll_fh_table[hash % LL_NODE_BUCKETS]; node; node = node->fh_next) {
+		if (node->fh_hash == hash && node->fh.len == fh->len &&
+		    !memcmp(node->fh.val, fh->val, fh->len)) {
+			break;
+		}
+	}
+	if (node == NULL) {
+		node = calloc(1, sizeof(struct ll_node));
+		if (node == NULL) {
+			pthread_mutex_unlock(&ll_mutex);
+			return 0;
+		}
+		node->ino = ll_next_ino++;
+		node->fh = *fh;
+		node->fh_hash = hash;
+		node->ino_next = ll_ino_table[node->ino % LL_NODE_BUCKETS];
+		ll_ino_table[node->ino % LL_NODE_BUCKETS] = node;
+		node->fh_next = ll_fh_table[hash % LL_NODE_BUCKETS];
+		ll_fh_table[hash % LL_NODE_BUCKETS] = node;
+	}
+	node->nlookup++;
+	ino = node->ino;
+	pthread_mutex_unlock(&ll_mutex);
+
+	return ino;
+}
+
+/* Must be called with ll_mutex held */
+static struct ll_node *
+ll_node_find(fuse_ino_t ino)
+{
+	struct ll_node *node;
+
+	for (node = ll_ino_table[ino % LL_NODE_BUCKETS]; node; node = node->ino_next) {
+		if (node->ino == ino) {
+			return node;
+		}
+	}
+	return NULL;
+}
+
+static int
+ll_node_fh(fuse_ino_t ino, struct ll_fh *fh)
+{
+	struct ll_node *node;
+
+	pthread_mutex_lock(&ll_mutex);
+	node = ll_node_find(ino);
+	if (node) {
+		*fh = node->fh;
+	}
+	pthread_mutex_unlock(&ll_mutex);
+
+	return node ? 0 : -ESTALE;
+}
+
+static void
+ll_node_forget(fuse_ino_t ino, uint64_t nlookup)
+{
+	struct ll_node *node, **pp;
+
+	if (ino == FUSE_ROOT_ID) {
+		return;
+	}
+	pthread_mutex_lock(&ll_mutex);
+	node = ll_node_find(ino);
+	if (node == NULL) {
+		pthread_mutex_unlock(&ll_mutex);
+		return;
+	}
+	node->nlookup -= nlookup < node->nlookup ? nlookup : node->nlookup;
+	if (node->nlookup) {
+		pthread_mutex_unlock(&ll_mutex);
+		return;
+	}
+	for (pp = &ll_ino_table[ino % LL_NODE_BUCKETS]; *pp; pp = &(*pp)->ino_next) {
+		if (*pp == node) {
+			*pp = node->ino_next;
+			break;
+		}
+	}
+	for (pp = &ll_fh_table[node->fh_hash % LL_NODE_BUCKETS]; *pp; pp = &(*pp)->fh_next) {
+		if (*pp == node) {
+			*pp = node->fh_next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&ll_mutex);
+	free(node);
+}
+
+static int
+ll_add_root(const struct nfs_fh *nfs_fh)
+{
+	struct ll_node *node;
+
+	if (nfs_fh->len > LL_FH_SIZE) {
+		return -1;
+	}
+	node = calloc(1, sizeof(struct ll_node));
+	if (node == NULL) {
+		return -1;
+	}
+	node->ino = FUSE_ROOT_ID;
+	node->nlookup = 1;
+	node->fh.len = nfs_fh->len;
+	memcpy(node->fh.val, nfs_fh->val, nfs_fh->len);
+	node->fh_hash = ll_fh_hash(&node->fh);
+	ll_ino_table[node->ino % LL_NODE_BUCKETS] = node;
+	ll_fh_table[node->fh_hash % LL_NODE_BUCKETS] = node;
+
+	return 0;
+}
+
+static struct nfs_conn *
+ll_conn(fuse_ino_t ino)
+{
+	return &conns[ino % num_conns];
+}
+
+/* Make update_rpc_credentials() and the uid mapping use the caller of req */
+static void
+ll_set_caller(fuse_req_t req)
+{
+	const struct fuse_ctx *ctx = fuse_req_ctx(req);
+
+	ll_caller_set = 1;
+	ll_caller_uid = ctx->uid;
+	ll_caller_gid = ctx->gid;
+}
+
+/* Send one NFSv3 request and wait for the reply */
+#define LL_RPC(ret, conn, func, args, cb, reply) do {			\
+	memset(&(reply)->cb_data, 0, sizeof(struct sync_cb_data));	\
+	conn_lock(conn);						\
+	update_rpc_credentials(conn);				\
+	ret = func(nfs_get_rpc_context((conn)->nfs), cb, args, reply);	\
+	pthread_mutex_unlock(&(conn)->mutex);				\
+	if (ret == 0) {							\
+		wait_for_nfs_reply(conn, &(reply)->cb_data);		\
+		ret = (reply)->cb_data.status;				\
+	} else {							\
+		ret = -ENOMEM;						\
+	}								\
+} while (0)
+
+/* LL_RPC for READs and WRITEs, which go through the scheduler */
+#define LL_DATA_RPC(ret, conn, cls, bytes, func, args, cb, reply) do {	\
+	memset(&(reply)->cb_data, 0, sizeof(struct sync_cb_data));	\
+	sched_lock(conn, &(reply)->cb_data, cls, bytes);		\
+	update_rpc_credentials(conn);				\
+	ret = func(nfs_get_rpc_context((conn)->nfs), cb, args, reply);	\
+	if (ret != 0) {							\
+		sched_done(&(reply)->cb_data);				\
+	}								\
+	pthread_mutex_unlock(&(conn)->mutex);				\
+	if (ret == 0) {							\
+		wait_for_nfs_reply(conn, &(reply)->cb_data);		\
+		ret = (reply)->cb_data.status;				\
+	} else {							\
+		ret = -ENOMEM;						\
+	}								\
+} while (0)
+
+static void
+ll_copy_attr(struct ll_reply *reply, const post_op_attr *attr)
+{
+	if (attr->attributes_follow) {
+		reply->attr = attr->post_op_attr_u.attributes;
+		reply->has_attr = 1;
+	}
+}
+
+static int
+ll_rpc_status(struct ll_reply *reply, int status, int nfsstatus)
+{
+	if (status != RPC_STATUS_SUCCESS) {
+		nfs_reply_done(&reply->cb_data, -EIO);
+		return -1;
+	}
+	if (nfsstatus != NFS3_OK) {
+		nfs_reply_done(&reply->cb_data, nfs3_errno(nfsstatus));
+		return -1;
+	}
+	return 0;
+}
+
+static void
+ll_lookup_cb(struct rpc_context *rpc, int status, void *data, void *private_data)
+{
+	struct ll_reply *reply = private_data;
+	LOOKUP3res *res = data;
+
+	if (ll_rpc_status(reply, status, status ? 0 : res->status)) {
+		return;
+	}
+	if (ll_fh_set(&reply->fh, &res->LOOKUP3res_u.resok.object) == 0) {
+		reply->has_fh = 1;
+	}
+	ll_copy_attr(reply, &res->LOOKUP3res_u.resok.obj_attributes);
+	nfs_reply_done(&reply->cb_data, 0);
+}
+
+/* CREATE, MKDIR and SYMLINK all return the new handle the same way */
+static void
+ll_new_object(struct ll_reply *reply, const post_op_fh3 *obj,
+	      const post_op_attr *attr)
+{
+	if (obj->handle_follows &&
+	    ll_fh_set(&reply->fh, &obj->post_op_fh3_u.handle) == 0) {
+		reply->has_fh = 1;
+	}
+	ll_copy_attr(reply, attr);
+	nfs_reply_done(&reply->cb_data, 0);
+}
+
+static void
+ll_create_cb(struct rpc_context *rpc, int status, void *data, void *private_data)
+{
+	struct ll_reply *reply = private_data;
+	CREATE3res *res = data;
+
+	if (ll_rpc_status(reply, status, status ? 0 : res->status)) {
+		return;
+	}
+	ll_new_object(reply, &res->CREATE3res_u.resok.obj,
+		      &res->CREATE3res_u.resok.obj_attributes);
+}
+
+static void
+ll_mknod_cb(struct rpc_context *rpc, int status, void *data, void *private_data)
+{
+	struct ll_reply *reply = private_data;
+	MKNOD3res *res = data;
+
+	if (ll_rpc_status(reply, status, status ? 0 : res->status)) {
+		return;
+	}
+	ll_new_object(reply, &res->MKNOD3res_u.resok.obj,
+		      &res->MKNOD3res_u.resok.obj_attributes);
+}
+
+static void
+ll_mkdir_cb(struct rpc_context *rpc, int status, void *data, void *private_data)
+{
+	struct ll_reply *reply = private_data;
+	MKDIR3res *res = data;
+
+	if (ll_rpc_status(reply, status, status ? 0 : res->status)) {
+		return;
+	}
+	ll_new_object(reply, &res->MKDIR3res_u.resok.obj,
+		      &res->MKDIR3res_u.resok.obj_attributes);
+}
+
+static void
+ll_symlink_cb(struct rpc_context *rpc, int status, void *data, void *private_data)
+{
+	struct ll_reply *reply = private_data;
+	SYMLINK3res *res = data;
+
+	if (ll_rpc_status(reply, status, status ? 0 : res->status)) {
+		return;
+	}
+	ll_new_object(reply, &res->SYMLINK3res_u.resok.obj,
+		      &res->SYMLINK3res_u.resok.obj_attributes);
+}
+
+static void
+ll_getattr_cb(struct rpc_context *rpc, int status, void *data, void *private_data)
+{
+	struct ll_reply *reply = private_data;
+	GETATTR3res *res = data;
+
+	if (ll_rpc_status(reply, status, status ? 0 : res->status)) {
+		return;
+	}
+	reply->attr = res->GETATTR3res_u.resok.obj_attributes;
+	reply->has_attr = 1;
+	nfs_reply_done(&reply->cb_data, 0);
+}
+
+static void
+ll_setattr_cb(struct rpc_context *rpc, int status, void *data, void *private_data)
+{
+	struct ll_reply *reply = private_data;
+	SETATTR3res *res = data;
+
+	if (ll_rpc_status(reply, status, status ? 0 : res->status)) {
+		return;
+	}
+	ll_copy_attr(reply, &res->SETATTR3res_u.resok.obj_wcc.after);
+	nfs_reply_done(&reply->cb_data, 0);
+}
+
+static void
+ll_readlink_cb(struct rpc_context *rpc, int status, void *data, void *private_data)
+{
+	struct ll_reply *reply = private_data;
+	READLINK3res *res = data;
+
+	if (ll_rpc_status(reply, status, status ? 0 : res->status)) {
+		return;
+	}
+	reply->data = strdup(res->READLINK3res_u.resok.data);
+	nfs_reply_done(&reply->cb_data, reply->data ? 0 : -ENOMEM);
+}
+
+static void
+ll_read_cb(struct rpc_context *rpc, int status, void *data, void *private_data)
+{
+	struct ll_reply *reply = private_data;
+	READ3res *res = data;
+	READ3resok *resok;
+
+	if (ll_rpc_status(reply, status, status ? 0 : res->status)) {
+		return;
+	}
+	resok = &res->READ3res_u.resok;
+	if (resok->data.data_len > reply->count) {
+		nfs_reply_done(&reply->cb_data, -EIO);
+		return;
+	}
+	memcpy(reply->data, resok->data.data_val, resok->data.data_len);
+	reply->count = resok->data.data_len;
+	reply->eof = resok->eof;
+	nfs_reply_done(&reply->cb_data, 0);
+}
+
+static void
+ll_write_cb(struct rpc_context *rpc, int status, void *data, void *private_data)
+{
+	struct ll_reply *reply = private_data;
+	WRITE3res *res = data;
+
+	if (ll_rpc_status(reply, status, status ? 0 : res->status)) {
+		return;
+	}
+	reply->count = res->WRITE3res_u.resok.count;
+	memcpy(reply->verf, res->WRITE3res_u.resok.verf, NFS3_WRITEVERFSIZE);
+	nfs_reply_done(&reply->cb_data, 0);
+}
+
+static void
+ll_commit_cb(struct rpc_context *rpc, int status, void *data, void *private_data)
+{
+	struct ll_reply *reply = private_data;
+	COMMIT3res *res = data;
+
+	if (ll_rpc_status(reply, status, status ? 0 : res->status)) {
+		return;
+	}
+	memcpy(reply->verf, res->COMMIT3res_u.resok.verf, NFS3_WRITEVERFSIZE);
+	nfs_reply_done(&reply->cb_data, 0);
+}
+
+static void
+ll_fsstat_cb(struct rpc_context *rpc, int status, void *data, void *private_data)
+{
+	struct ll_reply *reply = private_data;
+	FSSTAT3res *res = data;
+
+	if (ll_rpc_status(reply, status, status ? 0 : res->status)) {
+		return;
+	}
+	reply->fsstat = res->FSSTAT3res_u.resok;
+	nfs_reply_done(&reply->cb_data, 0);
+}
+
+/* REMOVE, RMDIR, RENAME and LINK, where we only need the status
+ * which is the first member of all the reply structures.
+ */
+static void
+ll_status_cb(struct rpc_context *rpc, int status, void *data, void *private_data)
+{
+	struct ll_reply *reply = private_data;
+
+	if (ll_rpc_status(reply, status, status ? 0 : *(nfsstat3 *)data)) {
+		return;
+	}
+	nfs_reply_done(&reply->cb_data, 0);
+}
+
+static int
+ll_getattr_fh(struct nfs_conn *conn, struct ll_fh *fh, struct ll_reply *reply)
+{
+	struct GETATTR3args args;
+	int ret;
+
+	memset(&args, 0, sizeof(args));
+	ll_fh3(fh, &args.object);
+	LL_RPC(ret, conn, rpc_nfs3_getattr_async, &args, ll_getattr_cb, reply);
+
+	return ret;
+}
+
+static void
+ll_attr_to_stat(const fattr3 *attr, struct stat *st)
+{
+	struct nfs_stat_64 nst;
+
+	fattr3_to_nfs_stat(attr, &nst);
+	memset(st, 0, sizeof(struct stat));
+	nfs_stat_to_stat(&nst, st);
+}
+
+/* Turn the reply of an operation that created or looked up a directory
+ * entry into a node and its entry parameters
+ */
+static int
+ll_entry(struct nfs_conn *conn, struct ll_reply *reply,
+	 struct fuse_entry_param *e)
+{
+	if (!reply->has_fh) {
+		return -EIO;
+	}
+	if (!reply->has_attr && ll_getattr_fh(conn, &reply->fh, reply) < 0) {
+		return -EIO;
+	}
+
+	memset(e, 0, sizeof(*e));
+	e->ino = ll_node_get(&reply->fh);
+	if (e->ino == 0) {
+		return -ENOMEM;
+	}
+	e->attr_timeout = ll_timeout;
+	e->entry_timeout = ll_timeout;
+	ll_attr_to_stat(&reply->attr, &e->attr);
+
+	return 0;
+}
+
+/* Reply to an operation that created or looked up a directory entry */
+static void
+ll_reply_entry(fuse_req_t req, struct nfs_conn *conn, struct ll_reply *reply)
+{
+	struct fuse_entry_param e;
+	int ret;
+
+	ret = ll_entry(conn, reply, &e);
+	if (ret < 0) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	if (fuse_reply_entry(req, &e) != 0) {
+		ll_node_forget(e.ino, 1);
+	}
+}
+
+static void
+ll_dirop(struct diropargs3 *dirop, struct ll_fh *dir, const char *name)
+{
+	ll_fh3(dir, &dirop->dir);
+	dirop->name = discard_const(name);
+}
+
+static void
+fuse_nfs_ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+	fuse_nfs_init(conn);
+}
+
+static void
+fuse_nfs_ll_destroy(void *userdata)
+{
+	fuse_nfs_destroy(NULL);
+}
+
+static void
+fuse_nfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	STATS_OP(STAT_LOOKUP);
+	struct nfs_conn *conn = ll_conn(parent);
+	struct LOOKUP3args args;
+	struct ll_reply reply;
+	struct ll_fh dir;
+	int ret;
+
+	LOG("fuse_nfs_ll_lookup entered [%lu/%s]\n", parent, name);
+
+	ll_set_caller(req);
+	memset(&reply, 0, sizeof(reply));
+	if (ll_node_fh(parent, &dir) < 0) {
+		fuse_reply_err(req, ESTALE);
+		return;
+	}
+	memset(&args, 0, sizeof(args));
+	ll_dirop(&args.what, &dir, name);
+	LL_RPC(ret, conn, rpc_nfs3_lookup_async, &args, ll_lookup_cb, &reply);
+	if (ret < 0) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	ll_reply_entry(req, conn, &reply);
 }
 
 static void
-readdir_cb(int status, struct nfs_context *nfs, void *data, void *private_data)
+fuse_nfs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
 {
-	struct sync_cb_data *cb_data = private_data;
+	STATS_OP(STAT_FORGET);
+	ll_node_forget(ino, nlookup);
+	fuse_reply_none(req);
+}
 
-	cb_data->is_finished = 1;
-	cb_data->status = status;
+static void
+fuse_nfs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	STATS_OP(STAT_GETATTR);
+	struct nfs_conn *conn = ll_conn(ino);
+	struct ll_reply reply;
+	struct ll_fh fh;
+	struct stat st;
+	int ret;
 
-	LOG("readdir_cb status:%d\n", status);
+	LOG("fuse_nfs_ll_getattr entered [%lu]\n", ino);
 
-	if (status < 0) {
+	ll_set_caller(req);
+	memset(&reply, 0, sizeof(reply));
+	if (ll_node_fh(ino, &fh) < 0) {
+		fuse_reply_err(req, ESTALE);
+		return;
+	}
+	ret = ll_getattr_fh(conn, &fh, &reply);
+	if (ret < 0) {
+		fuse_reply_err(req, -ret);
 		return;
 	}
-	cb_data->return_data = data;
+	ll_attr_to_stat(&reply.attr, &st);
+	fuse_reply_attr(req, &st, ll_timeout);
 }
 
-static int
-fuse_nfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-		 off_t offset, struct fuse_file_info *fi)
+static void
+fuse_nfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+		    int to_set, struct fuse_file_info *fi)
 {
-	struct nfsdir *nfsdir;
-	struct nfsdirent *nfsdirent;
-	struct sync_cb_data cb_data;
+	STATS_OP(STAT_SETATTR);
+	struct nfs_conn *conn = ll_conn(ino);
+	struct SETATTR3args args;
+	struct ll_reply reply;
+	struct ll_fh fh;
+	struct stat st;
 	int ret;
 
-	LOG("fuse_nfs_readdir entered [%s]\n", path);
-
-        memset(&cb_data, 0, sizeof(struct sync_cb_data));
+	LOG("fuse_nfs_ll_setattr entered [%lu]\n", ino);
 
-	pthread_mutex_lock(&nfs_mutex);
-        update_rpc_credentials();
-	ret = nfs_opendir_async(nfs, path, readdir_cb, &cb_data);
-	pthread_mutex_unlock(&nfs_mutex);
-	if (ret < 0) {
-		return ret;
+	ll_set_caller(req);
+	memset(&reply, 0, sizeof(reply));
+	if (ll_node_fh(ino, &fh) < 0) {
+		fuse_reply_err(req, ESTALE);
+		return;
 	}
-	wait_for_nfs_reply(nfs, &cb_data);
 
-	nfsdir = cb_data.return_data;
-	while ((nfsdirent = nfs_readdir(nfs, nfsdir)) != NULL) {
-		filler(buf, nfsdirent->name, NULL, 0);
+	memset(&args, 0, sizeof(args));
+	ll_fh3(&fh, &args.object);
+	if (to_set & FUSE_SET_ATTR_MODE) {
+		args.new_attributes.mode.set_it = 1;
+		args.new_attributes.mode.set_mode3_u.mode = attr->st_mode & 07777;
+	}
+	if (to_set & FUSE_SET_ATTR_UID) {
+		args.new_attributes.uid.set_it = 1;
+		args.new_attributes.uid.set_uid3_u.uid = map_reverse_uid(attr->st_uid);
+	}
+	if (to_set & FUSE_SET_ATTR_GID) {
+		args.new_attributes.gid.set_it = 1;
+		args.new_attributes.gid.set_gid3_u.gid = map_reverse_gid(attr->st_gid);
+	}
+	if (to_set & FUSE_SET_ATTR_SIZE) {
+		args.new_attributes.size.set_it = 1;
+		args.new_attributes.size.set_size3_u.size = attr->st_size;
+	}
+	if (to_set & FUSE_SET_ATTR_ATIME_NOW) {
+		args.new_attributes.atime.set_it = SET_TO_SERVER_TIME;
+	} else if (to_set & FUSE_SET_ATTR_ATIME) {
+		args.new_attributes.atime.set_it = SET_TO_CLIENT_TIME;
+		args.new_attributes.atime.set_atime_u.atime.seconds = attr->st_atime;
+#if defined(HAVE_ST_ATIM)
+		args.new_attributes.atime.set_atime_u.atime.nseconds = attr->st_atim.tv_nsec;
+#endif
+	}
+	if (to_set & FUSE_SET_ATTR_MTIME_NOW) {
+		args.new_attributes.mtime.set_it = SET_TO_SERVER_TIME;
+	} else if (to_set & FUSE_SET_ATTR_MTIME) {
+		args.new_attributes.mtime.set_it = SET_TO_CLIENT_TIME;
+		args.new_attributes.mtime.set_mtime_u.mtime.seconds = attr->st_mtime;
+#if defined(HAVE_ST_ATIM)
+		args.new_attributes.mtime.set_mtime_u.mtime.nseconds = attr->st_mtim.tv_nsec;
+#endif
 	}
 
-	nfs_closedir(nfs, nfsdir);
-
-	return cb_data.status;
+	LL_RPC(ret, conn, rpc_nfs3_setattr_async, &args, ll_setattr_cb, &reply);
+	if (ret == 0 && (to_set & FUSE_SET_ATTR_SIZE)) {
+		statfs_cache_kick();
+	}
+	if (ret == 0 && !reply.has_attr) {
+		ret = ll_getattr_fh(conn, &fh, &reply);
+	}
+	if (ret < 0) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	ll_attr_to_stat(&reply.attr, &st);
+	fuse_reply_attr(req, &st, ll_timeout);
 }
 
 static void
-readlink_cb(int status, struct nfs_context *nfs, void *data, void *private_data)
+fuse_nfs_ll_readlink(fuse_req_t req, fuse_ino_t ino)
 {
-	struct sync_cb_data *cb_data = private_data;
+	STATS_OP(STAT_READLINK);
+	struct nfs_conn *conn = ll_conn(ino);
+	struct READLINK3args args;
+	struct ll_reply reply;
+	struct ll_fh fh;
+	int ret;
 
-	cb_data->is_finished = 1;
-	cb_data->status = status;
+	LOG("fuse_nfs_ll_readlink entered [%lu]\n", ino);
 
-	if (status < 0) {
+	ll_set_caller(req);
+	memset(&reply, 0, sizeof(reply));
+	if (ll_node_fh(ino, &fh) < 0) {
+		fuse_reply_err(req, ESTALE);
+		return;
+	}
+	memset(&args, 0, sizeof(args));
+	ll_fh3(&fh, &args.symlink);
+	LL_RPC(ret, conn, rpc_nfs3_readlink_async, &args, ll_readlink_cb, &reply);
+	if (ret < 0) {
+		fuse_reply_err(req, -ret);
 		return;
 	}
-	strncat(cb_data->return_data, data, cb_data->max_size);
+	fuse_reply_readlink(req, reply.data);
+	free(reply.data);
 }
 
 static int
-fuse_nfs_readlink(const char *path, char *buf, size_t size)
+ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+	  int exclusive, struct ll_reply *reply)
 {
-	struct sync_cb_data cb_data;
+	struct nfs_conn *conn = ll_conn(parent);
+	struct CREATE3args args;
+	struct ll_fh dir;
 	int ret;
 
-	LOG("fuse_nfs_readlink entered [%s]\n", path);
+	if (ll_node_fh(parent, &dir) < 0) {
+		return -ESTALE;
+	}
+	memset(&args, 0, sizeof(args));
+	ll_dirop(&args.where, &dir, name);
+	args.how.mode = exclusive ? GUARDED : UNCHECKED;
+	args.how.createhow3_u.obj_attributes.mode.set_it = 1;
+	args.how.createhow3_u.obj_attributes.mode.set_mode3_u.mode = mode & 07777;
+	LL_RPC(ret, conn, rpc_nfs3_create_async, &args, ll_create_cb, reply);
 
-        memset(&cb_data, 0, sizeof(struct sync_cb_data));
-	*buf = 0;
-	cb_data.return_data = buf;
-	cb_data.max_size = size;
+	return ret;
+}
 
-	pthread_mutex_lock(&nfs_mutex);
-        update_rpc_credentials();
-	ret = nfs_readlink_async(nfs, path, readlink_cb, &cb_data);
-	pthread_mutex_unlock(&nfs_mutex);
-	if (ret < 0) {
-		return ret;
+/* Devices, fifos and sockets */
+static int
+ll_mknod(fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev,
+	 struct ll_reply *reply)
+{
+	struct nfs_conn *conn = ll_conn(parent);
+	struct MKNOD3args args;
+	struct devicedata3 *device = NULL;
+	struct sattr3 *attr;
+	struct ll_fh dir;
+	int ret;
+
+	if (ll_node_fh(parent, &dir) < 0) {
+		return -ESTALE;
 	}
-	wait_for_nfs_reply(nfs, &cb_data);
+	memset(&args, 0, sizeof(args));
+	ll_dirop(&args.where, &dir, name);
+	switch (mode & S_IFMT) {
+	case S_IFCHR:
+		args.what.type = NF3CHR;
+		device = &args.what.mknoddata3_u.chr_device;
+		break;
+	case S_IFBLK:
+		args.what.type = NF3BLK;
+		device = &args.what.mknoddata3_u.blk_device;
+		break;
+	case S_IFSOCK:
+		args.what.type = NF3SOCK;
+		attr = &args.what.mknoddata3_u.sock_attributes;
+		break;
+	case S_IFIFO:
+		args.what.type = NF3FIFO;
+		attr = &args.what.mknoddata3_u.pipe_attributes;
+		break;
+	default:
+		return -EINVAL;
+	}
+	if (device) {
+		device->spec.specdata1 = major(rdev);
+		device->spec.specdata2 = minor(rdev);
+		attr = &device->dev_attributes;
+	}
+	attr->mode.set_it = 1;
+	attr->mode.set_mode3_u.mode = mode & 07777;
+	LL_RPC(ret, conn, rpc_nfs3_mknod_async, &args, ll_mknod_cb, reply);
 
-	return cb_data.status;
+	return ret;
 }
 
 static void
-open_cb(int status, struct nfs_context *nfs, void *data, void *private_data)
+fuse_nfs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+		  mode_t mode, dev_t rdev)
 {
-	struct sync_cb_data *cb_data = private_data;
-
-	cb_data->is_finished = 1;
-	cb_data->status = status;
+	STATS_OP(STAT_MKNOD);
+	struct ll_reply reply;
+	int ret;
 
-	LOG("open_cb status:%d\n", status);
+	LOG("fuse_nfs_ll_mknod entered [%lu/%s]\n", parent, name);
 
-	if (status < 0) {
+	ll_set_caller(req);
+	memset(&reply, 0, sizeof(reply));
+	/* Regular files are made with CREATE, everything else with MKNOD */
+	if (S_ISREG(mode)) {
+		ret = ll_create(req, parent, name, mode, 1, &reply);
+	} else {
+		ret = ll_mknod(parent, name, mode, rdev, &reply);
+	}
+	if (ret < 0) {
+		fuse_reply_err(req, -ret);
 		return;
 	}
-	cb_data->return_data = data;
+	ll_reply_entry(req, ll_conn(parent), &reply);
 }
 
-static int
-fuse_nfs_open(const char *path, struct fuse_file_info *fi)
+static void
+fuse_nfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+		  mode_t mode)
 {
-	struct sync_cb_data cb_data;
+	STATS_OP(STAT_MKDIR);
+	struct nfs_conn *conn = ll_conn(parent);
+	struct MKDIR3args args;
+	struct ll_reply reply;
+	struct ll_fh dir;
 	int ret;
 
-	LOG("fuse_nfs_open entered [%s]\n", path);
-
-        memset(&cb_data, 0, sizeof(struct sync_cb_data));
-
-	pthread_mutex_lock(&nfs_mutex);
-        update_rpc_credentials();
+	LOG("fuse_nfs_ll_mkdir entered [%lu/%s]\n", parent, name);
 
-	fi->fh = 0;
-        ret = nfs_open_async(nfs, path, fi->flags, open_cb, &cb_data);
-	pthread_mutex_unlock(&nfs_mutex);
+	ll_set_caller(req);
+	memset(&reply, 0, sizeof(reply));
+	if (ll_node_fh(parent, &dir) < 0) {
+		fuse_reply_err(req, ESTALE);
+		return;
+	}
+	memset(&args, 0, sizeof(args));
+	ll_dirop(&args.where, &dir, name);
+	args.attributes.mode.set_it = 1;
+	args.attributes.mode.set_mode3_u.mode = mode & 07777;
+	LL_RPC(ret, conn, rpc_nfs3_mkdir_async, &args, ll_mkdir_cb, &reply);
 	if (ret < 0) {
-		return ret;
+		fuse_reply_err(req, -ret);
+		return;
 	}
-	wait_for_nfs_reply(nfs, &cb_data);
+	ll_reply_entry(req, conn, &reply);
+}
 
-	fi->fh = (uint64_t)cb_data.return_data;
+static void
+ll_remove(fuse_req_t req, fuse_ino_t parent, const char *name, int is_dir)
+{
+	struct nfs_conn *conn = ll_conn(parent);
+	struct REMOVE3args rm_args;
+	struct RMDIR3args rmdir_args;
+	struct ll_reply reply;
+	struct ll_fh dir;
+	int ret;
 
-	return cb_data.status;
+	ll_set_caller(req);
+	memset(&reply, 0, sizeof(reply));
+	if (ll_node_fh(parent, &dir) < 0) {
+		fuse_reply_err(req, ESTALE);
+		return;
+	}
+	if (is_dir) {
+		memset(&rmdir_args, 0, sizeof(rmdir_args));
+		ll_dirop(&rmdir_args.object, &dir, name);
+		LL_RPC(ret, conn, rpc_nfs3_rmdir_async, &rmdir_args, ll_status_cb, &reply);
+	} else {
+		memset(&rm_args, 0, sizeof(rm_args));
+		ll_dirop(&rm_args.object, &dir, name);
+		LL_RPC(ret, conn, rpc_nfs3_remove_async, &rm_args, ll_status_cb, &reply);
+		if (ret == 0) {
+			statfs_cache_kick();
+		}
+	}
+	fuse_reply_err(req, -ret);
 }
 
-static int fuse_nfs_release(const char *path, struct fuse_file_info *fi)
+static void
+fuse_nfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-	struct sync_cb_data cb_data;
-	struct nfsfh *nfsfh = (struct nfsfh *)fi->fh;
+	STATS_OP(STAT_UNLINK);
+	LOG("fuse_nfs_ll_unlink entered [%lu/%s]\n", parent, name);
 
-        memset(&cb_data, 0, sizeof(struct sync_cb_data));
+	ll_remove(req, parent, name, 0);
+}
 
-	pthread_mutex_lock(&nfs_mutex);
-	nfs_close_async(nfs, nfsfh, generic_cb, &cb_data);
-	pthread_mutex_unlock(&nfs_mutex);
-	wait_for_nfs_reply(nfs, &cb_data);
+static void
+fuse_nfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	STATS_OP(STAT_RMDIR);
+	LOG("fuse_nfs_ll_rmdir entered [%lu/%s]\n", parent, name);
 
-	return 0;
+	ll_remove(req, parent, name, 1);
 }
 
 static void
-read_cb(int status, struct nfs_context *nfs, void *data, void *private_data)
+fuse_nfs_ll_symlink(fuse_req_t req, const char *link, fuse_ino_t parent,
+		    const char *name)
 {
-	struct sync_cb_data *cb_data = private_data;
+	STATS_OP(STAT_SYMLINK);
+	struct nfs_conn *conn = ll_conn(parent);
+	struct SYMLINK3args args;
+	struct ll_reply reply;
+	struct ll_fh dir;
+	int ret;
 
-	cb_data->is_finished = 1;
-	cb_data->status = status;
+	LOG("fuse_nfs_ll_symlink entered [%lu/%s -> %s]\n", parent, name, link);
 
-	if (status < 0) {
+	ll_set_caller(req);
+	memset(&reply, 0, sizeof(reply));
+	if (ll_node_fh(parent, &dir) < 0) {
+		fuse_reply_err(req, ESTALE);
+		return;
+	}
+	memset(&args, 0, sizeof(args));
+	ll_dirop(&args.where, &dir, name);
+	args.symlink.symlink_data = discard_const(link);
+	LL_RPC(ret, conn, rpc_nfs3_symlink_async, &args, ll_symlink_cb, &reply);
+	if (ret < 0) {
+		fuse_reply_err(req, -ret);
 		return;
 	}
-	memcpy(cb_data->return_data, data, status);
+	ll_reply_entry(req, conn, &reply);
 }
 
-static int
-fuse_nfs_read(const char *path, char *buf, size_t size,
-	      off_t offset, struct fuse_file_info *fi)
+static void
+fuse_nfs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+		   fuse_ino_t newparent, const char *newname)
 {
-	struct nfsfh *nfsfh = (struct nfsfh *)fi->fh;
-	struct sync_cb_data cb_data;
+	STATS_OP(STAT_RENAME);
+	struct nfs_conn *conn = ll_conn(parent);
+	struct RENAME3args args;
+	struct ll_reply reply;
+	struct ll_fh from, to;
 	int ret;
 
-	LOG("fuse_nfs_read entered [%s]\n", path);
-
-        memset(&cb_data, 0, sizeof(struct sync_cb_data));
-	cb_data.return_data = buf;
+	LOG("fuse_nfs_ll_rename entered [%lu/%s -> %lu/%s]\n", parent, name,
+	    newparent, newname);
 
-	pthread_mutex_lock(&nfs_mutex);
-	update_rpc_credentials();
-	ret = nfs_pread_async(nfs, nfsfh, offset, size, read_cb, &cb_data);
-	pthread_mutex_unlock(&nfs_mutex);
-	if (ret < 0) {
-		return ret;
+	ll_set_caller(req);
+	memset(&reply, 0, sizeof(reply));
+	if (ll_node_fh(parent, &from) < 0 || ll_node_fh(newparent, &to) < 0) {
+		fuse_reply_err(req, ESTALE);
+		return;
 	}
-	wait_for_nfs_reply(nfs, &cb_data);
-
-	return cb_data.status;
+	memset(&args, 0, sizeof(args));
+	ll_dirop(&args.from, &from, name);
+	ll_dirop(&args.to, &to, newname);
+	LL_RPC(ret, conn, rpc_nfs3_rename_async, &args, ll_status_cb, &reply);
+	fuse_reply_err(req, -ret);
 }
 
-static int fuse_nfs_write(const char *path, const char *buf, size_t size,
-       off_t offset, struct fuse_file_info *fi)
+static void
+fuse_nfs_ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+		 const char *newname)
 {
-	struct nfsfh *nfsfh = (struct nfsfh *)fi->fh;
-	struct sync_cb_data cb_data;
+	STATS_OP(STAT_LINK);
+	struct nfs_conn *conn = ll_conn(ino);
+	struct LINK3args args;
+	struct ll_reply reply;
+	struct ll_fh fh, dir;
 	int ret;
 
-	LOG("fuse_nfs_write entered [%s]\n", path);
-
-        memset(&cb_data, 0, sizeof(struct sync_cb_data));
+	LOG("fuse_nfs_ll_link entered [%lu -> %lu/%s]\n", ino, newparent, newname);
 
-	pthread_mutex_lock(&nfs_mutex);
-        update_rpc_credentials();
-	ret = nfs_pwrite_async(nfs, nfsfh, offset, size, discard_const(buf),
-			       generic_cb, &cb_data);
-	pthread_mutex_unlock(&nfs_mutex);
+	ll_set_caller(req);
+	memset(&reply, 0, sizeof(reply));
+	if (ll_node_fh(ino, &fh) < 0 || ll_node_fh(newparent, &dir) < 0) {
+		fuse_reply_err(req, ESTALE);
+		return;
+	}
+	memset(&args, 0, sizeof(args));
+	ll_fh3(&fh, &args.file);
+	ll_dirop(&args.link, &dir, newname);
+	LL_RPC(ret, conn, rpc_nfs3_link_async, &args, ll_status_cb, &reply);
 	if (ret < 0) {
-		return ret;
+		fuse_reply_err(req, -ret);
+		return;
 	}
-	wait_for_nfs_reply(nfs, &cb_data);
-
-	return cb_data.status;
+	reply.fh = fh;
+	reply.has_fh = 1;
+	ll_reply_entry(req, conn, &reply);
 }
 
-static int fuse_nfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+static struct ll_file *
+ll_file_new(fuse_ino_t ino, const struct ll_fh *fh)
 {
-	struct sync_cb_data cb_data;
-	int ret = 0;
-
-	LOG("fuse_nfs_create entered [%s]\n", path);
-
-        memset(&cb_data, 0, sizeof(struct sync_cb_data));
+	struct ll_file *file;
 
-	pthread_mutex_lock(&nfs_mutex);
-	update_rpc_credentials();
-	ret = nfs_creat_async(nfs, path, mode, open_cb, &cb_data);
-	pthread_mutex_unlock(&nfs_mutex);
-	if (ret < 0) {
-		return ret;
+	file = calloc(1, sizeof(struct ll_file));
+	if (file == NULL) {
+		return NULL;
 	}
-	wait_for_nfs_reply(nfs, &cb_data);
+	file->conn = ll_conn(ino);
+	file->fh = *fh;
+	pthread_mutex_init(&file->mutex, NULL);
 
-	fi->fh = (uint64_t)cb_data.return_data;
-	
-	return cb_data.status;
+	return file;
 }
 
-static int fuse_nfs_utime(const char *path, struct utimbuf *times)
+static void
+ll_file_free(struct ll_file *file)
 {
-	struct sync_cb_data cb_data;
-	int ret;
-
-	LOG("fuse_nfs_utime entered [%s]\n", path);
+	pthread_mutex_destroy(&file->mutex);
+	free(file);
+}
 
-        memset(&cb_data, 0, sizeof(struct sync_cb_data));
+/* A WRITE came back. Mark the file dirty and check that the server
+ * still is the instance that holds the earlier UNSTABLE writes.
+ */
+static int
+ll_file_wrote(struct ll_file *file, const char *verf)
+{
+	int ret = 0;
 
-	pthread_mutex_lock(&nfs_mutex);
-	update_rpc_credentials();
-	ret = nfs_utime_async(nfs, path, times, generic_cb, &cb_data);
-	pthread_mutex_unlock(&nfs_mutex);
-	if (ret < 0) {
-                LOG("fuse_nfs_utime returned %d. %s\n", ret,
-                    nfs_get_error(nfs));
-		return ret;
+	pthread_mutex_lock(&file->mutex);
+	if (file->verf_set && memcmp(file->verf, verf, NFS3_WRITEVERFSIZE)) {
+		LOG("WRITE verifier changed, unstable data lost\n");
+		if (file->error == 0) {
+			file->error = -EIO;
+		}
+		ret = -EIO;
 	}
-	wait_for_nfs_reply(nfs, &cb_data);
+	memcpy(file->verf, verf, NFS3_WRITEVERFSIZE);
+	file->verf_set = 1;
+	file->dirty = 1;
+	pthread_mutex_unlock(&file->mutex);
 
-	return cb_data.status;
+	return ret;
 }
 
-static int fuse_nfs_unlink(const char *path)
+static void
+fuse_nfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-	struct sync_cb_data cb_data;
-	int ret;
-
-	LOG("fuse_nfs_unlink entered [%s]\n", path);
+	STATS_OP(STAT_OPEN);
+	struct ll_file *file;
+	struct ll_fh fh;
 
-        memset(&cb_data, 0, sizeof(struct sync_cb_data));
+	LOG("fuse_nfs_ll_open entered [%lu]\n", ino);
 
-	pthread_mutex_lock(&nfs_mutex);
-	update_rpc_credentials();
-        ret = nfs_unlink_async(nfs, path, generic_cb, &cb_data);
-	pthread_mutex_unlock(&nfs_mutex);
-	if (ret < 0) {
-		return ret;
+	/* NFSv3 is stateless, all we need is the handle. O_TRUNC arrives
+	 * as a separate setattr.
+	 */
+	if (ll_node_fh(ino, &fh) < 0) {
+		fuse_reply_err(req, ESTALE);
+		return;
+	}
+	file = ll_file_new(ino, &fh);
+	if (file == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	fi->fh = (uint64_t)file;
+	if (fuse_reply_open(req, fi) != 0) {
+		ll_file_free(file);
 	}
-	wait_for_nfs_reply(nfs, &cb_data);
-
-	return cb_data.status;
 }
 
-static int fuse_nfs_rmdir(const char *path)
+static void
+fuse_nfs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+		   mode_t mode, struct fuse_file_info *fi)
 {
-	struct sync_cb_data cb_data;
+	STATS_OP(STAT_CREATE);
+	struct fuse_entry_param e;
+	struct ll_reply reply;
+	struct ll_file *file;
 	int ret;
 
-	LOG("fuse_nfs_mknod entered [%s]\n", path);
-
-        memset(&cb_data, 0, sizeof(struct sync_cb_data));
+	LOG("fuse_nfs_ll_create entered [%lu/%s]\n", parent, name);
 
-	pthread_mutex_lock(&nfs_mutex);
-	update_rpc_credentials();
-	ret = nfs_rmdir_async(nfs, path, generic_cb, &cb_data);
-	pthread_mutex_unlock(&nfs_mutex);
+	ll_set_caller(req);
+	memset(&reply, 0, sizeof(reply));
+	ret = ll_create(req, parent, name, mode, fi->flags & O_EXCL, &reply);
 	if (ret < 0) {
-		return ret;
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	ret = ll_entry(ll_conn(parent), &reply, &e);
+	if (ret < 0) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	/* Like open, the file uses the connection of its own node */
+	file = ll_file_new(e.ino, &reply.fh);
+	if (file == NULL) {
+		ll_node_forget(e.ino, 1);
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	fi->fh = (uint64_t)file;
+	if (fuse_reply_create(req, &e, fi) != 0) {
+		ll_node_forget(e.ino, 1);
+		ll_file_free(file);
 	}
-	wait_for_nfs_reply(nfs, &cb_data);
-
-	return cb_data.status;
 }
 
-static int
-fuse_nfs_mkdir(const char *path, mode_t mode)
+static void
+fuse_nfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+		 struct fuse_file_info *fi)
 {
-	struct sync_cb_data cb_data;
-	int ret;
-
-	LOG("fuse_nfs_mkdir entered [%s]\n", path);
+	STATS_OP(STAT_READ);
+	struct ll_file *file = (struct ll_file *)fi->fh;
+	struct nfs_conn *conn = file->conn;
+	size_t readmax = nfs_get_readmax(conn->nfs);
+	struct READ3args args;
+	struct ll_reply reply;
+	size_t done = 0, chunk;
+	uint64_t sent;
+	char *buf;
+	int ret = 0;
 
-        memset(&cb_data, 0, sizeof(struct sync_cb_data));
+	LOG("fuse_nfs_ll_read entered [%lu]\n", ino);
 
-	pthread_mutex_lock(&nfs_mutex);
-	update_rpc_credentials();
-	ret = nfs_mkdir_async(nfs, path, generic_cb, &cb_data);
-	pthread_mutex_unlock(&nfs_mutex);
-	if (ret < 0) {
-		return ret;
+	ll_set_caller(req);
+	buf = malloc(size ? size : 1);
+	if (buf == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
 	}
-	wait_for_nfs_reply(nfs, &cb_data);
-
-	cb_data.is_finished = 0;
-
-	pthread_mutex_lock(&nfs_mutex);
-	update_rpc_credentials();
-	ret = nfs_chmod_async(nfs, path, mode, generic_cb, &cb_data);
-	pthread_mutex_unlock(&nfs_mutex);
-	if (ret < 0) {
-		return ret;
+	while (done < size) {
+		memset(&reply, 0, sizeof(reply));
+		memset(&args, 0, sizeof(args));
+		ll_fh3(&file->fh, &args.file);
+		args.offset = off + done;
+		chunk = io_tune_size(IO_TUNE_READ, readmax);
+		args.count = size - done < chunk ? size - done : chunk;
+		reply.data = buf + done;
+		reply.count = args.count;
+		sent = stats_now();
+		LL_DATA_RPC(ret, conn, sched_class(file->io_bytes), args.count,
+			    rpc_nfs3_read_async, &args, ll_read_cb, &reply);
+		if (ret < 0) {
+			break;
+		}
+		io_tune_sample(IO_TUNE_READ, args.count, reply.count,
+			       stats_now() - sent);
+		done += reply.count;
+		if (reply.eof || reply.count == 0) {
+			break;
+		}
 	}
-	wait_for_nfs_reply(nfs, &cb_data);
-
-	return cb_data.status;
+	if (ret < 0 && done == 0) {
+		fuse_reply_err(req, -ret);
+	} else {
+		stats_bytes(STAT_READ, done);
+		__sync_fetch_and_add(&file->io_bytes, done);
+		fuse_reply_buf(req, buf, done);
+	}
+	free(buf);
 }
 
-static int fuse_nfs_mknod(const char *path, mode_t mode, dev_t rdev)
+static void
+fuse_nfs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size,
+		  off_t off, struct fuse_file_info *fi)
 {
-	struct sync_cb_data cb_data;
-	int ret;
+	STATS_OP(STAT_WRITE);
+	struct ll_file *file = (struct ll_file *)fi->fh;
+	struct nfs_conn *conn = file->conn;
+	size_t writemax = nfs_get_writemax(conn->nfs);
+	struct WRITE3args args;
+	struct ll_reply reply;
+	size_t done = 0, chunk;
+	uint64_t sent;
+	int ret = 0;
 
-	LOG("fuse_nfs_mknod entered [%s]\n", path);
+	LOG("fuse_nfs_ll_write entered [%lu]\n", ino);
+
+	ll_set_caller(req);
+	while (done < size) {
+		memset(&reply, 0, sizeof(reply));
+		memset(&args, 0, sizeof(args));
+		ll_fh3(&file->fh, &args.file);
+		args.offset = off + done;
+		chunk = io_tune_size(IO_TUNE_WRITE, writemax);
+		args.count = size - done < chunk ? size - done : chunk;
+		args.stable = UNSTABLE;
+		args.data.data_len = args.count;
+		args.data.data_val = discard_const(buf + done);
+		sent = stats_now();
+		LL_DATA_RPC(ret, conn, sched_class(file->io_bytes), args.count,
+			    rpc_nfs3_write_async, &args, ll_write_cb, &reply);
+		if (ret < 0) {
+			break;
+		}
+		io_tune_sample(IO_TUNE_WRITE, args.count, reply.count,
+			       stats_now() - sent);
+		if (reply.count == 0) {
+			ret = -EIO;
+			break;
+		}
+		ret = ll_file_wrote(file, reply.verf);
+		if (ret < 0) {
+			break;
+		}
+		done += reply.count;
+	}
+	if (ret < 0 && done == 0) {
+		fuse_reply_err(req, -ret);
+	} else {
+		stats_bytes(STAT_WRITE, done);
+		statfs_cache_wrote(done);
+		__sync_fetch_and_add(&file->io_bytes, done);
+		fuse_reply_write(req, done);
+	}
+}
 
-        memset(&cb_data, 0, sizeof(struct sync_cb_data));
+/* UNSTABLE writes are only safe on the server once we have COMMITted
+ * them and the COMMIT carries the verifier the WRITEs did.
+ */
+static int
+ll_commit(struct ll_file *file)
+{
+	struct COMMIT3args args;
+	struct ll_reply reply;
+	int dirty, ret = 0;
+
+	/* Clear it before the COMMIT goes out, so that a write finishing
+	 * meanwhile marks the file again rather than being lost.
+	 */
+	pthread_mutex_lock(&file->mutex);
+	dirty = file->dirty;
+	file->dirty = 0;
+	pthread_mutex_unlock(&file->mutex);
+	if (dirty) {
+		memset(&reply, 0, sizeof(reply));
+		memset(&args, 0, sizeof(args));
+		ll_fh3(&file->fh, &args.file);
+		LL_RPC(ret, file->conn, rpc_nfs3_commit_async, &args,
+		       ll_commit_cb, &reply);
+	}
 
-	pthread_mutex_lock(&nfs_mutex);
-	update_rpc_credentials();
-	ret = nfs_mknod_async(nfs, path, mode, rdev, generic_cb, &cb_data);
-	pthread_mutex_unlock(&nfs_mutex);
+	pthread_mutex_lock(&file->mutex);
 	if (ret < 0) {
-		return ret;
+		file->dirty = 1;
+	} else if (dirty) {
+		if (memcmp(file->verf, reply.verf, NFS3_WRITEVERFSIZE)) {
+			LOG("COMMIT verifier changed, unstable data lost\n");
+			memcpy(file->verf, reply.verf, NFS3_WRITEVERFSIZE);
+			ret = -EIO;
+		}
+		/* All committed, the next WRITE starts afresh */
+		if (!file->dirty) {
+			file->verf_set = 0;
+		}
 	}
-	wait_for_nfs_reply(nfs, &cb_data);
+	if (ret == 0) {
+		ret = file->error;
+	}
+	file->error = 0;
+	pthread_mutex_unlock(&file->mutex);
 
-	return cb_data.status;
+	return ret;
 }
 
-static int fuse_nfs_symlink(const char *from, const char *to)
+static void
+fuse_nfs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-	struct sync_cb_data cb_data;
-	int ret;
-
-	LOG("fuse_nfs_symlink entered [%s -> %s]\n", from, to);
-
-        memset(&cb_data, 0, sizeof(struct sync_cb_data));
-
-	pthread_mutex_lock(&nfs_mutex);
-	update_rpc_credentials();
-	ret = nfs_symlink_async(nfs, from, to, generic_cb, &cb_data);
-	pthread_mutex_unlock(&nfs_mutex);
-	if (ret < 0) {
-		return ret;
-	}
-	wait_for_nfs_reply(nfs, &cb_data);
+	STATS_OP(STAT_FLUSH);
+	LOG("fuse_nfs_ll_flush entered [%lu]\n", ino);
 
-	return cb_data.status;
+	ll_set_caller(req);
+	fuse_reply_err(req, -ll_commit((struct ll_file *)fi->fh));
 }
 
-static int fuse_nfs_rename(const char *from, const char *to)
+static void
+fuse_nfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+		  struct fuse_file_info *fi)
 {
-	struct sync_cb_data cb_data;
-	int ret;
+	STATS_OP(STAT_FSYNC);
+	LOG("fuse_nfs_ll_fsync entered [%lu]\n", ino);
 
-	LOG("fuse_nfs_rename entered [%s -> %s]\n", from, to);
+	ll_set_caller(req);
+	fuse_reply_err(req, -ll_commit((struct ll_file *)fi->fh));
+}
 
-        memset(&cb_data, 0, sizeof(struct sync_cb_data));
+static void
+fuse_nfs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	STATS_OP(STAT_RELEASE);
+	struct ll_file *file = (struct ll_file *)fi->fh;
 
-	pthread_mutex_lock(&nfs_mutex);
-	update_rpc_credentials();
-	ret = nfs_rename_async(nfs, from, to, generic_cb, &cb_data);
-	pthread_mutex_unlock(&nfs_mutex);
-	if (ret < 0) {
-		return ret;
-	}
-	wait_for_nfs_reply(nfs, &cb_data);
+	LOG("fuse_nfs_ll_release entered [%lu]\n", ino);
 
-	return cb_data.status;
+	ll_set_caller(req);
+	ll_commit(file);
+	ll_file_free(file);
+	fuse_reply_err(req, 0);
 }
 
-static int
-fuse_nfs_link(const char *from, const char *to)
+static void
+fuse_nfs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-	struct sync_cb_data cb_data;
-	int ret;
-
-	LOG("fuse_nfs_link entered [%s -> %s]\n", from, to);
+	STATS_OP(STAT_OPENDIR);
+	struct fuse_nfs_dir *dir;
+	struct ll_fh fh;
 
-        memset(&cb_data, 0, sizeof(struct sync_cb_data));
+	LOG("fuse_nfs_ll_opendir entered [%lu]\n", ino);
 
-	pthread_mutex_lock(&nfs_mutex);
-	update_rpc_credentials();
-	ret = nfs_link_async(nfs, from, to, generic_cb, &cb_data);
-	pthread_mutex_unlock(&nfs_mutex);
-	if (ret < 0) {
-		return ret;
+	if (ll_node_fh(ino, &fh) < 0) {
+		fuse_reply_err(req, ESTALE);
+		return;
+	}
+	dir = calloc(1, sizeof(struct fuse_nfs_dir));
+	if (dir == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	dir->fh.data.data_val = malloc(fh.len);
+	if (dir->fh.data.data_val == NULL) {
+		free(dir);
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	memcpy(dir->fh.data.data_val, fh.val, fh.len);
+	dir->fh.data.data_len = fh.len;
+	dir->conn = ll_conn(ino);
+	dir->batch_cookie = -1;
+	fi->fh = (uint64_t)dir;
+	if (fuse_reply_open(req, fi) != 0) {
+		free(dir->fh.data.data_val);
+		free(dir);
 	}
-	wait_for_nfs_reply(nfs, &cb_data);
-	
-	return cb_data.status;
 }
 
+struct ll_dirbuf {
+	fuse_req_t req;
+	char *buf;
+	size_t size;
+	size_t pos;
+};
+
+/* A fuse_fill_dir_t that packs the entries into a low-level reply buffer */
 static int
-fuse_nfs_chmod(const char *path, mode_t mode)
+ll_dir_filler(void *buf, const char *name, const struct stat *stbuf, off_t off)
 {
-	struct sync_cb_data cb_data;
-	int ret;
-
-	LOG("fuse_nfs_chmod entered [%s]\n", path);
-
-        memset(&cb_data, 0, sizeof(struct sync_cb_data));
+	struct ll_dirbuf *db = buf;
+	struct stat st;
+	size_t len;
 
-	pthread_mutex_lock(&nfs_mutex);
-	update_rpc_credentials();
-	ret = nfs_chmod_async(nfs, path, mode, generic_cb, &cb_data);
-	pthread_mutex_unlock(&nfs_mutex);
-	if (ret < 0) {
-		return ret;
+	if (stbuf == NULL) {
+		memset(&st, 0, sizeof(st));
+		stbuf = &st;
 	}
-	wait_for_nfs_reply(nfs, &cb_data);
-	
-	return cb_data.status;
+	len = fuse_add_direntry(db->req, db->buf + db->pos, db->size - db->pos,
+				name, stbuf, off);
+	if (len > db->size - db->pos) {
+		return 1;
+	}
+	db->pos += len;
+	return 0;
 }
 
-static int fuse_nfs_chown(const char *path, uid_t uid, gid_t gid)
+static void
+fuse_nfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+		    struct fuse_file_info *fi)
 {
-	struct sync_cb_data cb_data;
+	STATS_OP(STAT_READDIR);
+	struct fuse_nfs_dir *dir = (struct fuse_nfs_dir *)fi->fh;
+	struct ll_dirbuf db;
 	int ret;
 
-	LOG("fuse_nfs_chown entered [%s]\n", path);
-
-        memset(&cb_data, 0, sizeof(struct sync_cb_data));
+	LOG("fuse_nfs_ll_readdir entered [%lu]\n", ino);
 
-	pthread_mutex_lock(&nfs_mutex);
-	update_rpc_credentials();
-	ret = nfs_chown_async(nfs, path,
-			      map_reverse_uid(uid), map_reverse_gid(gid),
-			      generic_cb, &cb_data);
-	pthread_mutex_unlock(&nfs_mutex);
+	ll_set_caller(req);
+	db.req = req;
+	db.size = size;
+	db.pos = 0;
+	db.buf = malloc(size ? size : 1);
+	if (db.buf == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	ret = fuse_nfs_readdir_stream(NULL, dir, &db, ll_dir_filler, off);
 	if (ret < 0) {
-		return ret;
+		fuse_reply_err(req, -ret);
+	} else {
+		fuse_reply_buf(req, db.buf, db.pos);
 	}
-	wait_for_nfs_reply(nfs, &cb_data);
-	
-	return cb_data.status;
+	free(db.buf);
 }
 
-static int fuse_nfs_truncate(const char *path, off_t size)
+static void
+fuse_nfs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-	struct sync_cb_data cb_data;
-	int ret;
+	STATS_OP(STAT_RELEASEDIR);
+	struct fuse_nfs_dir *dir = (struct fuse_nfs_dir *)fi->fh;
 
-	LOG("fuse_nfs_truncate entered [%s]\n", path);
-
-        memset(&cb_data, 0, sizeof(struct sync_cb_data));
-
-	pthread_mutex_lock(&nfs_mutex);
-	update_rpc_credentials();
-	ret = nfs_truncate_async(nfs, path, size, generic_cb, &cb_data);
-	pthread_mutex_unlock(&nfs_mutex);
-	if (ret < 0) {
-		return ret;
-	}
-	wait_for_nfs_reply(nfs, &cb_data);
-
-	return cb_data.status;
+	free_dir_batch(dir);
+	free(dir->fh.data.data_val);
+	free(dir);
+	fuse_reply_err(req, 0);
 }
 
-static int
-fuse_nfs_fsync(const char *path, int isdatasync,
-	       struct fuse_file_info *fi)
+static void
+fuse_nfs_ll_statfs(fuse_req_t req, fuse_ino_t ino)
 {
-	struct nfsfh *nfsfh = (struct nfsfh *)fi->fh;
-	struct sync_cb_data cb_data;
+	STATS_OP(STAT_STATFS);
+	struct nfs_conn *conn = ll_conn(FUSE_ROOT_ID);
+	struct FSSTAT3args args;
+	struct ll_reply reply;
+	struct statvfs svfs;
+	struct ll_fh fh;
 	int ret;
 
-	LOG("fuse_nfs_fsync entered [%s]\n", path);
+	LOG("fuse_nfs_ll_statfs entered [%lu]\n", ino);
 
-        memset(&cb_data, 0, sizeof(struct sync_cb_data));
+	if (statfs_cache_get(&svfs) == 0) {
+		fuse_reply_statfs(req, &svfs);
+		return;
+	}
 
-	pthread_mutex_lock(&nfs_mutex);
-	update_rpc_credentials();
-        ret = nfs_fsync_async(nfs, nfsfh, generic_cb, &cb_data);
-	pthread_mutex_unlock(&nfs_mutex);
+	ll_set_caller(req);
+	memset(&reply, 0, sizeof(reply));
+	ll_node_fh(FUSE_ROOT_ID, &fh);
+	memset(&args, 0, sizeof(args));
+	ll_fh3(&fh, &args.fsroot);
+	LL_RPC(ret, conn, rpc_nfs3_fsstat_async, &args, ll_fsstat_cb, &reply);
 	if (ret < 0) {
-		return ret;
+		fuse_reply_err(req, -ret);
+		return;
 	}
-	wait_for_nfs_reply(nfs, &cb_data);
-	
-	return cb_data.status;
+
+	memset(&svfs, 0, sizeof(svfs));
+	svfs.f_bsize   = 4096;
+	svfs.f_frsize  = 4096;
+	svfs.f_blocks  = reply.fsstat.tbytes / 4096;
+	svfs.f_bfree   = reply.fsstat.fbytes / 4096;
+	svfs.f_bavail  = reply.fsstat.abytes / 4096;
+	svfs.f_files   = reply.fsstat.tfiles;
+	svfs.f_ffree   = reply.fsstat.ffiles;
+	svfs.f_favail  = reply.fsstat.afiles;
+	svfs.f_namemax = 255;
+	if (statfs_cache_ttl > 0) {
+		statfs_cache_store(&svfs);
+	}
+	fuse_reply_statfs(req, &svfs);
 }
 
-static void
-statvfs_cb(int status, struct nfs_context *nfs, void *data, void *private_data)
-{
-	struct sync_cb_data *cb_data = private_data;
+static struct fuse_lowlevel_ops nfs_ll_oper = {
+	.create		= fuse_nfs_ll_create,
+	.destroy	= fuse_nfs_ll_destroy,
+	.flush		= fuse_nfs_ll_flush,
+	.forget		= fuse_nfs_ll_forget,
+	.fsync		= fuse_nfs_ll_fsync,
+	.getattr	= fuse_nfs_ll_getattr,
+	.init		= fuse_nfs_ll_init,
+	.link		= fuse_nfs_ll_link,
+	.lookup		= fuse_nfs_ll_lookup,
+	.mkdir		= fuse_nfs_ll_mkdir,
+	.mknod		= fuse_nfs_ll_mknod,
+	.open		= fuse_nfs_ll_open,
+	.opendir	= fuse_nfs_ll_opendir,
+	.read		= fuse_nfs_ll_read,
+	.readdir	= fuse_nfs_ll_readdir,
+	.readlink	= fuse_nfs_ll_readlink,
+	.release	= fuse_nfs_ll_release,
+	.releasedir	= fuse_nfs_ll_releasedir,
+	.rename		= fuse_nfs_ll_rename,
+	.rmdir		= fuse_nfs_ll_rmdir,
+	.setattr	= fuse_nfs_ll_setattr,
+	.statfs		= fuse_nfs_ll_statfs,
+	.symlink	= fuse_nfs_ll_symlink,
+	.unlink		= fuse_nfs_ll_unlink,
+	.write		= fuse_nfs_ll_write,
+};
 
-	cb_data->is_finished = 1;
-	cb_data->status = status;
+/* Options of the high-level library that fuse_lowlevel_new() refuses */
+static const char *ll_highlevel_opts[] = {
+	"entry_timeout", "attr_timeout", "negative_timeout", "ac_attr_timeout",
+	"umask", "uid", "gid", "kernel_cache", "auto_cache", "use_ino",
+	"readdir_ino", "hard_remove", "intr", "intr_signal", "direct_io",
+	NULL
+};
 
-	if (status < 0) {
-		return;
+/* The first of argv the low-level API does not take, or NULL */
+static const char *
+ll_highlevel_opt(int argc, char *argv[])
+{
+	const char **opt;
+	size_t len;
+	int i;
+
+	for (i = 0; i < argc; i++) {
+		if (strncmp(argv[i], "-o", 2)) {
+			continue;
+		}
+		len = strcspn(argv[i] + 2, "=");
+		for (opt = ll_highlevel_opts; *opt; opt++) {
+			if (strlen(*opt) == len &&
+			    !strncmp(argv[i] + 2, *opt, len)) {
+				return argv[i];
+			}
+		}
 	}
-	memcpy(cb_data->return_data, data, sizeof(struct statvfs));
+	return NULL;
 }
 
+/* The equivalent of fuse_main() for the low-level API */
 static int
-fuse_nfs_statfs(const char *path, struct statvfs* stbuf)
+fuse_nfs_ll_main(int argc, char *argv[])
 {
-        int ret;
-        struct statvfs svfs;
-
-	struct sync_cb_data cb_data;
-
-	LOG("fuse_nfs_statfs entered [%s]\n", path);
-
-        memset(&cb_data, 0, sizeof(struct sync_cb_data));
-	cb_data.return_data = &svfs;
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+#ifndef HAVE_NFS_GET_ROOTFH
+	struct nfsfh *nfsfh;
+#endif
+	struct fuse_session *se;
+	struct fuse_chan *ch;
+	char *mountpoint;
+	int multithreaded, foreground;
+	int ret = -1;
+
+#ifdef HAVE_NFS_GET_ROOTFH
+	/* The handle the MOUNT call returned */
+	ret = ll_add_root(nfs_get_rootfh(conns[0].nfs));
+#else
+	/* Older libnfs does not hand out the root handle, so open the
+	 * root instead. The service threads are not running yet, so we
+	 * can use the synchronous API.
+	 */
+	if (nfs_open(conns[0].nfs, "/", O_RDONLY, &nfsfh) != 0) {
+		fprintf(stderr, "Failed to open the root of the share : %s\n",
+			nfs_get_error(conns[0].nfs));
+		return 10;
+	}
+	ret = ll_add_root(nfs_get_fh(nfsfh));
+	nfs_close(conns[0].nfs, nfsfh);
+#endif
+	if (ret != 0) {
+		fprintf(stderr, "Unsupported root file handle\n");
+		return 10;
+	}
+	if (attr_cache_ttl > 0) {
+		ll_timeout = attr_cache_ttl;
+	}
 
-	pthread_mutex_lock(&nfs_mutex);
-        ret = nfs_statvfs_async(nfs, path, statvfs_cb, &cb_data);
-	pthread_mutex_unlock(&nfs_mutex);
-	if (ret < 0) {
-		return ret;
+	if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) != 0) {
+		return 10;
 	}
-	wait_for_nfs_reply(nfs, &cb_data);
-  
-        stbuf->f_bsize      = svfs.f_bsize;
-        stbuf->f_frsize     = svfs.f_frsize;
-        stbuf->f_fsid       = svfs.f_fsid;
-        stbuf->f_flag       = svfs.f_flag;
-        stbuf->f_namemax    = svfs.f_namemax;
-        stbuf->f_blocks     = svfs.f_blocks;
-        stbuf->f_bfree      = svfs.f_bfree;
-        stbuf->f_bavail     = svfs.f_bavail;
-        stbuf->f_files      = svfs.f_files;
-        stbuf->f_ffree      = svfs.f_ffree;
-        stbuf->f_favail     = svfs.f_favail;
+	ch = fuse_mount(mountpoint, &args);
+	if (ch == NULL) {
+		fuse_opt_free_args(&args);
+		return 10;
+	}
+	ret = -1;
+	se = fuse_lowlevel_new(&args, &nfs_ll_oper, sizeof(nfs_ll_oper), NULL);
+	if (se != NULL) {
+		if (fuse_set_signal_handlers(se) != -1) {
+			fuse_session_add_chan(se, ch);
+			fuse_daemonize(foreground);
+			if (multithreaded) {
+				ret = fuse_session_loop_mt(se);
+			} else {
+				ret = fuse_session_loop(se);
+			}
+			fuse_remove_signal_handlers(se);
+			fuse_session_remove_chan(ch);
+		}
+		fuse_session_destroy(se);
+	}
+	fuse_unmount(mountpoint, ch);
+	free(mountpoint);
+	fuse_opt_free_args(&args);
 
-	return cb_data.status;
+	return ret ? 1 : 0;
 }
 
-static struct fuse_operations nfs_oper = {
-	.chmod		= fuse_nfs_chmod,
-	.chown		= fuse_nfs_chown,
-	.create		= fuse_nfs_create,
-	.fsync		= fuse_nfs_fsync,
-	.getattr	= fuse_nfs_getattr,
-	.link		= fuse_nfs_link,
-	.mkdir		= fuse_nfs_mkdir,
-	.mknod		= fuse_nfs_mknod,
-	.open		= fuse_nfs_open,
-	.read		= fuse_nfs_read,
-	.readdir	= fuse_nfs_readdir,
-	.readlink	= fuse_nfs_readlink,
-	.release	= fuse_nfs_release,
-	.rmdir		= fuse_nfs_rmdir,
-	.unlink		= fuse_nfs_unlink,
-	.utime		= fuse_nfs_utime,
-	.rename		= fuse_nfs_rename,
-	.symlink	= fuse_nfs_symlink,
-	.truncate	= fuse_nfs_truncate,
-	.write		= fuse_nfs_write,
-        .statfs 	= fuse_nfs_statfs,
+/* Options that only have a long form */
+enum {
+	OPT_CONNECTIONS = 256,
+	OPT_ATTR_CACHE_TTL,
+	OPT_READDIR_STREAM,
+	OPT_LOWLEVEL,
+	OPT_READAHEAD_MAX,
+	OPT_WRITEBACK,
+	OPT_CACHE_DIR,
+	OPT_CACHE_SIZE,
+	OPT_NEGATIVE_CACHE_TTL,
+	OPT_LOG_LEVEL,
+	OPT_TRACE_FILE,
+	OPT_USER_CONNECTIONS,
+	OPT_OPEN_CACHE_MAX,
+	OPT_OPEN_CACHE_TIMEOUT,
+	OPT_STATFS_CACHE_TTL,
+	OPT_ADAPTIVE_IO,
+	OPT_SCHED_BULK_BYTES,
+	OPT_SCHED_PER_UID,
+	OPT_SINGLE_FLIGHT,
+	OPT_PREFETCH_MAX,
+	OPT_CACHE_BLOCK_SIZE,
 };
 
 void print_usage(char *name)
@@ -847,6 +7802,48 @@ void print_usage(char *name)
 			"\t [-G NFS_GID|--fusenfs_gid=NFS_GID] \n"
 			"\t\t The gid passed within the rpc credentials within the mount point \n"
 			"\t\t This is the same as passing the gid within the url, however if both are defined then the url's one is used\n"
+			"\t [--connections=N] \n"
+			"\t\t Mount the share N times and spread requests over the N connections, default is 1 \n"
+			"\t [--user_connections=N] \n"
+			"\t\t N more connections that each serve the path operations of one uid/gid, default is 0 \n"
+			"\t\t These then serve all path operations and file I/O instead of the --connections pool \n"
+			"\t [--attr_cache_ttl=TIMEOUT] \n"
+			"\t\t Cache file attributes inside fuse-nfs for TIMEOUT seconds, default is 0 (disabled) \n"
+			"\t [--negative_cache_ttl=TIMEOUT] \n"
+			"\t\t Remember paths that do not exist for TIMEOUT seconds, default is 0 (disabled) \n"
+			"\t [--readdir_stream] \n"
+			"\t\t Page through large directories in bounded READDIRPLUS batches (NFSv3 only) \n"
+			"\t [--lowlevel] \n"
+			"\t\t Use the inode based FUSE low-level API and talk NFSv3 on file handles directly \n"
+			"\t\t Not with -u, -g, -K, -d, -k, -c, -E, -N, -T, -C, -h, -q, -Q, -i or -I \n"
+			"\t [--readahead_max=BYTES] \n"
+			"\t\t Keep up to BYTES of reads in flight ahead of sequential readers, 0 disables \n"
+			"\t [--writeback[=N]] \n"
+			"\t\t Buffer writes into wsize UNSTABLE WRITEs, N in flight per file (default 8), COMMIT on flush/fsync \n"
+			"\t [--adaptive_io] \n"
+			"\t\t Measure reads and writes of different sizes up to rsize/wsize and use the fastest \n"
+			"\t [--prefetch_max=N] \n"
+			"\t\t Fetch attributes readdir did not return in the background, N at a time, needs --attr_cache_ttl \n"
+			"\t [--single_flight] \n"
+			"\t\t Let identical concurrent getattr, readlink and readdir calls share one request \n"
+			"\t [--sched_bulk_bytes=BYTES] \n"
+			"\t\t Keep at most BYTES of bulk and of interactive READs/WRITEs in flight per connection ahead of metadata, 0 disables \n"
+			"\t [--sched_per_uid] \n"
+			"\t\t Let uids waiting for that budget take turns \n"
+			"\t [--cache_dir=DIR] \n"
+			"\t\t Keep file data read through read-only opens in a local disk cache in DIR \n"
+			"\t [--cache_size=BYTES] \n"
+			"\t\t Size budget of the disk cache, default 1GiB \n"
+			"\t [--cache_block_size=BYTES] \n"
+			"\t\t Unit the disk cache fetches and keeps data in, at least 4096, default 1MiB \n"
+			"\t [--statfs_cache_ttl=TIMEOUT] \n"
+			"\t\t Answer statfs from a copy refreshed in the background every TIMEOUT seconds, default 0 (disabled) \n"
+			"\t [--open_cache_max=N] \n"
+			"\t\t Keep up to N released file handles open for reuse by the next open, default 0 \n"
+			"\t [--open_cache_timeout=TIMEOUT] \n"
+			"\t\t Close handles kept for reuse after TIMEOUT idle seconds, default 1.0 \n"
+			"\t [--trace_file=FILE] \n"
+			"\t\t Record every operation into FILE for fuse-nfs-replay (not with --lowlevel) \n"
 			"\t [-o|--fusenfs_allow_other_own_ids] \n"
 			"\t\t Allow fuse-nfs with allow_user activated to update the rpc credentials with the current (other) user credentials instead\n"
 			"\t\t of using the mount user credentials or (if defined) the custom credentials defined with -U/-G / url \n" 
@@ -875,13 +7872,15 @@ void print_usage(char *name)
 			"\t [-T TIMEOUT|--attr_timeout=TIMEOUT] \n"
 			"\t [-C TIMEOUT|--ac_attr_timeout=TIMEOUT] \n"
 			"\t [-L|--logfile=logfile] \n"
+			"\t [--log_level=LEVEL] \n"
+			"\t\t Only log messages up to LEVEL: 0 errors, 1 warnings, 2 info, 3 debug (default) \n"
 			"\t [-l|--large_read] \n"
 			"\t [-R MAX_READ|--max_read=MAX_READ] \n"
 			"\t [-H MAX_READAHEAD|--max_readahead=MAX_READAHEAD] \n"
 			"\t [-A|--async_read] \n"
 			"\t [-S|--sync_read] \n"
 			"\t [-W MAX_WRITE|--max_write=MAX_WRITE] \n"
-			"\t\t Default is 32768 \n"
+			"\t\t Default is the wsize of the server, max_read and max_readahead default to its rsize \n"
 			"\t [-h|--hard_remove] \n"
 			"\t [-Y|--nonempty] \n"
 			"\t [-q|--use_ino] \n"
@@ -945,10 +7944,32 @@ int main(int argc, char *argv[])
 		{ "readdir_ino", required_argument, 0, 'Q' },
 		{ "multithread", required_argument, 0, 't' },
 		{ "read_only", no_argument, 0, 'O' },
+		/*fuse-nfs long-only options*/
+		{ "connections", required_argument, 0, OPT_CONNECTIONS },
+		{ "attr_cache_ttl", required_argument, 0, OPT_ATTR_CACHE_TTL },
+		{ "readdir_stream", no_argument, 0, OPT_READDIR_STREAM },
+		{ "lowlevel", no_argument, 0, OPT_LOWLEVEL },
+		{ "readahead_max", required_argument, 0, OPT_READAHEAD_MAX },
+		{ "writeback", optional_argument, 0, OPT_WRITEBACK },
+		{ "adaptive_io", no_argument, 0, OPT_ADAPTIVE_IO },
+		{ "sched_bulk_bytes", required_argument, 0, OPT_SCHED_BULK_BYTES },
+		{ "sched_per_uid", no_argument, 0, OPT_SCHED_PER_UID },
+		{ "single_flight", no_argument, 0, OPT_SINGLE_FLIGHT },
+		{ "prefetch_max", required_argument, 0, OPT_PREFETCH_MAX },
+		{ "cache_dir", required_argument, 0, OPT_CACHE_DIR },
+		{ "cache_size", required_argument, 0, OPT_CACHE_SIZE },
+		{ "cache_block_size", required_argument, 0, OPT_CACHE_BLOCK_SIZE },
+		{ "negative_cache_ttl", required_argument, 0, OPT_NEGATIVE_CACHE_TTL },
+		{ "log_level", required_argument, 0, OPT_LOG_LEVEL },
+		{ "trace_file", required_argument, 0, OPT_TRACE_FILE },
+		{ "user_connections", required_argument, 0, OPT_USER_CONNECTIONS },
+		{ "open_cache_max", required_argument, 0, OPT_OPEN_CACHE_MAX },
+		{ "open_cache_timeout", required_argument, 0, OPT_OPEN_CACHE_TIMEOUT },
+		{ "statfs_cache_ttl", required_argument, 0, OPT_STATFS_CACHE_TTL },
 		{ NULL, 0, 0, 0 }
 	};
 
-	int c;
+	int c, n;
 	int opt_idx = 0;
 	char *url = NULL;
 	char *mnt = NULL;
@@ -969,9 +7990,10 @@ int main(int argc, char *argv[])
 	char fuse_intr_signal_arg[32] = {0};
 
 	struct nfs_url *urls = NULL;
+	size_t readmax, writemax;
 
 	int fuse_nfs_argc = 2;
-	char *fuse_nfs_argv[34] = {
+	char *fuse_nfs_argv[40] = {
 		"fuse-nfs",
 		"<export>",
 		NULL,
@@ -1005,6 +8027,12 @@ int main(int argc, char *argv[])
 		NULL,
 		NULL,
 		NULL,
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+		NULL,
         };
 
 	while ((c = getopt_long(argc, argv, "?am:n:U:G:u:g:Dp:drklL:hf:s:biR:W:H:ASK:E:N:T:C:oYI:qQct:O", long_opts, &opt_idx)) > 0) {
@@ -1136,6 +8164,82 @@ int main(int argc, char *argv[])
 	        case 'O':
 			fuse_nfs_argv[fuse_nfs_argc++] = "-oro";
 			break;
+		case OPT_CONNECTIONS:
+			num_conns = atoi(optarg);
+			if (num_conns < 1) {
+				num_conns = 1;
+			}
+			break;
+		case OPT_ATTR_CACHE_TTL:
+			attr_cache_ttl = atof(optarg);
+			break;
+		case OPT_READDIR_STREAM:
+			readdir_stream = 1;
+			break;
+		case OPT_LOWLEVEL:
+			lowlevel = 1;
+			break;
+		case OPT_READAHEAD_MAX:
+			readahead_max = strtoul(optarg, NULL, 10);
+			break;
+		case OPT_WRITEBACK:
+			writeback = 1;
+			if (optarg) {
+				writeback_max_inflight = atoi(optarg);
+				if (writeback_max_inflight < 1) {
+					writeback_max_inflight = 1;
+				}
+			}
+			break;
+		case OPT_ADAPTIVE_IO:
+			adaptive_io = 1;
+			break;
+		case OPT_SCHED_BULK_BYTES:
+			sched_bulk_bytes = strtoul(optarg, NULL, 10);
+			break;
+		case OPT_SCHED_PER_UID:
+			sched_per_uid = 1;
+			break;
+		case OPT_SINGLE_FLIGHT:
+			single_flight = 1;
+			break;
+		case OPT_PREFETCH_MAX:
+			prefetch_max = atoi(optarg);
+			break;
+		case OPT_CACHE_DIR:
+			free(disk_cache_dir);
+			disk_cache_dir = strdup(optarg);
+			break;
+		case OPT_CACHE_SIZE:
+			disk_cache_size = strtoull(optarg, NULL, 10);
+			break;
+		case OPT_CACHE_BLOCK_SIZE:
+			disk_cache_block_size = strtoul(optarg, NULL, 10);
+			break;
+		case OPT_NEGATIVE_CACHE_TTL:
+			negative_cache_ttl = atof(optarg);
+			break;
+		case OPT_LOG_LEVEL:
+			log_level = atoi(optarg);
+			break;
+		case OPT_TRACE_FILE:
+			trace_file = strdup(optarg);
+			break;
+		case OPT_USER_CONNECTIONS:
+			num_user_conns = atoi(optarg);
+			if (num_user_conns < 0) {
+				num_user_conns = 0;
+			}
+			break;
+		case OPT_OPEN_CACHE_MAX:
+			open_cache_max = atoi(optarg);
+			break;
+		case OPT_OPEN_CACHE_TIMEOUT:
+			open_cache_timeout = atof(optarg);
+			break;
+		case OPT_STATFS_CACHE_TTL:
+			statfs_cache_ttl = atof(optarg);
+			break;
 		}
 	}
 
@@ -1181,54 +8285,152 @@ int main(int argc, char *argv[])
 		fuse_nfs_argv[fuse_nfs_argc++] = fuse_subtype_arg;
 	}
 
-	if (!strstr(fuse_max_write_arg, "-omax_write="))
-	{
-		snprintf(fuse_max_write_arg, sizeof(fuse_max_write_arg), "-omax_write=%s", "32768");
-		fuse_nfs_argv[fuse_nfs_argc++] = fuse_max_write_arg;
-	}
-
 	/* Only for compatibility with previous version */
 	if (fuse_default_permissions){fuse_nfs_argv[fuse_nfs_argc++] = "-odefault_permissions";}
 	if (!fuse_multithreads){fuse_nfs_argv[fuse_nfs_argc++] = "-s";}
 
-	nfs = nfs_init_context();
-	if (nfs == NULL) {
-		fprintf(stderr, "Failed to init context\n");
-		ret = 10;
-		goto finished;
-	}
+	if (lowlevel) {
+		const char *opt = ll_highlevel_opt(fuse_nfs_argc, fuse_nfs_argv);
 
-	urls = nfs_parse_url_dir(nfs, url);
-	if (urls == NULL) {
-		fprintf(stderr, "Failed to parse url : %s\n", nfs_get_error(nfs));
+		if (opt != NULL) {
+			fprintf(stderr, "%s is not supported with --lowlevel\n", opt);
+			ret = 10;
+			goto finished;
+		}
+		/* The low-level frontend picks connections by inode */
+		num_user_conns = 0;
+	}
+	conns = calloc(num_conns + num_user_conns, sizeof(struct nfs_conn));
+	user_conns = calloc(num_user_conns + 1, sizeof(struct user_conn));
+	if (conns == NULL || user_conns == NULL) {
+		fprintf(stderr, "Failed to allocate connections\n");
 		ret = 10;
 		goto finished;
 	}
 
-	if (idstr = strstr(url, "uid=")) { custom_uid = atoi(&idstr[4]); }
-	if (idstr = strstr(url, "gid=")) { custom_gid = atoi(&idstr[4]); }
-
 	#ifdef WIN32
 	WSADATA wsaData;
 	WSAStartup(MAKEWORD(2,2),&wsaData);
 	#endif
 
-	ret = nfs_mount(nfs, urls->server, urls->path);
-	if (ret != 0) {
-		fprintf(stderr, "Failed to mount nfs share : %s\n", nfs_get_error(nfs));
+	for (n = 0; n < num_conns + num_user_conns; n++) {
+		struct nfs_conn *conn = &conns[n];
+		struct nfs_url *conn_urls;
+
+		pthread_mutex_init(&conn->mutex, NULL);
+		conn->wakeup_fd[0] = conn->wakeup_fd[1] = -1;
+
+		conn->nfs = nfs_init_context();
+		if (conn->nfs == NULL) {
+			fprintf(stderr, "Failed to init context\n");
+			ret = 10;
+			goto finished;
+		}
+
+		/* The url arguments are applied to the context they are
+		 * parsed with, so every connection parses its own copy.
+		 */
+		conn_urls = nfs_parse_url_dir(conn->nfs, url);
+		if (conn_urls == NULL) {
+			fprintf(stderr, "Failed to parse url : %s\n", nfs_get_error(conn->nfs));
+			ret = 10;
+			goto finished;
+		}
+
+		ret = nfs_mount(conn->nfs, conn_urls->server, conn_urls->path);
+		if (ret != 0) {
+			fprintf(stderr, "Failed to mount nfs share : %s\n", nfs_get_error(conn->nfs));
+			nfs_destroy_url(conn_urls);
+			goto finished;
+		}
+
+		if (urls == NULL) {
+			urls = conn_urls;
+		} else {
+			nfs_destroy_url(conn_urls);
+		}
+	}
+
+	/* Let FUSE send requests as large as the server takes them. libnfs
+	 * has the rtmax and wtmax from FSINFO, capped to what it supports.
+	 */
+	readmax = nfs_get_readmax(conns[0].nfs);
+	writemax = nfs_get_writemax(conns[0].nfs);
+	LOG("Server transfer sizes: read %zu write %zu\n", readmax, writemax);
+	if (!strstr(fuse_max_write_arg, "-omax_write="))
+	{
+		snprintf(fuse_max_write_arg, sizeof(fuse_max_write_arg), "-omax_write=%zu", writemax);
+		fuse_nfs_argv[fuse_nfs_argc++] = fuse_max_write_arg;
+	}
+	if (!strstr(fuse_max_read_arg, "-omax_read="))
+	{
+		snprintf(fuse_max_read_arg, sizeof(fuse_max_read_arg), "-omax_read=%zu", readmax);
+		fuse_nfs_argv[fuse_nfs_argc++] = fuse_max_read_arg;
+	}
+	if (!strstr(fuse_max_readahead_arg, "-omax_readahead="))
+	{
+		snprintf(fuse_max_readahead_arg, sizeof(fuse_max_readahead_arg), "-omax_readahead=%zu", readmax);
+		fuse_nfs_argv[fuse_nfs_argc++] = fuse_max_readahead_arg;
+	}
+	/* FUSE 2 splits writes into pages without it, whatever max_write says */
+	fuse_nfs_argv[fuse_nfs_argc++] = "-obig_writes";
+	if (adaptive_io) {
+		io_tune_init(IO_TUNE_READ, readmax);
+		io_tune_init(IO_TUNE_WRITE, writemax);
+	}
+
+	attr_cache_init();
+	if (disk_cache_init() != 0) {
+		fprintf(stderr, "Failed to set up the disk cache in %s : %s\n",
+			disk_cache_dir, strerror(errno));
+		ret = 10;
+		goto finished;
+	}
+	if (trace_file && trace_open() != 0) {
+		fprintf(stderr, "Failed to open the trace file %s : %s\n",
+			trace_file, strerror(errno));
+		ret = 10;
 		goto finished;
 	}
 
+	if (idstr = strstr(url, "uid=")) { custom_uid = atoi(&idstr[4]); }
+	if (idstr = strstr(url, "gid=")) { custom_gid = atoi(&idstr[4]); }
+	if ((idstr = strstr(url, "version=")) != NULL) { nfs_version = atoi(&idstr[8]); }
+	if (nfs_version != 3) {
+		writeback = 0;
+		open_cache_max = 0;
+	}
+
 	fuse_nfs_argv[1] = mnt;
 
+	if (lowlevel) {
+		if (nfs_version != 3) {
+			fprintf(stderr, "--lowlevel needs NFSv3\n");
+			ret = 10;
+			goto finished;
+		}
+		LOG("Starting fuse_nfs_ll_main()\n");
+		ret = fuse_nfs_ll_main(fuse_nfs_argc, fuse_nfs_argv);
+		goto finished;
+	}
+
 	LOG("Starting fuse_main()\n");
 	ret = fuse_main(fuse_nfs_argc, fuse_nfs_argv, &nfs_oper, NULL);
 
 finished:
+	if (logfile) {
+		log_flush();
+	}
+	trace_close();
+	free(trace_file);
 	nfs_destroy_url(urls);
-	if (nfs != NULL) {
-		nfs_destroy_context(nfs);
+	for (n = 0; conns != NULL && n < num_conns + num_user_conns; n++) {
+		if (conns[n].nfs != NULL) {
+			nfs_destroy_context(conns[n].nfs);
+		}
 	}
+	free(conns);
+	free(user_conns);
 	free(url);
 	free(mnt);
 	return ret;